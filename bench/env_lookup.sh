@@ -0,0 +1,52 @@
+#!/bin/sh
+#
+# Measure global symbol lookup latency with 10k globals defined
+#
+# Two scripts are generated which both define the globals and then call a
+# function many times. In one, the function body lists randomly chosen
+# globals, so every call looks each of them up. In the other, the body lists
+# plain numbers. The difference in run time is the cost of the lookups.
+#
+# Usage: bench/env_lookup.sh [path/to/santoku]
+
+SANTOKU=${1:-build/santoku}
+GLOBALS=10000
+PER_CALL=1000
+CALLS=10000
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+gen() {
+    awk -v globals=$GLOBALS -v per_call=$PER_CALL -v calls=$CALLS \
+        -v prefix="$1" 'BEGIN {
+        srand(1)
+        for (i = 0; i < globals; i++) { printf "(def {g%d} %d)\n", i, i }
+        printf "(def {look} (\\ {_} {== {} (list"
+        for (i = 0; i < per_call; i++) {
+            printf " %s%d", prefix, int(rand() * globals)
+        }
+        printf ")}))\n"
+        for (i = 0; i < calls; i++) { printf "(look 0)\n" }
+    }'
+}
+
+gen "g" > "$TMP/lookup.lspy"
+gen "" > "$TMP/numbers.lspy"
+
+now() { date +%s%N; }
+
+start=$(now)
+"$SANTOKU" "$TMP/numbers.lspy" > /dev/null
+mid=$(now)
+"$SANTOKU" "$TMP/lookup.lspy" > /dev/null
+end=$(now)
+
+lookups=$((PER_CALL * CALLS))
+base=$((mid - start))
+total=$((end - mid))
+echo "globals:    $GLOBALS"
+echo "lookups:    $lookups"
+echo "baseline:   $((base / 1000000)) ms"
+echo "total:      $((total / 1000000)) ms"
+echo "per lookup: $(( (total - base) / lookups )) ns"
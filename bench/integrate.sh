@@ -0,0 +1,46 @@
+#!/bin/sh
+#
+# Measure a numeric integration loop with doubles and with fixed point
+#
+# Both scripts integrate x * x over [0, 1] with the midpoint rule, taking
+# STEPS steps in a tail recursive function. One does the arithmetic with
+# doubles, and the other emulates them with integers scaled by SCALE, as
+# scripts had to before there were doubles. Each prints its result, which
+# should be close to 1/3, or SCALE/3 in fixed point.
+#
+# Usage: bench/integrate.sh [path/to/santoku]
+
+SANTOKU=${1:-build/santoku}
+STEPS=1000000
+SCALE=1000000000
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+cat > "$TMP/double.lspy" <<EOF
+(def {step} (\\ {i n h acc} {
+    if (== i n) {acc} {
+        step (+ i 1) n h
+            (+ acc (* h (* (* (+ i 0.5) h) (* (+ i 0.5) h))))}}))
+(step 0 $STEPS (/ 1.0 $STEPS) 0.0)
+EOF
+
+cat > "$TMP/fixed.lspy" <<EOF
+(def {step} (\\ {i n h acc} {
+    if (== i n) {acc} {
+        step (+ i 1) n h
+            (+ acc (/ (* h (/ (* (+ (* i h) (/ h 2)) (+ (* i h) (/ h 2)))
+                $SCALE)) $SCALE))}}))
+(step 0 $STEPS (/ $SCALE $STEPS) 0)
+EOF
+
+now() { date +%s%N; }
+
+for kind in double fixed; do
+    start=$(now)
+    result=$("$SANTOKU" "$TMP/$kind.lspy" | tail -n 1)
+    end=$(now)
+    total=$((end - start))
+    printf "%-8s %8d ms %6d ns/step   result %s\n" $kind \
+        $((total / 1000000)) $((total / STEPS)) "$result"
+done
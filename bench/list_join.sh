@@ -0,0 +1,36 @@
+#!/bin/sh
+#
+# Measure building a list by joining one element at a time
+#
+# For each size, a script is generated which appends that many numbers to an
+# empty list with a tail recursive function, then derives a second version
+# of the list by prepending to it. Once lists are long enough to be held in
+# trees, each join is O(log n), so the time per element grows only slowly as
+# the list grows.
+#
+# Usage: bench/list_join.sh [path/to/santoku]
+
+SANTOKU=${1:-build/santoku}
+SIZES="25000 50000 100000 200000"
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+now() { date +%s%N; }
+
+echo "elements   total ms   ns/element"
+for n in $SIZES; do
+    cat > "$TMP/join.lspy" <<EOF
+(def {up} (\\ {i n l} {if (== i n) {l} {up (+ i 1) n (join l (list i))}}))
+(def {xs} (up 0 $n {}))
+(def {ys} (join {-1} xs))
+(== xs ys)
+EOF
+
+    start=$(now)
+    "$SANTOKU" "$TMP/join.lspy" > /dev/null
+    end=$(now)
+
+    total=$((end - start))
+    printf "%8d %10d %12d\n" $n $((total / 1000000)) $((total / n))
+done
@@ -0,0 +1,46 @@
+#!/bin/sh
+#
+# Measure recursive list processing, which walks a list with head and tail
+#
+# For each size, a script is generated which defines a list of that many
+# numbers and sums it with a tail recursive function. Building the list from
+# a literal costs the same in both scripts, so the script is also run with
+# the sum replaced by a constant time comparison, and only the difference is
+# reported. With O(1) head and tail the time per element stays flat as the
+# list grows.
+#
+# Usage: bench/list_sum.sh [path/to/santoku]
+
+SANTOKU=${1:-build/santoku}
+SIZES="250000 500000 1000000"
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+gen() {
+    awk -v n=$1 -v body="$2" 'BEGIN {
+        printf "(def {sum} (\\ {l acc} {if (== l {}) {acc} "
+        printf "{sum (tail l) (+ acc (eval (head l)))}}))\n"
+        printf "(def {xs} {"
+        for (i = 1; i <= n; i++) { printf " %d", i }
+        printf "})\n"
+        printf "%s\n", body
+    }'
+}
+
+now() { date +%s%N; }
+
+echo "elements   total ms   ns/element"
+for n in $SIZES; do
+    gen $n "(sum xs 0)" > "$TMP/sum.lspy"
+    gen $n "(== xs {})" > "$TMP/base.lspy"
+
+    start=$(now)
+    "$SANTOKU" "$TMP/base.lspy" > /dev/null
+    mid=$(now)
+    "$SANTOKU" "$TMP/sum.lspy" > /dev/null
+    end=$(now)
+
+    total=$(( (end - mid) - (mid - start) ))
+    printf "%8d %10d %12d\n" $n $((total / 1000000)) $((total / n))
+done
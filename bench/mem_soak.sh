@@ -0,0 +1,78 @@
+#!/bin/sh
+#
+# Check that repeating the same work doesn't grow the heap
+#
+# A script runs a workload which makes strings, lists, closures and global
+# bindings ITERATIONS times, in CHUNKS top level loops. After each loop it
+# prints (mem-stats {}), and every line after the first must be the same, or
+# something is leaking. The resident set size of the process is sampled while
+# it runs, where /proc is available, and should level off once the pools
+# have warmed up.
+#
+# Usage: bench/mem_soak.sh [path/to/santoku]
+
+SANTOKU=${1:-build/santoku}
+ITERATIONS=1000000
+CHUNKS=10
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+per_chunk=$((ITERATIONS / CHUNKS))
+{
+    cat <<EOF
+(def {work} (\\ {i} {
+    def {last} (join (list i "step") (map (\\ {x} {+ x i}) {1 2 3}))}))
+(def {loop} (\\ {i n} {
+    if (== i n) {i} {if (== (work i) ()) {loop (+ i 1) n} {i}}}))
+EOF
+    for c in $(seq 1 $CHUNKS); do
+        echo "(loop 0 $per_chunk)"
+        echo "(mem-stats {})"
+    done
+} > "$TMP/soak.lspy"
+
+now() { date +%s%N; }
+
+start=$(now)
+"$SANTOKU" "$TMP/soak.lspy" > "$TMP/out" &
+pid=$!
+: > "$TMP/rss"
+while kill -0 $pid 2> /dev/null; do
+    if [ -r /proc/$pid/status ]; then
+        awk '/^VmRSS/ { print $2 }' /proc/$pid/status >> "$TMP/rss"
+    fi
+    sleep 0.2
+done
+wait $pid
+status=$?
+end=$(now)
+
+if [ $status -ne 0 ]; then
+    echo "santoku exited with status $status"
+    exit 1
+fi
+
+total=$((end - start))
+printf "%d iterations in %d ms, %d ns/iteration\n" $ITERATIONS \
+    $((total / 1000000)) $((total / ITERATIONS))
+
+if [ -s "$TMP/rss" ]; then
+    awk 'NR == 1 { first = $1 } $1 > peak { peak = $1 } { last = $1 }
+        END { printf "rss kB: first %d, last %d, peak %d\n",
+            first, last, peak }' "$TMP/rss"
+fi
+
+if grep -q '^Error' "$TMP/out"; then
+    grep '^Error' "$TMP/out"
+    exit 1
+fi
+
+grep '^{lval' "$TMP/out" > "$TMP/stats"
+echo "live after each chunk:"
+cat "$TMP/stats"
+if [ "$(tail -n +2 "$TMP/stats" | sort -u | wc -l)" -ne 1 ]; then
+    echo "FAIL: live objects grew"
+    exit 1
+fi
+echo "ok: live objects stayed flat"
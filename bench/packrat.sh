@@ -0,0 +1,86 @@
+#!/bin/sh
+#
+# Measure parsing with a grammar whose alternatives share prefixes
+#
+# Every alternative of expr starts with a term, and every alternative of term
+# with a factor, so without memoization each level of parentheses makes mpc
+# parse the level inside it nine times. The input is COUNT expressions, each
+# nested DEPTH parentheses deep, so plain backtracking takes time exponential
+# in DEPTH. With MPCA_LANG_PACKRAT each rule is parsed at most once at each
+# position, and the time grows linearly with COUNT.
+#
+# Usage: bench/packrat.sh [count ...]
+
+COUNTS=${*:-"1 2 4 100 1000 10000"}
+DEPTH=${DEPTH:-5}
+CC=${CC:-cc}
+SRC=$(cd "$(dirname "$0")/../src" && pwd)
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+cat > "$TMP/packrat.c" <<EOF
+#include "mpc.h"
+#include <time.h>
+
+int main(int argc, char **argv) {
+  int flags = atoi(argv[1]), depth = atoi(argv[2]), count = atoi(argv[3]);
+  char *input = malloc((size_t)count * (depth * 2 + 2) + 1);
+  int n, i, j;
+  mpc_parser_t *Expr = mpc_new("expr");
+  mpc_parser_t *Term = mpc_new("term");
+  mpc_parser_t *Factor = mpc_new("factor");
+  mpc_parser_t *Top = mpc_new("top");
+  mpc_result_t r;
+  clock_t start;
+  int ok;
+
+  mpca_lang(flags,
+    "expr   : <term> '+' <expr> | <term> '-' <expr> | <term> ;"
+    "term   : <factor> '*' <term> | <factor> '/' <term> | <factor> ;"
+    "factor : /[0-9]+/ | '(' <expr> ')' ;"
+    "top    : /^/ <expr> (';' <expr>)* /\$/ ;",
+    Expr, Term, Factor, Top, NULL);
+
+  /* ((...(1)...));((...(1)...));... */
+  n = 0;
+  for (j = 0; j < count; j++) {
+    if (j > 0) { input[n++] = ';'; }
+    for (i = 0; i < depth; i++) { input[n++] = '('; }
+    input[n++] = '1';
+    for (i = 0; i < depth; i++) { input[n++] = ')'; }
+  }
+  input[n] = '\0';
+
+  start = clock();
+  ok = mpc_parse("<bench>", input, Top, &r);
+  printf("%ld\n", (long)((clock() - start) * 1000000 / CLOCKS_PER_SEC));
+  if (ok) { mpc_ast_delete(r.output); } else { mpc_err_delete(r.error); }
+
+  mpc_cleanup(4, Expr, Term, Factor, Top);
+  free(input);
+  return !ok;
+}
+EOF
+
+"$CC" -O2 -I"$SRC" "$TMP/packrat.c" "$SRC/mpc.c" -lm -o "$TMP/packrat" || exit 1
+
+# Skip plain backtracking once a parse would take longer than this
+LIMIT_US=5000000
+
+echo "depth $DEPTH"
+echo "   count   backtracking us   packrat us   packrat ns/byte"
+plain=0
+last=1
+for count in $COUNTS; do
+    if [ "$plain" != "-" ] && [ $((plain / last * count)) -lt $LIMIT_US ]; then
+        plain=$("$TMP/packrat" 0 $DEPTH $count) || exit 1
+        last=$count
+    else
+        plain="-"
+    fi
+    packrat=$("$TMP/packrat" 4 $DEPTH $count) || exit 1
+    bytes=$((count * (DEPTH * 2 + 2)))
+    printf "%8d %17s %12s %17d\n" $count "$plain" "$packrat" \
+        $((packrat * 1000 / bytes))
+done
@@ -0,0 +1,41 @@
+#!/bin/sh
+#
+# Measure parsing source files of increasing size
+#
+# Each file defines one long q-expression of rows of numbers, strings and
+# symbols, so almost all of the time goes on parsing rather than evaluation.
+# Parsing should be linear in the size of the file, so the time per byte
+# should stay about the same as the files grow.
+#
+# Usage: bench/parse_file.sh [path/to/santoku]
+#
+# Set SIZES to a list of sizes in megabytes to try other sizes.
+
+SANTOKU=${1:-build/santoku}
+SIZES=${SIZES:-"1 2 4 8"}
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+now() { date +%s%N; }
+
+echo "      MB   total ms   ns/byte"
+for mb in $SIZES; do
+    awk -v bytes=$((mb * 1048576)) 'BEGIN {
+        print "(def {data} {"
+        for (n = 0; n < bytes; i++) {
+            line = sprintf("  {%d \"row %d\" 2.5 abc}", i, i)
+            print line
+            n += length(line) + 1
+        }
+        print "})"
+    }' > "$TMP/data.lspy"
+    size=$(wc -c < "$TMP/data.lspy")
+
+    start=$(now)
+    "$SANTOKU" "$TMP/data.lspy" > /dev/null
+    end=$(now)
+
+    total=$((end - start))
+    printf "%8d %10d %9d\n" $mb $((total / 1000000)) $((total / size))
+done
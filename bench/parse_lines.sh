@@ -0,0 +1,73 @@
+#!/bin/sh
+#
+# Measure parsing many short inputs, as the REPL does
+#
+# LINES short lines of the santoku grammar are parsed one at a time, first
+# with mpc_parse, which sets up a new input for every line, and then with
+# mpc_context_parse, which reuses one input and its memory pool. The pool
+# statistics of the context show how many of the parser's allocations were
+# served by the pool rather than by malloc.
+#
+# Usage: bench/parse_lines.sh [lines]
+
+LINES=${1:-200000}
+CC=${CC:-cc}
+SRC=$(cd "$(dirname "$0")/../src" && pwd)
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+cat > "$TMP/lines.c" <<EOF
+#include "mpc.h"
+#include <time.h>
+
+int main(int argc, char **argv) {
+  int lines = atoi(argv[1]), i, ok = 1, pass;
+  char line[64];
+  mpc_parser_t *Number = mpc_new("number");
+  mpc_parser_t *Symbol = mpc_new("symbol");
+  mpc_parser_t *String = mpc_new("string");
+  mpc_parser_t *Sexpr = mpc_new("sexpr");
+  mpc_parser_t *Qexpr = mpc_new("qexpr");
+  mpc_parser_t *Expr = mpc_new("expr");
+  mpc_parser_t *Lispy = mpc_new("lispy");
+  mpc_context_t *c = mpc_context_new();
+  mpc_mem_stats_t s;
+  mpc_result_t r;
+  clock_t start;
+
+  mpca_lang(MPCA_LANG_DEFAULT,
+    "number : /-?[0-9]+/ ;"
+    "symbol : /[a-zA-Z0-9_+\\\\-*\\\\/\\\\\\\\=<>!&]+/ ;"
+    "string : /\"(\\\\\\\\.|[^\"])*\"/ ;"
+    "sexpr  : '(' <expr>* ')' ;"
+    "qexpr  : '{' <expr>* '}' ;"
+    "expr   : <number> | <symbol> | <string> | <sexpr> | <qexpr> ;"
+    "lispy  : /^/ <expr>* /\$/ ;",
+    Number, Symbol, String, Sexpr, Qexpr, Expr, Lispy, NULL);
+
+  for (pass = 0; pass < 2; pass++) {
+    start = clock();
+    for (i = 0; i < lines && ok; i++) {
+      sprintf(line, "(def {x%d} (join {%d \"s\"} (list x %d)))", i, i, -i);
+      ok = pass == 0
+        ? mpc_parse("<stdin>", line, Lispy, &r)
+        : mpc_context_parse(c, "<stdin>", line, Lispy, &r);
+      if (ok) { mpc_ast_delete(r.output); } else { mpc_err_print(r.error); }
+    }
+    printf("%-16s %8ld ns/line\n", pass == 0 ? "mpc_parse" : "mpc_context_parse",
+      (long)((double)(clock() - start) * 1e9 / CLOCKS_PER_SEC / lines));
+  }
+
+  mpc_context_stats(c, &s);
+  printf("pool: %lu parses, %lu pooled, %lu fallback, %lu large\n",
+    s.parses, s.pooled, s.fallback, s.large);
+
+  mpc_context_delete(c);
+  mpc_cleanup(7, Number, Symbol, String, Sexpr, Qexpr, Expr, Lispy);
+  return !ok;
+}
+EOF
+
+"$CC" -O2 -I"$SRC" "$TMP/lines.c" "$SRC/mpc.c" -lm -o "$TMP/lines" || exit 1
+"$TMP/lines" $LINES
@@ -0,0 +1,86 @@
+#!/bin/sh
+#
+# Compare the recursive parser with the parser VM
+#
+# A santoku-like grammar is used to parse two kinds of input: ROWS rows of
+# numbers, strings and symbols in one q-expression, and a single number
+# nested inside DEPTH pairs of parentheses. Each is parsed by the grammar as
+# defined, which mpc_parse_run runs by recursion on the C stack, and by the
+# same grammar compiled with mpc_compile. The recursive parser runs out of
+# stack on deeply nested input, which is shown as "crashed".
+#
+# Usage: bench/parse_vm.sh [depth ...]
+
+DEPTHS=${*:-"1000 10000 100000"}
+ROWS=${ROWS:-100000}
+CC=${CC:-cc}
+SRC=$(cd "$(dirname "$0")/../src" && pwd)
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+cat > "$TMP/vm.c" <<EOF
+#include "mpc.h"
+#include <time.h>
+
+int main(int argc, char **argv) {
+  int vm = atoi(argv[1]), depth = atoi(argv[2]), rows = atoi(argv[3]);
+  char *input = malloc((size_t)depth * 2 + (size_t)rows * 40 + 16);
+  int n = 0, j, ok;
+  mpc_parser_t *Number = mpc_new("number");
+  mpc_parser_t *Symbol = mpc_new("symbol");
+  mpc_parser_t *String = mpc_new("string");
+  mpc_parser_t *Sexpr = mpc_new("sexpr");
+  mpc_parser_t *Qexpr = mpc_new("qexpr");
+  mpc_parser_t *Expr = mpc_new("expr");
+  mpc_parser_t *Lispy = mpc_new("lispy");
+  mpc_parser_t *p;
+  mpc_result_t r;
+  clock_t start;
+
+  mpca_lang(MPCA_LANG_DEFAULT,
+    "number : /-?[0-9]+/ ;"
+    "symbol : /[a-zA-Z0-9_+\\\\-*\\\\/\\\\\\\\=<>!&]+/ ;"
+    "string : /\"(\\\\\\\\.|[^\"])*\"/ ;"
+    "sexpr  : '(' <expr>* ')' ;"
+    "qexpr  : '{' <expr>* '}' ;"
+    "expr   : <number> | <symbol> | <string> | <sexpr> | <qexpr> ;"
+    "lispy  : /^/ <expr>* /\$/ ;",
+    Number, Symbol, String, Sexpr, Qexpr, Expr, Lispy, NULL);
+  p = vm ? mpc_compile(Lispy) : Lispy;
+
+  if (rows > 0) {
+    input[n++] = '{';
+    for (j = 0; j < rows; j++) {
+      n += sprintf(input + n, " {%d \"row %d\" abc}", j, j);
+    }
+    input[n++] = '}';
+  } else {
+    for (j = 0; j < depth; j++) { input[n++] = '('; }
+    input[n++] = '1';
+    for (j = 0; j < depth; j++) { input[n++] = ')'; }
+  }
+  input[n] = '\0';
+
+  start = clock();
+  ok = mpc_parse("<bench>", input, p, &r);
+  printf("%ld\n", (long)((double)(clock() - start) * 1e9 / CLOCKS_PER_SEC / n));
+  if (ok) { mpc_ast_delete(r.output); } else { mpc_err_delete(r.error); }
+
+  if (vm) { mpc_delete(p); }
+  mpc_cleanup(7, Number, Symbol, String, Sexpr, Qexpr, Expr, Lispy);
+  free(input);
+  return !ok;
+}
+EOF
+
+"$CC" -O2 -I"$SRC" "$TMP/vm.c" "$SRC/mpc.c" -lm -o "$TMP/vm" || exit 1
+
+run() { "$TMP/vm" "$@" 2> /dev/null || echo crashed; }
+
+echo "input              recursive ns/byte   vm ns/byte"
+printf "%-18s %19s %12s\n" "$ROWS rows" "$(run 0 0 $ROWS)" "$(run 1 0 $ROWS)"
+for depth in $DEPTHS; do
+    printf "%-18s %19s %12s\n" "depth $depth" "$(run 0 $depth 0)" \
+        "$(run 1 $depth 0)"
+done
@@ -0,0 +1,52 @@
+#!/bin/sh
+#
+# Measure the vector builtins with each set of kernels
+#
+# A script is generated which builds a vector of 100000 numbers, small enough
+# to stay in cache, then applies one builtin to it REPEAT times, comparing each
+# result with 0 so that it isn't printed. Building the vector costs the same
+# for every builtin, so a script which only builds it is also run and its time
+# subtracted.
+# bench/list_sum.sh does the work of vsum with q-expressions.
+#
+# Usage: bench/vec_ops.sh [path/to/santoku]
+
+SANTOKU=${1:-build/santoku}
+N=100000
+REPEAT=5000
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+gen() {
+    awk -v n=$N -v repeat=$REPEAT -v body="$1" 'BEGIN {
+        printf "(def {v} (vec {"
+        for (i = 1; i <= n; i++) { printf " %d", i }
+        printf "}))\n"
+        for (i = 0; i < repeat; i++) { printf "%s\n", body }
+    }'
+}
+
+now() { date +%s%N; }
+
+# Nanoseconds taken to run a script
+run() {
+    start=$(now)
+    "$SANTOKU" --simd=$1 "$2" > /dev/null || exit 1
+    end=$(now)
+    echo $((end - start))
+}
+
+gen "" > "$TMP/base.lspy"
+for simd in c sse2 avx2; do
+    "$SANTOKU" --simd=$simd "$TMP/base.lspy" > /dev/null 2>&1 || continue
+    base=$(run $simd "$TMP/base.lspy")
+    echo "$simd"
+    for op in "vsum v" "vmax v" "vdot v v" "v+ v v" "v* v 3" \
+            "vfilter-gt v 500000"; do
+        gen "(== ($op) 0)" > "$TMP/op.lspy"
+        total=$(( $(run $simd "$TMP/op.lspy") - base ))
+        printf "  %-22s %8d ps/element\n" "($op)" \
+            $((total * 1000 / (N * REPEAT)))
+    done
+done
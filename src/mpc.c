@@ -1,5 +1,13 @@
 #include "mpc.h"
 
+#if defined(__unix__) || defined(__APPLE__)
+#define MPC_USE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 /*
 ** State Type
 */
@@ -25,13 +33,21 @@ static mpc_state_t mpc_state_new(void) {
 */
 
 /*
-** In mpc the input type has three modes of 
-** operation: String, File and Pipe.
+** In mpc the input type has four modes of 
+** operation: String, Mmap, File and Pipe.
+**
+** String is easy. The caller's buffer is
+** scanned through in place, without being
+** copied, and its length is found once up
+** front. The cursor can jump around at will
+** making backtracking easy.
 **
-** String is easy. The whole contents are 
-** loaded into a buffer and scanned through.
-** The cursor can jump around at will making 
-** backtracking easy.
+** Mmap is the same as String, but the buffer
+** is a file mapped into memory. This is how
+** `mpc_parse_contents` reads files on systems
+** which support it, so they are parsed at the
+** speed of a string rather than a seek per
+** character.
 **
 ** The second is a File which is also somewhat
 ** easy. The contents are never loaded into 
@@ -53,26 +69,54 @@ static mpc_state_t mpc_state_new(void) {
 ** backtracking and make LL(1) grammars easy
 ** to parse for all input methods.
 **
+** Parsers wrapped with `mpc_packrat` remember
+** their results at each position of String
+** and Mmap inputs, so backtracking into them
+** again costs a lookup rather than a reparse.
+** These results are kept in a fixed size table
+** on the input, where each entry is replaced
+** by later ones which hash to the same slot.
+** The parse moves steadily forward, so the
+** table holds a window of recent positions.
+**
 */
 
 enum {
   MPC_INPUT_STRING = 0,
   MPC_INPUT_FILE   = 1,
-  MPC_INPUT_PIPE   = 2
+  MPC_INPUT_PIPE   = 2,
+  MPC_INPUT_MMAP   = 3
 };
 
 enum {
-  MPC_INPUT_MARKS_MIN = 32
+  MPC_INPUT_MARKS_MIN = 32,
+  MPC_INPUT_BUFFER_MIN = 64
 };
 
 enum {
   MPC_INPUT_MEM_NUM = 512
 };
 
-typedef struct {
+enum {
+  MPC_INPUT_MEMO_NUM = 4096
+};
+
+/*
+** Small allocations made while parsing come from
+** a pool of blocks inside the input. Blocks which
+** have been freed are kept in a list threaded
+** through the blocks themselves, and blocks past
+** `mem_top` have never been used, so both taking
+** a block and resetting the pool are constant time.
+*/
+
+typedef union mpc_mem_t {
   char mem[64];
+  union mpc_mem_t *next;
 } mpc_mem_t;
 
+struct mpc_memo_t;
+
 typedef struct {
 
   int type;
@@ -80,7 +124,10 @@ typedef struct {
   mpc_state_t state;
   
   char *string;
+  size_t length;
   char *buffer;
+  size_t buffer_len;
+  size_t buffer_slots;
   FILE *file;
   
   int suppress;
@@ -92,8 +139,14 @@ typedef struct {
   char *lasts;
   char last;
   
-  size_t mem_index;
-  char mem_full[MPC_INPUT_MEM_NUM];
+  struct mpc_memo_t *memo;
+  
+  int dfa_used;
+  int dfa_off;
+  
+  mpc_mem_stats_t mem_stats;
+  mpc_mem_t *mem_free;
+  size_t mem_top;
   mpc_mem_t mem[MPC_INPUT_MEM_NUM];
   
 } mpc_input_t;
@@ -108,8 +161,8 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   
   i->state = mpc_state_new();
   
-  i->string = malloc(strlen(string) + 1);
-  strcpy(i->string, string);
+  i->string = (char*)string;
+  i->length = strlen(string);
   i->buffer = NULL;
   i->file = NULL;
   
@@ -121,8 +174,14 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
   
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->memo = NULL;
+  
+  i->dfa_used = 0;
+  i->dfa_off = 0;
+  
+  memset(&i->mem_stats, 0, sizeof(mpc_mem_stats_t));
+  i->mem_free = NULL;
+  i->mem_top = 0;
   
   return i;
 }
@@ -137,9 +196,10 @@ static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *stri
   
   i->state = mpc_state_new();
   
-  i->string = malloc(length + 1);
-  strncpy(i->string, string, length);
-  i->string[length] = '\0';
+  /* Like a copy made with strncpy, the input stops at any null */
+  i->string = (char*)string;
+  i->length = memchr(string, '\0', length) ?
+    strlen(string) : length;
   i->buffer = NULL;
   i->file = NULL;
   
@@ -151,8 +211,14 @@ static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *stri
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
   
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->memo = NULL;
+  
+  i->dfa_used = 0;
+  i->dfa_off = 0;
+  
+  memset(&i->mem_stats, 0, sizeof(mpc_mem_stats_t));
+  i->mem_free = NULL;
+  i->mem_top = 0;
   
   return i;
 
@@ -169,6 +235,7 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->state = mpc_state_new();
   
   i->string = NULL;
+  i->length = 0;
   i->buffer = NULL;
   i->file = pipe;
   
@@ -180,8 +247,14 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
   
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->memo = NULL;
+  
+  i->dfa_used = 0;
+  i->dfa_off = 0;
+  
+  memset(&i->mem_stats, 0, sizeof(mpc_mem_stats_t));
+  i->mem_free = NULL;
+  i->mem_top = 0;
   
   return i;
   
@@ -197,6 +270,7 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->state = mpc_state_new();
   
   i->string = NULL;
+  i->length = 0;
   i->buffer = NULL;
   i->file = file;
   
@@ -208,24 +282,73 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
   
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->memo = NULL;
+  
+  i->dfa_used = 0;
+  i->dfa_off = 0;
+  
+  memset(&i->mem_stats, 0, sizeof(mpc_mem_stats_t));
+  i->mem_free = NULL;
+  i->mem_top = 0;
   
   return i;
 }
 
-static void mpc_input_delete(mpc_input_t *i) {
+static void mpc_memo_delete(mpc_input_t *i);
+
+/* Frees what belongs to the current parse only */
+static void mpc_input_release(mpc_input_t *i) {
   
-  free(i->filename);
+  mpc_memo_delete(i);
   
-  if (i->type == MPC_INPUT_STRING) { free(i->string); }
+#ifdef MPC_USE_MMAP
+  if (i->type == MPC_INPUT_MMAP) { munmap(i->string, i->length); }
+#endif
   if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
   
+  i->string = NULL;
+  i->length = 0;
+  i->buffer = NULL;
+  i->file = NULL;
+}
+
+static void mpc_input_delete(mpc_input_t *i) {
+  
+  mpc_input_release(i);
+  
+  free(i->filename);
   free(i->marks);
   free(i->lasts);
   free(i);
 }
 
+/*
+** Readies a released input for another parse,
+** keeping its marks and memory pool. Nothing
+** allocated from the pool outlives a parse, as
+** results are exported from it before returning.
+*/
+
+static void mpc_input_restart(mpc_input_t *i, int type, const char *filename) {
+  
+  i->filename = realloc(i->filename, strlen(filename) + 1);
+  strcpy(i->filename, filename);
+  i->type = type;
+  
+  i->state = mpc_state_new();
+  
+  i->suppress = 0;
+  i->backtrack = 1;
+  i->marks_num = 0;
+  i->last = '\0';
+  
+  i->dfa_used = 0;
+  i->dfa_off = 0;
+  
+  i->mem_free = NULL;
+  i->mem_top = 0;
+}
+
 static int mpc_mem_ptr(mpc_input_t *i, void *p) {
   return
     (char*)p >= (char*)(i->mem) &&
@@ -233,22 +356,26 @@ static int mpc_mem_ptr(mpc_input_t *i, void *p) {
 }
 
 static void *mpc_malloc(mpc_input_t *i, size_t n) {
-  size_t j;
-  char *p;
-  
-  if (n > sizeof(mpc_mem_t)) { return malloc(n); }
-  
-  j = i->mem_index;
-  do {
-    if (!i->mem_full[i->mem_index]) {
-      p = (void*)(i->mem + i->mem_index);
-      i->mem_full[i->mem_index] = 1;
-      i->mem_index = (i->mem_index+1) % MPC_INPUT_MEM_NUM;
-      return p;
-    }
-    i->mem_index = (i->mem_index+1) % MPC_INPUT_MEM_NUM;
-  } while (j != i->mem_index);
+  mpc_mem_t *p;
+  
+  if (n > sizeof(mpc_mem_t)) {
+    i->mem_stats.large++;
+    return malloc(n);
+  }
+  
+  if (i->mem_free) {
+    p = i->mem_free;
+    i->mem_free = p->next;
+    i->mem_stats.pooled++;
+    return p;
+  }
+  
+  if (i->mem_top < MPC_INPUT_MEM_NUM) {
+    i->mem_stats.pooled++;
+    return i->mem + i->mem_top++;
+  }
   
+  i->mem_stats.fallback++;
   return malloc(n);
 }
 
@@ -259,10 +386,10 @@ static void *mpc_calloc(mpc_input_t *i, size_t n, size_t m) {
 }
 
 static void mpc_free(mpc_input_t *i, void *p) {
-  size_t j;
+  mpc_mem_t *x = p;
   if (!mpc_mem_ptr(i, p)) { free(p); return; }
-  j = ((size_t)(((char*)p) - ((char*)i->mem))) / sizeof(mpc_mem_t);
-  i->mem_full[j] = 0;
+  x->next = i->mem_free;
+  i->mem_free = x;
 }
 
 static void *mpc_realloc(mpc_input_t *i, void *p, size_t n) {
@@ -312,7 +439,9 @@ static void mpc_input_mark(mpc_input_t *i) {
   i->lasts[i->marks_num-1] = i->last;
   
   if (i->type == MPC_INPUT_PIPE && i->marks_num == 1) {
-    i->buffer = calloc(1, 1);
+    i->buffer_len = 0;
+    i->buffer_slots = MPC_INPUT_BUFFER_MIN;
+    i->buffer = malloc(i->buffer_slots);
   }
   
 }
@@ -354,7 +483,7 @@ static void mpc_input_rewind(mpc_input_t *i) {
 }
 
 static int mpc_input_buffer_in_range(mpc_input_t *i) {
-  return i->state.pos < (long)(strlen(i->buffer) + i->marks[0].pos);
+  return i->state.pos < (long)(i->buffer_len + i->marks[0].pos);
 }
 
 static char mpc_input_buffer_get(mpc_input_t *i) {
@@ -362,7 +491,8 @@ static char mpc_input_buffer_get(mpc_input_t *i) {
 }
 
 static int mpc_input_terminated(mpc_input_t *i) {
-  if (i->type == MPC_INPUT_STRING && i->state.pos == (long)strlen(i->string)) { return 1; }
+  if ((i->type == MPC_INPUT_STRING || i->type == MPC_INPUT_MMAP)
+  &&  i->state.pos == (long)i->length) { return 1; }
   if (i->type == MPC_INPUT_FILE && feof(i->file)) { return 1; }
   if (i->type == MPC_INPUT_PIPE && feof(i->file)) { return 1; }
   return 0;
@@ -374,7 +504,9 @@ static char mpc_input_getc(mpc_input_t *i) {
   
   switch (i->type) {
     
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
+    case MPC_INPUT_STRING:
+    case MPC_INPUT_MMAP:
+      return i->state.pos < (long)i->length ? i->string[i->state.pos] : '\0';
     case MPC_INPUT_FILE: c = fgetc(i->file); return c;
     case MPC_INPUT_PIPE:
     
@@ -397,7 +529,9 @@ static char mpc_input_peekc(mpc_input_t *i) {
   char c = '\0';
   
   switch (i->type) {
-    case MPC_INPUT_STRING: return i->string[i->state.pos];
+    case MPC_INPUT_STRING:
+    case MPC_INPUT_MMAP:
+      return i->state.pos < (long)i->length ? i->string[i->state.pos] : '\0';
     case MPC_INPUT_FILE: 
       
       c = fgetc(i->file);
@@ -433,6 +567,7 @@ static int mpc_input_failure(mpc_input_t *i, char c) {
 
   switch (i->type) {
     case MPC_INPUT_STRING: { break; }
+    case MPC_INPUT_MMAP: { break; }
     case MPC_INPUT_FILE: fseek(i->file, -1, SEEK_CUR); { break; }
     case MPC_INPUT_PIPE: {
       
@@ -453,9 +588,11 @@ static int mpc_input_success(mpc_input_t *i, char c, char **o) {
   
   if (i->type == MPC_INPUT_PIPE
   &&  i->buffer && !mpc_input_buffer_in_range(i)) {
-    i->buffer = realloc(i->buffer, strlen(i->buffer) + 2);
-    i->buffer[strlen(i->buffer) + 1] = '\0';
-    i->buffer[strlen(i->buffer) + 0] = c;
+    if (i->buffer_len == i->buffer_slots) {
+      i->buffer_slots = i->buffer_slots * 2;
+      i->buffer = realloc(i->buffer, i->buffer_slots);
+    }
+    i->buffer[i->buffer_len++] = c;
   }
   
   i->last = c;
@@ -850,6 +987,39 @@ static mpc_err_t *mpc_err_merge(mpc_input_t *i, mpc_err_t *x, mpc_err_t *y) {
   return mpc_err_or(i, errs, 2);
 }
 
+/*
+** Copies are allocated with malloc rather than
+** from the input's memory, so that the packrat
+** table can hold them for a long time without
+** filling it up.
+*/
+
+static char *mpc_err_strdup(const char *s) {
+  char *x;
+  if (s == NULL) { return NULL; }
+  x = malloc(strlen(s) + 1);
+  strcpy(x, s);
+  return x;
+}
+
+static mpc_err_t *mpc_err_copy(mpc_err_t *x) {
+  int j;
+  mpc_err_t *y;
+  if (x == NULL) { return NULL; }
+  y = malloc(sizeof(mpc_err_t));
+  y->state = x->state;
+  y->expected_num = x->expected_num;
+  y->expected = x->expected_num ?
+    malloc(sizeof(char*) * x->expected_num) : NULL;
+  for (j = 0; j < x->expected_num; j++) {
+    y->expected[j] = mpc_err_strdup(x->expected[j]);
+  }
+  y->filename = mpc_err_strdup(x->filename);
+  y->failure = mpc_err_strdup(x->failure);
+  y->recieved = x->recieved;
+  return y;
+}
+
 /*
 ** Parser Type
 */
@@ -882,7 +1052,11 @@ enum {
   MPC_TYPE_COUNT     = 22,
   
   MPC_TYPE_OR        = 23,
-  MPC_TYPE_AND       = 24
+  MPC_TYPE_AND       = 24,
+  
+  MPC_TYPE_MEMO      = 25,
+  MPC_TYPE_DFA       = 26,
+  MPC_TYPE_VM        = 27
 };
 
 typedef struct { char *m; } mpc_pdata_fail_t;
@@ -896,6 +1070,62 @@ typedef struct { char *x; } mpc_pdata_string_t;
 typedef struct { mpc_parser_t *x; mpc_apply_t f; } mpc_pdata_apply_t;
 typedef struct { mpc_parser_t *x; mpc_apply_to_t f; void *d; } mpc_pdata_apply_to_t;
 typedef struct { mpc_parser_t *x; } mpc_pdata_predict_t;
+typedef struct { mpc_parser_t *x; mpc_apply_t copy; mpc_dtor_t dx; } mpc_pdata_memo_t;
+
+typedef struct {
+  int states;
+  int classes;
+  unsigned char class_of[256];
+  short *trans;
+  short *eoi;
+} mpc_dfa_t;
+
+typedef struct { mpc_parser_t *x; mpc_dfa_t *dfa; } mpc_pdata_dfa_t;
+
+/*
+** A parser compiled by `mpc_compile` is a flat
+** array of instructions, one for each parser in
+** its graph, with children referred to by their
+** index. The children of `or` and `and` are
+** listed in `kids`, and `leaf` marks those that
+** never call another. Instructions borrow strings
+** and functions from the parsers they came from.
+*/
+
+typedef struct {
+  char type;
+  char leaf;
+  char c;
+  char d;
+  int n;
+  int x;
+  union {
+    char *s;
+    int(*satisfy)(char);
+    int(*anchor)(char,char);
+    mpc_ctor_t lf;
+    mpc_val_t *val;
+    mpc_apply_t apply;
+    mpc_apply_to_t apply_to;
+    mpc_fold_t fold;
+    mpc_dfa_t *dfa;
+    mpc_parser_t *p;
+  } f;
+  union {
+    void *d;
+    mpc_dtor_t dx;
+    mpc_dtor_t *dxs;
+  } g;
+} mpc_instr_t;
+
+typedef struct {
+  int instrs_num;
+  mpc_instr_t *instrs;
+  int kids_num;
+  int *kids;
+} mpc_program_t;
+
+typedef struct { mpc_parser_t *x; mpc_program_t *prog; } mpc_pdata_vm_t;
 typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_ctor_t lf; } mpc_pdata_not_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdata_repeat_t;
 typedef struct { int n; mpc_parser_t **xs; } mpc_pdata_or_t;
@@ -913,6 +1143,9 @@ typedef union {
   mpc_pdata_apply_t apply;
   mpc_pdata_apply_to_t apply_to;
   mpc_pdata_predict_t predict;
+  mpc_pdata_memo_t memo;
+  mpc_pdata_dfa_t dfa;
+  mpc_pdata_vm_t vm;
   mpc_pdata_not_t not;
   mpc_pdata_repeat_t repeat;
   mpc_pdata_and_t and;
@@ -926,6 +1159,63 @@ struct mpc_parser_t {
   mpc_pdata_t data;
 };
 
+/*
+** Packrat Memo Table
+**
+** An entry records the outcome of running a
+** packrat parser at one position: where the
+** input ended up, a copy of the result or of
+** the error, and a copy of the furthest error
+** seen along the way. Results depend on the
+** character before the start, for anchors, and
+** on whether errors are suppressed and whether
+** backtracking is enabled, so these are part
+** of the key.
+*/
+
+typedef struct mpc_memo_t {
+  mpc_parser_t *parser;
+  long pos;
+  char last;
+  char mode;
+  char success;
+  char end_last;
+  mpc_state_t end;
+  mpc_result_t result;
+  mpc_err_t *furthest;
+} mpc_memo_t;
+
+static char mpc_memo_mode(mpc_input_t *i) {
+  return (char)((i->suppress > 0) | ((i->backtrack > 0) << 1));
+}
+
+static mpc_memo_t *mpc_memo_slot(mpc_input_t *i, mpc_parser_t *p) {
+  size_t h = ((size_t)p >> 4) ^ ((size_t)i->state.pos * 2654435761u);
+  if (!i->memo) { i->memo = calloc(MPC_INPUT_MEMO_NUM, sizeof(mpc_memo_t)); }
+  return &i->memo[h & (MPC_INPUT_MEMO_NUM - 1)];
+}
+
+static void mpc_parse_dtor(mpc_input_t *i, mpc_dtor_t d, mpc_val_t *x);
+
+static void mpc_memo_clear(mpc_input_t *i, mpc_memo_t *m) {
+  if (m->parser == NULL) { return; }
+  if (m->success) {
+    mpc_parse_dtor(i, m->parser->data.memo.dx, m->result.output);
+  } else {
+    mpc_err_delete_internal(i, m->result.error);
+  }
+  mpc_err_delete_internal(i, m->furthest);
+  m->parser = NULL;
+}
+
+static void mpc_memo_delete(mpc_input_t *i) {
+  int j;
+  if (!i->memo) { return; }
+  for (j = 0; j < MPC_INPUT_MEMO_NUM; j++) { mpc_memo_clear(i, &i->memo[j]); }
+  free(i->memo);
+  i->memo = NULL;
+}
+
 static mpc_val_t *mpcf_input_nth_free(mpc_input_t *i, int n, mpc_val_t **xs, int x) {
   int j;
   for (j = 0; j < n; j++) { if (j != x) { mpc_free(i, xs[j]); } }
@@ -1006,6 +1296,395 @@ enum {
   if (x) { MPC_SUCCESS(r->output); } \
   else { MPC_FAILURE(NULL); }
 
+static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e);
+
+static int mpc_parse_memo(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e) {
+  
+  mpc_memo_t *m;
+  mpc_err_t *furthest = NULL;
+  long pos = i->state.pos;
+  char last = i->last;
+  char mode = mpc_memo_mode(i);
+  int x;
+  
+  /* Only inputs held in memory can jump to where a remembered parse ended */
+  if (i->type != MPC_INPUT_STRING && i->type != MPC_INPUT_MMAP) {
+    return mpc_parse_run(i, p->data.memo.x, r, e);
+  }
+  
+  m = mpc_memo_slot(i, p);
+  if (m->parser == p && m->pos == pos && m->last == last && m->mode == mode) {
+    i->state = m->end;
+    i->last = m->end_last;
+    *e = mpc_err_merge(i, *e, mpc_err_copy(m->furthest));
+    if (m->success) {
+      r->output = p->data.memo.copy(m->result.output);
+    } else {
+      r->error = mpc_err_copy(m->result.error);
+    }
+    return m->success;
+  }
+  
+  x = mpc_parse_run(i, p->data.memo.x, r, &furthest);
+  
+  mpc_memo_clear(i, m);
+  m->parser = p;
+  m->pos = pos;
+  m->last = last;
+  m->mode = mode;
+  m->success = (char)x;
+  m->end = i->state;
+  m->end_last = i->last;
+  if (x) {
+    m->result.output = p->data.memo.copy(r->output);
+  } else {
+    m->result.error = mpc_err_copy(r->error);
+  }
+  m->furthest = mpc_err_copy(furthest);
+  
+  *e = mpc_err_merge(i, *e, furthest);
+  return x;
+}
+
+/*
+** Regex DFA Runner
+**
+** Regexes compiled by `mpc_re` into DFAs are
+** matched by walking the transition table over
+** String and Mmap inputs. A DFA can find the
+** end of a match, but not the errors merged by
+** the combinators it replaces, so failures are
+** reported with no error. If the whole parse
+** then fails, `mpc_parse_input` runs it again
+** with DFAs turned off to report the error.
+**
+** Returns 1 on a match, 0 on no match, and -1
+** where the combinators must be run instead:
+** for other inputs, with backtracking disabled,
+** or where the DFA can't decide on its own.
+*/
+
+enum {
+  MPC_DFA_FAIL   = -1,
+  MPC_DFA_ACCEPT = -2,
+  MPC_DFA_BAIL   = -3
+};
+
+static int mpc_dfa_run(mpc_input_t *i, mpc_dfa_t *d, char **o) {
+  
+  long start = i->state.pos, pos = start, j;
+  size_t n = 0;
+  int s = 0, a;
+  
+  if ((i->type != MPC_INPUT_STRING && i->type != MPC_INPUT_MMAP)
+  ||  i->dfa_off || i->backtrack < 1) { return -1; }
+  
+  while (1) {
+    if (pos == (long)i->length) {
+      a = d->eoi[s];
+    } else {
+      a = d->trans[s * d->classes + d->class_of[(unsigned char)i->string[pos]]];
+    }
+    if (a < 0) { break; }
+    s = a;
+    pos++;
+  }
+  
+  if (a == MPC_DFA_BAIL) { return -1; }
+  i->dfa_used = 1;
+  if (a == MPC_DFA_FAIL) { return 0; }
+  
+  /* Like `mpcf_strfold`, leave out any null characters */
+  *o = mpc_malloc(i, (size_t)(pos - start) + 1);
+  for (j = start; j < pos; j++) {
+    if (i->string[j] == '\n') {
+      i->state.col = 0;
+      i->state.row++;
+    } else {
+      i->state.col++;
+    }
+    if (i->string[j] != '\0') { (*o)[n++] = i->string[j]; }
+  }
+  (*o)[n] = '\0';
+  
+  if (pos > start) { i->last = i->string[pos - 1]; }
+  i->state.pos = pos;
+  return 1;
+}
+
+/*
+** Parser VM
+**
+** Runs a compiled parser with the same results
+** and errors as `mpc_parse_run`, but keeping the
+** parsers in progress on a stack of frames rather
+** than the C stack, so deeply nested input can't
+** overflow it. A frame is entered once, and then
+** resumed each time one of its children returns,
+** with the child's outcome in `ok` and `res`.
+** Results waiting to be folded are kept on one
+** shared stack of values, from each frame's base.
+** Packrat and nested compiled parsers are run by
+** `mpc_parse_run`.
+*/
+
+enum {
+  MPC_VM_STACK_MIN = 64
+};
+
+typedef struct {
+  int ins;
+  int j;
+  int base;
+} mpc_vm_frame_t;
+
+/* Doubles a stack of `slots` items, moving it off the C stack */
+static void *mpc_vm_grow(void *xs, void *stk, int slots, size_t size) {
+  void *ys;
+  if (xs != stk) { return realloc(xs, slots * 2 * size); }
+  ys = malloc(slots * 2 * size);
+  memcpy(ys, xs, slots * size);
+  return ys;
+}
+
+/*
+** Runs instructions which don't call another,
+** returning -1 for any other instruction, or a
+** DFA that has bailed out to its combinators.
+*/
+
+static int mpc_vm_leaf(mpc_input_t *i, mpc_instr_t *in, mpc_result_t *r, mpc_err_t **e) {
+  
+  int a;
+  
+  switch (in->type) {
+    
+    case MPC_TYPE_ANY:     MPC_PRIMITIVE(mpc_input_any(i, (char**)&r->output));
+    case MPC_TYPE_SINGLE:  MPC_PRIMITIVE(mpc_input_char(i, in->c, (char**)&r->output));
+    case MPC_TYPE_RANGE:   MPC_PRIMITIVE(mpc_input_range(i, in->c, in->d, (char**)&r->output));
+    case MPC_TYPE_ONEOF:   MPC_PRIMITIVE(mpc_input_oneof(i, in->f.s, (char**)&r->output));
+    case MPC_TYPE_NONEOF:  MPC_PRIMITIVE(mpc_input_noneof(i, in->f.s, (char**)&r->output));
+    case MPC_TYPE_SATISFY: MPC_PRIMITIVE(mpc_input_satisfy(i, in->f.satisfy, (char**)&r->output));
+    case MPC_TYPE_STRING:  MPC_PRIMITIVE(mpc_input_string(i, in->f.s, (char**)&r->output));
+    case MPC_TYPE_ANCHOR:  MPC_PRIMITIVE(mpc_input_anchor(i, in->f.anchor, (char**)&r->output));
+    
+    case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_err_fail(i, "Parser Undefined!"));
+    case MPC_TYPE_PASS:      MPC_SUCCESS(NULL);
+    case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_err_fail(i, in->f.s));
+    case MPC_TYPE_LIFT:      MPC_SUCCESS(in->f.lf());
+    case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(in->f.val);
+    case MPC_TYPE_STATE:     MPC_SUCCESS(mpc_input_state_copy(i));
+    
+    case MPC_TYPE_MEMO:
+    case MPC_TYPE_VM:
+      return mpc_parse_run(i, in->f.p, r, e);
+    
+    case MPC_TYPE_DFA:
+      a = mpc_dfa_run(i, in->f.dfa, (char**)&r->output);
+      if (a == 1) { MPC_SUCCESS(r->output); }
+      if (a == 0) { MPC_FAILURE(NULL); }
+      return -1;
+    
+    default: return -1;
+  }
+  
+}
+
+/* Leaves are run at once, rather than in a frame of their own */
+#define MPC_VM_CALL(c) { \
+  next = (c); \
+  if (m->instrs[next].leaf) { \
+    a = mpc_vm_leaf(i, &m->instrs[next], &res, e); \
+    if (a >= 0) { ok = a; ret = 1; break; } } \
+  if (frames_num == frames_slots) { \
+    frames = mpc_vm_grow(frames, frames_stk, frames_slots, sizeof(mpc_vm_frame_t)); \
+    frames_slots = frames_slots * 2; } \
+  frames[frames_num].ins = next; \
+  frames[frames_num].j = 0; \
+  frames[frames_num].base = vals_num; \
+  frames_num++; \
+  ret = 0; \
+  break; }
+
+#define MPC_VM_PUSH(x) { \
+  if (vals_num == vals_slots) { \
+    vals = mpc_vm_grow(vals, vals_stk, vals_slots, sizeof(mpc_result_t)); \
+    vals_slots = vals_slots * 2; } \
+  vals[vals_num++] = (x); }
+
+#define MPC_VM_RETURN() { ret = 1; frames_num--; break; }
+#define MPC_VM_SUCCESS(x) { res.output = (x); ok = 1; MPC_VM_RETURN(); }
+#define MPC_VM_FAILURE(x) { res.error = (x); ok = 0; MPC_VM_RETURN(); }
+
+static int mpc_vm_run(mpc_input_t *i, mpc_program_t *m, mpc_result_t *r, mpc_err_t **e) {
+  
+  mpc_vm_frame_t frames_stk[MPC_VM_STACK_MIN], *frames = frames_stk, *f;
+  mpc_result_t vals_stk[MPC_VM_STACK_MIN], *vals = vals_stk, res;
+  int frames_num = 1, frames_slots = MPC_VM_STACK_MIN;
+  int vals_num = 0, vals_slots = MPC_VM_STACK_MIN;
+  int ok = 0, ret = 0, next, k, a;
+  mpc_instr_t *in;
+  
+  frames[0].ins = 0;
+  frames[0].j = 0;
+  frames[0].base = 0;
+  res.output = NULL;
+  
+  a = mpc_vm_leaf(i, &m->instrs[0], &res, e);
+  if (a >= 0) {
+    ok = a;
+    frames_num = 0;
+  }
+  
+  while (frames_num > 0) {
+    
+    f = &frames[frames_num-1];
+    in = &m->instrs[f->ins];
+    
+    /* Entering a frame, which is never a leaf */
+    
+    if (!ret) {
+      switch (in->type) {
+        
+        case MPC_TYPE_EXPECT:  mpc_input_suppress_enable(i); MPC_VM_CALL(in->x);
+        case MPC_TYPE_PREDICT: mpc_input_backtrack_disable(i); MPC_VM_CALL(in->x);
+        
+        case MPC_TYPE_NOT:
+          mpc_input_mark(i);
+          mpc_input_suppress_enable(i);
+          MPC_VM_CALL(in->x);
+        
+        case MPC_TYPE_APPLY:
+        case MPC_TYPE_APPLY_TO:
+        case MPC_TYPE_MAYBE:
+        case MPC_TYPE_MANY:
+        case MPC_TYPE_MANY1:
+        case MPC_TYPE_COUNT:
+        case MPC_TYPE_DFA:
+          MPC_VM_CALL(in->x);
+        
+        case MPC_TYPE_OR:
+          if (in->n == 0) { MPC_VM_SUCCESS(NULL); }
+          MPC_VM_CALL(m->kids[in->x]);
+        
+        case MPC_TYPE_AND:
+          if (in->n == 0) { MPC_VM_SUCCESS(NULL); }
+          mpc_input_mark(i);
+          MPC_VM_CALL(m->kids[in->x]);
+        
+        default: MPC_VM_FAILURE(mpc_err_fail(i, "Unknown Parser Type Id!"));
+      }
+      continue;
+    }
+    
+    /* Resuming a frame after a child returned */
+    
+    switch (in->type) {
+      
+      case MPC_TYPE_APPLY:
+        if (ok) { MPC_VM_SUCCESS(mpc_parse_apply(i, in->f.apply, res.output)); }
+        MPC_VM_RETURN();
+      
+      case MPC_TYPE_APPLY_TO:
+        if (ok) { MPC_VM_SUCCESS(mpc_parse_apply_to(i, in->f.apply_to, res.output, in->g.d)); }
+        MPC_VM_RETURN();
+      
+      case MPC_TYPE_EXPECT:
+        mpc_input_suppress_disable(i);
+        if (ok) { MPC_VM_RETURN(); }
+        MPC_VM_FAILURE(mpc_err_new(i, in->f.s));
+      
+      case MPC_TYPE_PREDICT:
+        mpc_input_backtrack_enable(i);
+        MPC_VM_RETURN();
+      
+      case MPC_TYPE_DFA:
+        MPC_VM_RETURN();
+      
+      case MPC_TYPE_NOT:
+        if (ok) {
+          mpc_input_rewind(i);
+          mpc_input_suppress_disable(i);
+          mpc_parse_dtor(i, in->g.dx, res.output);
+          MPC_VM_FAILURE(mpc_err_new(i, "opposite"));
+        }
+        mpc_input_unmark(i);
+        mpc_input_suppress_disable(i);
+        MPC_VM_SUCCESS(in->f.lf());
+      
+      case MPC_TYPE_MAYBE:
+        if (ok) { MPC_VM_RETURN(); }
+        *e = mpc_err_merge(i, *e, res.error);
+        MPC_VM_SUCCESS(in->f.lf());
+      
+      case MPC_TYPE_MANY:
+      case MPC_TYPE_MANY1:
+        if (ok) {
+          MPC_VM_PUSH(res);
+          f->j++;
+          MPC_VM_CALL(in->x);
+        }
+        if (in->type == MPC_TYPE_MANY1 && f->j == 0) {
+          MPC_VM_FAILURE(mpc_err_many1(i, res.error));
+        }
+        *e = mpc_err_merge(i, *e, res.error);
+        vals_num = f->base;
+        MPC_VM_SUCCESS(mpc_parse_fold(i, in->f.fold, f->j, (mpc_val_t**)(vals + f->base)));
+      
+      case MPC_TYPE_COUNT:
+        if (ok) {
+          MPC_VM_PUSH(res);
+          f->j++;
+          if (f->j < in->n) { MPC_VM_CALL(in->x); }
+          vals_num = f->base;
+          MPC_VM_SUCCESS(mpc_parse_fold(i, in->f.fold, f->j, (mpc_val_t**)(vals + f->base)));
+        }
+        for (k = 0; k < f->j; k++) {
+          mpc_parse_dtor(i, in->g.dx, vals[f->base + k].output);
+        }
+        vals_num = f->base;
+        MPC_VM_FAILURE(mpc_err_count(i, res.error, in->n));
+      
+      case MPC_TYPE_OR:
+        if (ok) { MPC_VM_RETURN(); }
+        *e = mpc_err_merge(i, *e, res.error);
+        f->j++;
+        if (f->j < in->n) { MPC_VM_CALL(m->kids[in->x + f->j]); }
+        MPC_VM_FAILURE(NULL);
+      
+      case MPC_TYPE_AND:
+        if (ok) {
+          MPC_VM_PUSH(res);
+          f->j++;
+          if (f->j < in->n) { MPC_VM_CALL(m->kids[in->x + f->j]); }
+          mpc_input_unmark(i);
+          vals_num = f->base;
+          MPC_VM_SUCCESS(mpc_parse_fold(i, in->f.fold, f->j, (mpc_val_t**)(vals + f->base)));
+        }
+        mpc_input_rewind(i);
+        for (k = 0; k < f->j; k++) {
+          mpc_parse_dtor(i, in->g.dxs[k], vals[f->base + k].output);
+        }
+        vals_num = f->base;
+        MPC_VM_RETURN();
+      
+      default: MPC_VM_RETURN();
+    }
+  }
+  
+  if (frames != frames_stk) { free(frames); }
+  if (vals != vals_stk) { free(vals); }
+  
+  if (ok) { r->output = res.output; } else { r->error = res.error; }
+  return ok;
+}
+
+#undef MPC_VM_CALL
+#undef MPC_VM_PUSH
+#undef MPC_VM_RETURN
+#undef MPC_VM_SUCCESS
+#undef MPC_VM_FAILURE
+
 static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e) {
   
   int j = 0, k = 0;
@@ -1061,6 +1740,19 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
         MPC_FAILURE(mpc_err_new(i, p->data.expect.m));
       }
     
+    case MPC_TYPE_MEMO:
+      return mpc_parse_memo(i, p, r, e);
+    
+    case MPC_TYPE_DFA:
+      switch (mpc_dfa_run(i, p->data.dfa.dfa, (char**)&r->output)) {
+        case 1: MPC_SUCCESS(r->output);
+        case 0: MPC_FAILURE(NULL);
+        default: return mpc_parse_run(i, p->data.dfa.x, r, e);
+      }
+    
+    case MPC_TYPE_VM:
+      return mpc_vm_run(i, p->data.vm.prog, r, e);
+    
     case MPC_TYPE_PREDICT:
       mpc_input_backtrack_disable(i);
       if (mpc_parse_run(i, p->data.predict.x, r, e)) {      
@@ -1234,9 +1926,24 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
 
 int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
   int x;
+  mpc_state_t start = i->state;
+  char last = i->last;
   mpc_err_t *e = mpc_err_fail(i, "Unknown Error");
   e->state = mpc_state_invalid();
+  i->mem_stats.parses++;
   x = mpc_parse_run(i, p, r, &e);
+  if (!x && i->dfa_used) {
+    /* Parse again without DFAs to find the error */
+    mpc_err_delete_internal(i, e);
+    mpc_err_delete_internal(i, r->error);
+    mpc_memo_delete(i);
+    i->state = start;
+    i->last = last;
+    i->dfa_off = 1;
+    e = mpc_err_fail(i, "Unknown Error");
+    e->state = mpc_state_invalid();
+    x = mpc_parse_run(i, p, r, &e);
+  }
   if (x) {
     mpc_err_delete_internal(i, e);
     r->output = mpc_export(i, r->output);
@@ -1278,27 +1985,98 @@ int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result
   return x;
 }
 
-int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
+/*
+** Parse Contexts
+*/
+
+struct mpc_context_t {
+  mpc_input_t *input;
+};
+
+mpc_context_t *mpc_context_new(void) {
+  mpc_context_t *c = malloc(sizeof(mpc_context_t));
+  c->input = mpc_input_new_string("", "");
+  return c;
+}
+
+void mpc_context_delete(mpc_context_t *c) {
+  mpc_input_delete(c->input);
+  free(c);
+}
+
+void mpc_context_stats(mpc_context_t *c, mpc_mem_stats_t *s) {
+  *s = c->input->mem_stats;
+}
+
+int mpc_context_parse(mpc_context_t *c, const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = c->input;
+  mpc_input_restart(i, MPC_INPUT_STRING, filename);
+  i->string = (char*)string;
+  i->length = strlen(string);
+  x = mpc_parse_input(i, p, r);
+  mpc_input_release(i);
+  return x;
+}
+
+int mpc_context_parse_contents(mpc_context_t *c, const char *filename, mpc_parser_t *p, mpc_result_t *r) {
   
-  FILE *f = fopen(filename, "rb");
+  FILE *f;
   int res;
+  mpc_input_t *i = c->input;
+  
+#ifdef MPC_USE_MMAP
+  /* Map regular files into memory, falling back to reading them */
+  int fd = open(filename, O_RDONLY);
+  struct stat st;
+  if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      close(fd);
+      madvise(map, st.st_size, MADV_SEQUENTIAL);
+      mpc_input_restart(i, MPC_INPUT_MMAP, filename);
+      i->string = map;
+      i->length = st.st_size;
+      res = mpc_parse_input(i, p, r);
+      mpc_input_release(i);
+      return res;
+    }
+  }
+  if (fd >= 0) { close(fd); }
+#endif
   
+  f = fopen(filename, "rb");
   if (f == NULL) {
     r->output = NULL;
     r->error = mpc_err_file(filename, "Unable to open file!");
     return 0;
   }
   
-  res = mpc_parse_file(filename, f, p, r);
+  mpc_input_restart(i, MPC_INPUT_FILE, filename);
+  i->file = f;
+  res = mpc_parse_input(i, p, r);
+  mpc_input_release(i);
   fclose(f);
   return res;
 }
 
+int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_context_t *c = mpc_context_new();
+  x = mpc_context_parse_contents(c, filename, p, r);
+  mpc_context_delete(c);
+  return x;
+}
+
 /*
 ** Building a Parser
 */
 
 static void mpc_undefine_unretained(mpc_parser_t *p, int force);
+static void mpc_dfa_delete(mpc_dfa_t *d);
+static mpc_dfa_t *mpc_dfa_copy(mpc_dfa_t *d);
+static mpc_program_t *mpc_program_new(mpc_parser_t *a);
+static void mpc_program_delete(mpc_program_t *m);
 
 static void mpc_undefine_or(mpc_parser_t *p) {
   
@@ -1338,6 +2116,15 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
     case MPC_TYPE_APPLY:    mpc_undefine_unretained(p->data.apply.x, 0);    break;
     case MPC_TYPE_APPLY_TO: mpc_undefine_unretained(p->data.apply_to.x, 0); break;
     case MPC_TYPE_PREDICT:  mpc_undefine_unretained(p->data.predict.x, 0);  break;
+    case MPC_TYPE_MEMO:     mpc_undefine_unretained(p->data.memo.x, 0);     break;
+    case MPC_TYPE_DFA:
+      mpc_undefine_unretained(p->data.dfa.x, 0);
+      mpc_dfa_delete(p->data.dfa.dfa);
+      break;
+    case MPC_TYPE_VM:
+      mpc_undefine_unretained(p->data.vm.x, 0);
+      mpc_program_delete(p->data.vm.prog);
+      break;
     
     case MPC_TYPE_MAYBE:
     case MPC_TYPE_NOT:
@@ -1436,6 +2223,15 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
     case MPC_TYPE_APPLY:    p->data.apply.x    = mpc_copy(a->data.apply.x);    break;
     case MPC_TYPE_APPLY_TO: p->data.apply_to.x = mpc_copy(a->data.apply_to.x); break;
     case MPC_TYPE_PREDICT:  p->data.predict.x  = mpc_copy(a->data.predict.x);  break;
+    case MPC_TYPE_MEMO:     p->data.memo.x     = mpc_copy(a->data.memo.x);     break;
+    case MPC_TYPE_DFA:
+      p->data.dfa.x = mpc_copy(a->data.dfa.x);
+      p->data.dfa.dfa = mpc_dfa_copy(a->data.dfa.dfa);
+      break;
+    case MPC_TYPE_VM:
+      p->data.vm.x = mpc_copy(a->data.vm.x);
+      p->data.vm.prog = mpc_program_new(p->data.vm.x);
+      break;
     
     case MPC_TYPE_MAYBE:
     case MPC_TYPE_NOT:
@@ -1726,6 +2522,225 @@ mpc_parser_t *mpc_predictive(mpc_parser_t *a) {
   return p;
 }
 
+mpc_parser_t *mpc_packrat(mpc_parser_t *a, mpc_apply_t copy, mpc_dtor_t da) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_MEMO;
+  p->data.memo.x = a;
+  p->data.memo.copy = copy;
+  p->data.memo.dx = da;
+  return p;
+}
+
+/*
+** Compiling a parser numbers every parser in its
+** graph in the order they are found, so the root
+** is instruction zero, using a table from parser
+** to number. The graph is walked with a work list
+** rather than by recursion.
+*/
+
+typedef struct {
+  mpc_parser_t **ps;
+  int *ids;
+  int slots;
+  mpc_parser_t **order;
+  int num;
+} mpc_program_index_t;
+
+static int mpc_program_id(mpc_program_index_t *t, mpc_parser_t *p) {
+  
+  size_t h;
+  int j, old_slots;
+  mpc_parser_t **old_ps;
+  int *old_ids;
+  
+  /* Keep the table at most half full */
+  if (t->num * 2 >= t->slots) {
+    old_ps = t->ps; old_ids = t->ids; old_slots = t->slots;
+    t->slots = t->slots * 2;
+    t->ps = calloc(t->slots, sizeof(mpc_parser_t*));
+    t->ids = malloc(sizeof(int) * t->slots);
+    t->order = realloc(t->order, sizeof(mpc_parser_t*) * t->slots);
+    for (j = 0; j < old_slots; j++) {
+      if (old_ps[j] == NULL) { continue; }
+      h = ((size_t)old_ps[j] >> 4) & (t->slots - 1);
+      while (t->ps[h] != NULL) { h = (h + 1) & (t->slots - 1); }
+      t->ps[h] = old_ps[j];
+      t->ids[h] = old_ids[j];
+    }
+    free(old_ps);
+    free(old_ids);
+  }
+  
+  h = ((size_t)p >> 4) & (t->slots - 1);
+  while (t->ps[h] != NULL) {
+    if (t->ps[h] == p) { return t->ids[h]; }
+    h = (h + 1) & (t->slots - 1);
+  }
+  
+  t->ps[h] = p;
+  t->ids[h] = t->num;
+  t->order[t->num] = p;
+  return t->num++;
+}
+
+static mpc_program_t *mpc_program_new(mpc_parser_t *a) {
+  
+  int j, k, n, instrs_slots = 0, kids_slots = 0;
+  mpc_parser_t *p, **xs;
+  mpc_instr_t *in;
+  mpc_program_index_t t;
+  mpc_program_t *m = malloc(sizeof(mpc_program_t));
+  
+  m->instrs_num = 0;
+  m->instrs = NULL;
+  m->kids_num = 0;
+  m->kids = NULL;
+  
+  t.slots = 64;
+  t.ps = calloc(t.slots, sizeof(mpc_parser_t*));
+  t.ids = malloc(sizeof(int) * t.slots);
+  t.order = malloc(sizeof(mpc_parser_t*) * t.slots);
+  t.num = 0;
+  mpc_program_id(&t, a);
+  
+  for (k = 0; k < t.num; k++) {
+    
+    p = t.order[k];
+    
+    if (k == instrs_slots) {
+      instrs_slots = instrs_slots ? instrs_slots * 2 : 64;
+      m->instrs = realloc(m->instrs, sizeof(mpc_instr_t) * instrs_slots);
+    }
+    in = &m->instrs[k];
+    memset(in, 0, sizeof(mpc_instr_t));
+    in->type = p->type;
+    in->leaf = 1;
+    
+    switch (p->type) {
+      
+      case MPC_TYPE_FAIL:     in->f.s = p->data.fail.m; break;
+      case MPC_TYPE_LIFT:     in->f.lf = p->data.lift.lf; break;
+      case MPC_TYPE_LIFT_VAL: in->f.val = p->data.lift.x; break;
+      case MPC_TYPE_ANCHOR:   in->f.anchor = p->data.anchor.f; break;
+      case MPC_TYPE_SINGLE:   in->c = p->data.single.x; break;
+      case MPC_TYPE_RANGE:    in->c = p->data.range.x; in->d = p->data.range.y; break;
+      case MPC_TYPE_SATISFY:  in->f.satisfy = p->data.satisfy.f; break;
+      
+      case MPC_TYPE_ONEOF:
+      case MPC_TYPE_NONEOF:
+      case MPC_TYPE_STRING:
+        in->f.s = p->data.string.x;
+        break;
+      
+      case MPC_TYPE_EXPECT:
+        in->f.s = p->data.expect.m;
+        in->x = mpc_program_id(&t, p->data.expect.x);
+        in->leaf = 0;
+        break;
+      
+      case MPC_TYPE_APPLY:
+        in->f.apply = p->data.apply.f;
+        in->x = mpc_program_id(&t, p->data.apply.x);
+        in->leaf = 0;
+        break;
+      
+      case MPC_TYPE_APPLY_TO:
+        in->f.apply_to = p->data.apply_to.f;
+        in->g.d = p->data.apply_to.d;
+        in->x = mpc_program_id(&t, p->data.apply_to.x);
+        in->leaf = 0;
+        break;
+      
+      case MPC_TYPE_PREDICT:
+        in->x = mpc_program_id(&t, p->data.predict.x);
+        in->leaf = 0;
+        break;
+      
+      case MPC_TYPE_NOT:
+      case MPC_TYPE_MAYBE:
+        in->f.lf = p->data.not.lf;
+        in->g.dx = p->data.not.dx;
+        in->x = mpc_program_id(&t, p->data.not.x);
+        in->leaf = 0;
+        break;
+      
+      case MPC_TYPE_MANY:
+      case MPC_TYPE_MANY1:
+      case MPC_TYPE_COUNT:
+        in->n = p->data.repeat.n;
+        in->f.fold = p->data.repeat.f;
+        in->g.dx = p->data.repeat.dx;
+        in->x = mpc_program_id(&t, p->data.repeat.x);
+        in->leaf = 0;
+        break;
+      
+      case MPC_TYPE_MEMO:
+      case MPC_TYPE_VM:
+        in->f.p = p;
+        break;
+      
+      case MPC_TYPE_DFA:
+        in->f.dfa = p->data.dfa.dfa;
+        in->x = mpc_program_id(&t, p->data.dfa.x);
+        break;
+      
+      case MPC_TYPE_OR:
+      case MPC_TYPE_AND:
+        n = p->type == MPC_TYPE_OR ? p->data.or.n : p->data.and.n;
+        xs = p->type == MPC_TYPE_OR ? p->data.or.xs : p->data.and.xs;
+        if (p->type == MPC_TYPE_AND) {
+          in->f.fold = p->data.and.f;
+          in->g.dxs = p->data.and.dxs;
+        }
+        in->leaf = 0;
+        in->n = n;
+        in->x = m->kids_num;
+        if (m->kids_num + n > kids_slots) {
+          kids_slots = (m->kids_num + n) * 2;
+          m->kids = realloc(m->kids, sizeof(int) * kids_slots);
+        }
+        m->kids_num += n;
+        for (j = 0; j < n; j++) {
+          m->kids[in->x + j] = mpc_program_id(&t, xs[j]);
+        }
+        break;
+      
+      default: break;
+    }
+  }
+  
+  m->instrs_num = t.num;
+  m->instrs = realloc(m->instrs, sizeof(mpc_instr_t) * m->instrs_num);
+  
+  free(t.ps);
+  free(t.ids);
+  free(t.order);
+  return m;
+}
+
+static void mpc_program_delete(mpc_program_t *m) {
+  free(m->instrs);
+  free(m->kids);
+  free(m);
+}
+
+/*
+** Compiles the graph of parsers reachable from
+** `a` for the parser VM. The compiled parser
+** borrows from the parsers it was made from, so
+** they must not be redefined, optimised or
+** deleted while it is in use.
+*/
+
+mpc_parser_t *mpc_compile(mpc_parser_t *a) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_VM;
+  p->data.vm.x = a;
+  p->data.vm.prog = mpc_program_new(a);
+  return p;
+}
+
 mpc_parser_t *mpc_not_lift(mpc_parser_t *a, mpc_dtor_t da, mpc_ctor_t lf) {
   mpc_parser_t *p = mpc_undefined();
   p->type = MPC_TYPE_NOT;
@@ -2156,6 +3171,411 @@ static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
   return out;
 }
 
+/*
+** Regex DFAs
+**
+** Most regexes are matched by a combinator tree
+** that never needs to backtrack. For these the
+** tree is compiled into a DFA, with a table of
+** transitions over classes of bytes which the
+** regex can't tell apart, so it can be matched
+** with one lookup per character.
+**
+** Each DFA state is a stack of what is left to
+** match, and a transition steps the stack over
+** one character, as the combinators would. Where
+** this can't be known from one character, such
+** as when two alternatives could both consume
+** it, the step bails out, and the combinator tree
+** is run from the start of the match instead.
+** Anchors, boundaries, `not` and anything else
+** which isn't a plain character pattern leave the
+** regex as a combinator tree.
+*/
+
+enum {
+  MPC_DFA_SET, MPC_DFA_EPS, MPC_DFA_SEQ, MPC_DFA_ALT,
+  MPC_DFA_STAR, MPC_DFA_PLUS, MPC_DFA_OPT
+};
+
+enum { MPC_DFA_CONSUME = 0 };
+
+enum {
+  MPC_DFA_STATES_MAX = 256,
+  MPC_DFA_STACK_MAX  = 64,
+  MPC_DFA_COUNT_MAX  = 16
+};
+
+typedef struct {
+  int type;
+  int n;
+  int kids;
+  int nullable;
+  unsigned char set[32];
+  unsigned char first[32];
+} mpc_dfa_node_t;
+
+typedef struct {
+  mpc_dfa_node_t *nodes;
+  int nodes_num;
+  int *kids;
+  int kids_num;
+} mpc_dfa_builder_t;
+
+#define MPC_DFA_IN(s, c) ((s)[(c) >> 3] & (1 << ((c) & 7)))
+
+static int mpc_dfa_node_new(mpc_dfa_builder_t *b, int type, int n, int *kids) {
+  
+  int j, c;
+  mpc_dfa_node_t *x;
+  
+  b->nodes = realloc(b->nodes, sizeof(mpc_dfa_node_t) * (b->nodes_num + 1));
+  b->kids = realloc(b->kids, sizeof(int) * (b->kids_num + n + 1));
+  if (n > 0) { memcpy(b->kids + b->kids_num, kids, sizeof(int) * n); }
+  
+  x = &b->nodes[b->nodes_num];
+  memset(x, 0, sizeof(mpc_dfa_node_t));
+  x->type = type;
+  x->n = n;
+  x->kids = b->kids_num;
+  b->kids_num += n;
+  
+  switch (type) {
+    case MPC_DFA_EPS: x->nullable = 1; break;
+    case MPC_DFA_SEQ:
+      x->nullable = 1;
+      for (j = 0; j < n && x->nullable; j++) {
+        for (c = 0; c < 32; c++) { x->first[c] |= b->nodes[kids[j]].first[c]; }
+        x->nullable = b->nodes[kids[j]].nullable;
+      }
+      break;
+    case MPC_DFA_ALT:
+      for (j = 0; j < n; j++) {
+        for (c = 0; c < 32; c++) { x->first[c] |= b->nodes[kids[j]].first[c]; }
+        x->nullable |= b->nodes[kids[j]].nullable;
+      }
+      break;
+    case MPC_DFA_STAR:
+    case MPC_DFA_PLUS:
+    case MPC_DFA_OPT:
+      /* Repeating something which can match nothing never ends */
+      if (b->nodes[kids[0]].nullable) { return -1; }
+      memcpy(x->first, b->nodes[kids[0]].first, 32);
+      x->nullable = type != MPC_DFA_PLUS;
+      break;
+  }
+  
+  return b->nodes_num++;
+}
+
+static int mpc_dfa_node_set(mpc_dfa_builder_t *b, mpc_parser_t *p) {
+  
+  int c, k = mpc_dfa_node_new(b, MPC_DFA_SET, 0, NULL);
+  mpc_dfa_node_t *x = &b->nodes[k];
+  char y;
+  int in = 0;
+  
+  /* Bytes matched are found the same way `mpc_input_*` finds them */
+  for (c = 0; c < 256; c++) {
+    y = (char)c;
+    switch (p->type) {
+      case MPC_TYPE_ANY:    in = 1; break;
+      case MPC_TYPE_SINGLE: in = y == p->data.single.x; break;
+      case MPC_TYPE_RANGE:  in = y >= p->data.range.x && y <= p->data.range.y; break;
+      case MPC_TYPE_ONEOF:  in = strchr(p->data.string.x, y) != 0; break;
+      case MPC_TYPE_NONEOF: in = strchr(p->data.string.x, y) == 0; break;
+    }
+    if (in) { x->set[c >> 3] |= (1 << (c & 7)); }
+  }
+  
+  memcpy(x->first, x->set, 32);
+  return k;
+}
+
+static int mpc_dfa_node(mpc_dfa_builder_t *b, mpc_parser_t *p) {
+  
+  int j, k, n, *kids, type;
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_EXPECT: return mpc_dfa_node(b, p->data.expect.x);
+    
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+      return mpc_dfa_node_set(b, p);
+    
+    case MPC_TYPE_LIFT:
+      if (p->data.lift.lf != mpcf_ctor_str) { return -1; }
+      return mpc_dfa_node_new(b, MPC_DFA_EPS, 0, NULL);
+    
+    case MPC_TYPE_AND:
+    case MPC_TYPE_OR:
+      if (p->type == MPC_TYPE_AND && p->data.and.f != mpcf_strfold) { return -1; }
+      n = p->type == MPC_TYPE_AND ? p->data.and.n : p->data.or.n;
+      if (n == 0) { return -1; }
+      kids = malloc(sizeof(int) * n);
+      for (j = 0; j < n; j++) {
+        kids[j] = mpc_dfa_node(b, p->type == MPC_TYPE_AND ? p->data.and.xs[j] : p->data.or.xs[j]);
+        if (kids[j] < 0) { free(kids); return -1; }
+      }
+      k = mpc_dfa_node_new(b, p->type == MPC_TYPE_AND ? MPC_DFA_SEQ : MPC_DFA_ALT, n, kids);
+      free(kids);
+      return k;
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+      if (p->data.repeat.f != mpcf_strfold) { return -1; }
+      k = mpc_dfa_node(b, p->data.repeat.x);
+      if (k < 0) { return -1; }
+      type = p->type == MPC_TYPE_MANY ? MPC_DFA_STAR : MPC_DFA_PLUS;
+      return mpc_dfa_node_new(b, type, 1, &k);
+    
+    case MPC_TYPE_MAYBE:
+      if (p->data.not.lf != mpcf_ctor_str) { return -1; }
+      k = mpc_dfa_node(b, p->data.not.x);
+      if (k < 0) { return -1; }
+      return mpc_dfa_node_new(b, MPC_DFA_OPT, 1, &k);
+    
+    case MPC_TYPE_COUNT:
+      n = p->data.repeat.n;
+      if (p->data.repeat.f != mpcf_strfold || n < 1 || n > MPC_DFA_COUNT_MAX) { return -1; }
+      k = mpc_dfa_node(b, p->data.repeat.x);
+      if (k < 0) { return -1; }
+      kids = malloc(sizeof(int) * n);
+      for (j = 0; j < n; j++) { kids[j] = k; }
+      k = mpc_dfa_node_new(b, MPC_DFA_SEQ, n, kids);
+      free(kids);
+      return k;
+    
+    default: return -1;
+  }
+  
+}
+
+/* Returns if a node can't fail, whatever comes next */
+static int mpc_dfa_sure(mpc_dfa_builder_t *b, int item) {
+  int j;
+  mpc_dfa_node_t *x = &b->nodes[item >> 1];
+  switch (x->type) {
+    case MPC_DFA_EPS:
+    case MPC_DFA_STAR:
+    case MPC_DFA_OPT:
+      return 1;
+    case MPC_DFA_PLUS:
+      return item & 1;
+    case MPC_DFA_SEQ:
+      for (j = 0; j < x->n; j++) {
+        if (!mpc_dfa_sure(b, b->kids[x->kids + j] << 1)) { return 0; }
+      }
+      return 1;
+    default: return 0;
+  }
+}
+
+/*
+** Steps the stack `st` of `*n` items over
+** the character `c`, or over the end of the
+** input when `c` is negative. Items are a node
+** shifted left by one, with the low bit set
+** once a `PLUS` has matched its first time.
+*/
+
+static int mpc_dfa_step(mpc_dfa_builder_t *b, int *st, int *n, int c) {
+  
+  int j, k, item, a, sub[MPC_DFA_STACK_MAX], sub_n;
+  mpc_dfa_node_t *x, *y;
+  
+  while (1) {
+    
+    if (*n == 0) { return MPC_DFA_ACCEPT; }
+    
+    item = st[*n-1];
+    x = &b->nodes[item >> 1];
+    
+    switch (x->type) {
+      
+      case MPC_DFA_EPS: (*n)--; break;
+      
+      case MPC_DFA_SET:
+        if (c < 0 || !MPC_DFA_IN(x->set, c)) { return MPC_DFA_FAIL; }
+        (*n)--;
+        return MPC_DFA_CONSUME;
+      
+      case MPC_DFA_SEQ:
+        if (*n - 1 + x->n > MPC_DFA_STACK_MAX) { return MPC_DFA_BAIL; }
+        (*n)--;
+        for (j = x->n-1; j >= 0; j--) { st[(*n)++] = b->kids[x->kids + j] << 1; }
+        break;
+      
+      case MPC_DFA_ALT:
+        
+        /* Alternatives before the first which could match will fail */
+        for (j = 0; j < x->n; j++) {
+          y = &b->nodes[b->kids[x->kids + j]];
+          if (y->nullable || (c >= 0 && MPC_DFA_IN(y->first, c))) { break; }
+        }
+        if (j == x->n) { return MPC_DFA_FAIL; }
+        
+        /* If it consumes, it must be the only one which could match */
+        y = &b->nodes[b->kids[x->kids + j]];
+        if (c >= 0 && MPC_DFA_IN(y->first, c)) {
+          for (k = j+1; k < x->n; k++) {
+            y = &b->nodes[b->kids[x->kids + k]];
+            if (y->nullable || MPC_DFA_IN(y->first, c)) { return MPC_DFA_BAIL; }
+          }
+        }
+        
+        st[*n-1] = b->kids[x->kids + j] << 1;
+        break;
+      
+      case MPC_DFA_PLUS:
+        if (!(item & 1)) {
+          if (*n == MPC_DFA_STACK_MAX) { return MPC_DFA_BAIL; }
+          st[*n-1] = item | 1;
+          st[(*n)++] = b->kids[x->kids] << 1;
+          break;
+        }
+        /* Fallthrough */
+      
+      case MPC_DFA_STAR:
+      case MPC_DFA_OPT:
+        
+        if (c < 0 || !MPC_DFA_IN(x->first, c)) { (*n)--; break; }
+        
+        /* Run once more only if it can't fail after consuming `c` */
+        sub[0] = b->kids[x->kids] << 1;
+        sub_n = 1;
+        a = mpc_dfa_step(b, sub, &sub_n, c);
+        if (a == MPC_DFA_FAIL) { (*n)--; break; }
+        if (a != MPC_DFA_CONSUME) { return MPC_DFA_BAIL; }
+        for (j = 0; j < sub_n; j++) {
+          if (!mpc_dfa_sure(b, sub[j])) { return MPC_DFA_BAIL; }
+        }
+        
+        if (x->type == MPC_DFA_OPT) { (*n)--; }
+        if (*n + sub_n > MPC_DFA_STACK_MAX) { return MPC_DFA_BAIL; }
+        memcpy(st + *n, sub, sizeof(int) * sub_n);
+        *n += sub_n;
+        return MPC_DFA_CONSUME;
+    }
+  }
+  
+}
+
+static void mpc_dfa_delete(mpc_dfa_t *d) {
+  free(d->trans);
+  free(d->eoi);
+  free(d);
+}
+
+static mpc_dfa_t *mpc_dfa_copy(mpc_dfa_t *d) {
+  mpc_dfa_t *e = malloc(sizeof(mpc_dfa_t));
+  memcpy(e, d, sizeof(mpc_dfa_t));
+  e->trans = malloc(sizeof(short) * d->states * d->classes);
+  e->eoi = malloc(sizeof(short) * d->states);
+  memcpy(e->trans, d->trans, sizeof(short) * d->states * d->classes);
+  memcpy(e->eoi, d->eoi, sizeof(short) * d->states);
+  return e;
+}
+
+static mpc_dfa_t *mpc_dfa_build(mpc_dfa_builder_t *b, int root) {
+  
+  int j, k, c, s, a, n, remap[512], refined[256], rep[256];
+  int st[MPC_DFA_STACK_MAX];
+  int *states, *states_n, states_num = 1;
+  mpc_dfa_t *d = calloc(1, sizeof(mpc_dfa_t));
+  
+  /* Split bytes into classes matched by the same sets */
+  d->classes = 1;
+  for (k = 0; k < b->nodes_num; k++) {
+    if (b->nodes[k].type != MPC_DFA_SET) { continue; }
+    for (j = 0; j < 512; j++) { remap[j] = -1; }
+    n = 0;
+    for (c = 0; c < 256; c++) {
+      j = d->class_of[c] * 2 + (MPC_DFA_IN(b->nodes[k].set, c) ? 1 : 0);
+      if (remap[j] < 0) { remap[j] = n++; }
+      refined[c] = remap[j];
+    }
+    for (c = 0; c < 256; c++) { d->class_of[c] = (unsigned char)refined[c]; }
+    d->classes = n;
+  }
+  
+  for (c = 255; c >= 0; c--) { rep[d->class_of[c]] = c; }
+  
+  /* Find every state reachable from the start, in order */
+  states = malloc(sizeof(int) * MPC_DFA_STATES_MAX * MPC_DFA_STACK_MAX);
+  states_n = malloc(sizeof(int) * MPC_DFA_STATES_MAX);
+  d->trans = malloc(sizeof(short) * MPC_DFA_STATES_MAX * d->classes);
+  d->eoi = malloc(sizeof(short) * MPC_DFA_STATES_MAX);
+  states[0] = root << 1;
+  states_n[0] = 1;
+  
+  for (s = 0; s < states_num; s++) {
+    for (k = -1; k < d->classes; k++) {
+      
+      n = states_n[s];
+      memcpy(st, states + s * MPC_DFA_STACK_MAX, sizeof(int) * n);
+      a = mpc_dfa_step(b, st, &n, k < 0 ? -1 : rep[k]);
+      
+      if (a == MPC_DFA_CONSUME) {
+        for (a = 0; a < states_num; a++) {
+          if (states_n[a] == n
+          &&  memcmp(states + a * MPC_DFA_STACK_MAX, st, sizeof(int) * n) == 0) { break; }
+        }
+        if (a == states_num) {
+          if (states_num == MPC_DFA_STATES_MAX) {
+            free(states); free(states_n);
+            mpc_dfa_delete(d);
+            return NULL;
+          }
+          memcpy(states + a * MPC_DFA_STACK_MAX, st, sizeof(int) * n);
+          states_n[a] = n;
+          states_num++;
+        }
+      }
+      
+      if (k < 0) { d->eoi[s] = (short)a; }
+      else { d->trans[s * d->classes + k] = (short)a; }
+    }
+  }
+  
+  free(states);
+  free(states_n);
+  
+  d->states = states_num;
+  d->trans = realloc(d->trans, sizeof(short) * d->states * d->classes);
+  d->eoi = realloc(d->eoi, sizeof(short) * d->states);
+  return d;
+}
+
+static mpc_parser_t *mpc_re_dfa(mpc_parser_t *a) {
+  
+  mpc_parser_t *p;
+  mpc_dfa_t *d = NULL;
+  mpc_dfa_builder_t b;
+  int root;
+  
+  b.nodes = NULL; b.nodes_num = 0;
+  b.kids = NULL; b.kids_num = 0;
+  
+  root = mpc_dfa_node(&b, a);
+  if (root >= 0) { d = mpc_dfa_build(&b, root); }
+  
+  free(b.nodes);
+  free(b.kids);
+  
+  if (d == NULL) { return a; }
+  
+  p = mpc_undefined();
+  p->type = MPC_TYPE_DFA;
+  p->data.dfa.x = a;
+  p->data.dfa.dfa = d;
+  return p;
+}
+
 mpc_parser_t *mpc_re(const char *re) {
   
   char *err_msg;
@@ -2219,7 +3639,7 @@ mpc_parser_t *mpc_re(const char *re) {
   
   mpc_optimise(r.output);
   
-  return r.output;
+  return mpc_re_dfa(r.output);
   
 }
 
@@ -2560,6 +3980,9 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
   if (p->type == MPC_TYPE_APPLY)    { mpc_print_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { mpc_print_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { mpc_print_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_MEMO)     { mpc_print_unretained(p->data.memo.x, 0); }
+  if (p->type == MPC_TYPE_DFA)      { mpc_print_unretained(p->data.dfa.x, 0); }
+  if (p->type == MPC_TYPE_VM)       { mpc_print_unretained(p->data.vm.x, 0); }
 
   if (p->type == MPC_TYPE_NOT)   { mpc_print_unretained(p->data.not.x, 0); printf("!"); }
   if (p->type == MPC_TYPE_MAYBE) { mpc_print_unretained(p->data.not.x, 0); printf("?"); }
@@ -2682,6 +4105,25 @@ void mpc_ast_delete(mpc_ast_t *a) {
   
 }
 
+mpc_ast_t *mpc_ast_copy(mpc_ast_t *a) {
+  
+  int i;
+  mpc_ast_t *b;
+  
+  if (a == NULL) { return NULL; }
+  
+  b = mpc_ast_new(a->tag, a->contents);
+  b->state = a->state;
+  b->children_num = a->children_num;
+  b->children = a->children_num ?
+    malloc(sizeof(mpc_ast_t*) * a->children_num) : NULL;
+  for (i = 0; i < a->children_num; i++) {
+    b->children[i] = mpc_ast_copy(a->children[i]);
+  }
+  return b;
+  
+}
+
 static void mpc_ast_delete_no_children(mpc_ast_t *a) {
   free(a->children);
   free(a->tag);
@@ -3113,6 +4555,7 @@ mpc_parser_t *mpca_and(int n, ...) {
 }
 
 mpc_parser_t *mpca_total(mpc_parser_t *a) { return mpc_total(a, (mpc_dtor_t)mpc_ast_delete); }
+mpc_parser_t *mpca_packrat(mpc_parser_t *a) { return mpc_packrat(a, (mpc_apply_t)mpc_ast_copy, (mpc_dtor_t)mpc_ast_delete); }
 
 /*
 ** Grammar Parser
@@ -3429,6 +4872,7 @@ static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
     left = mpca_grammar_find_parser(stmt->ident, st);
     if (st->flags & MPCA_LANG_PREDICTIVE) { stmt->grammar = mpc_predictive(stmt->grammar); }
     if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
+    if (st->flags & MPCA_LANG_PACKRAT) { stmt->grammar = mpca_packrat(stmt->grammar); }
     mpc_optimise(stmt->grammar);
     mpc_define(left, stmt->grammar);
     free(stmt->ident);
@@ -3623,6 +5067,9 @@ static int mpc_nodecount_unretained(mpc_parser_t* p, int force) {
   if (p->type == MPC_TYPE_APPLY)    { return 1 + mpc_nodecount_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { return 1 + mpc_nodecount_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { return 1 + mpc_nodecount_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_MEMO)     { return 1 + mpc_nodecount_unretained(p->data.memo.x, 0); }
+  if (p->type == MPC_TYPE_DFA)      { return 1 + mpc_nodecount_unretained(p->data.dfa.x, 0); }
+  if (p->type == MPC_TYPE_VM)       { return 1 + mpc_nodecount_unretained(p->data.vm.x, 0); }
 
   if (p->type == MPC_TYPE_NOT)   { return 1 + mpc_nodecount_unretained(p->data.not.x, 0); }
   if (p->type == MPC_TYPE_MAYBE) { return 1 + mpc_nodecount_unretained(p->data.not.x, 0); }
@@ -3670,6 +5117,13 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
   if (p->type == MPC_TYPE_APPLY)    { mpc_optimise_unretained(p->data.apply.x, 0); }
   if (p->type == MPC_TYPE_APPLY_TO) { mpc_optimise_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)  { mpc_optimise_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_MEMO)     { mpc_optimise_unretained(p->data.memo.x, 0); }
+  if (p->type == MPC_TYPE_DFA)      { mpc_optimise_unretained(p->data.dfa.x, 0); }
+  if (p->type == MPC_TYPE_VM) {
+    mpc_optimise_unretained(p->data.vm.x, 0);
+    mpc_program_delete(p->data.vm.prog);
+    p->data.vm.prog = mpc_program_new(p->data.vm.x);
+  }
   if (p->type == MPC_TYPE_NOT)      { mpc_optimise_unretained(p->data.not.x, 0); }
   if (p->type == MPC_TYPE_MAYBE)    { mpc_optimise_unretained(p->data.not.x, 0); }
   if (p->type == MPC_TYPE_MANY)     { mpc_optimise_unretained(p->data.repeat.x, 0); }
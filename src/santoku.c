@@ -1,8 +1,16 @@
+#include <assert.h>
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include "mpc.h"
 
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
 // Compile our own readline function on Windows
 #ifdef _WIN32
 #include <string.h>
@@ -34,9 +42,9 @@ void add_history(char* unusued) {}
     }
 
 #define LASSERT_TYPE(func, args, index, expected) \
-    LASSERT(args, args->cell[index]->type == expected, \
+    LASSERT(args, lval_type(args->cell[index]) == expected, \
         "function '%s' argument %d was type %s, expected %s", func, index, \
-        ltype_name(args->cell[index]->type), ltype_name(expected))
+        ltype_name(lval_type(args->cell[index])), ltype_name(expected))
 
 #define LASSERT_NUM(func, args, num) \
     LASSERT(args, args->count == num, \
@@ -56,50 +64,327 @@ typedef struct lenv lenv;
 
 // Enumeration of possible lval types
 enum { LVAL_ERR, LVAL_NUM, LVAL_SYM, LVAL_BOOL, LVAL_STR, LVAL_FUN, 
-    LVAL_SEXPR, LVAL_QEXPR };
+    LVAL_SEXPR, LVAL_QEXPR, LVAL_VEC, LVAL_DBL, LVAL_RRB };
+
+// Numbers and booleans are usually immediates: rather than pointing at a
+// struct lval, the lval pointer encodes the value itself. Integers n are
+// stored as (n << 1) | 1 and the booleans as the two constants below. Heap
+// lvals are aligned, so their low two bits are clear. Use lval_type,
+// lval_to_num and lval_to_bool rather than reading these fields directly.
+#define LVAL_IS_IMM(v) ((uintptr_t)(v) & 3)
+#define LVAL_IS_INT(v) ((uintptr_t)(v) & 1)
+#define LVAL_FALSE ((lval*)2)
+#define LVAL_TRUE ((lval*)6)
+
+// Integers outside this range don't fit in an immediate, so are boxed in a
+// heap LVAL_NUM
+#define LVAL_INT_MIN (LONG_MIN >> 1)
+#define LVAL_INT_MAX (LONG_MAX >> 1)
+
+// Arithmetic and ordering operators, named by lop_names. Each group is in
+// the same order as its opcodes.
+enum { LOP_ADD, LOP_SUB, LOP_MUL, LOP_DIV, LOP_GT, LOP_GE, LOP_LT, LOP_LE };
+char* lop_names[] = { "+", "-", "*", "/", ">", ">=", "<", "<=" };
+
+// Store x op y in *r, evaluating to nonzero if the result overflowed
+#if defined(__GNUC__)
+#define LNUM_ADD(x, y, r) __builtin_add_overflow(x, y, r)
+#define LNUM_SUB(x, y, r) __builtin_sub_overflow(x, y, r)
+#define LNUM_MUL(x, y, r) __builtin_mul_overflow(x, y, r)
+#else
+#define LNUM_ADD(x, y, r) lnum_add(x, y, r)
+#define LNUM_SUB(x, y, r) lnum_sub(x, y, r)
+#define LNUM_MUL(x, y, r) lnum_mul(x, y, r)
+#endif
 
 // Enumeration of possible lval errors
 enum { LERR_DIV_ZERO, LERR_BAD_OP, LERR_BAD_NUM };
 
+// Q-expressions with at least LRRB_MIN elements may be held in a tree of
+// LVAL_RRB nodes, each with at most LRRB_WIDTH children
+#define LRRB_WIDTH 32
+#define LRRB_MIN 64
+
+// Environments with at most this many bindings are searched linearly
+#define LENV_LINEAR_MAX 8
+
+// An interned symbol name. There is exactly one lsym per distinct name, so
+// symbols are equal exactly when their lsym pointers are.
+typedef struct {
+    unsigned long hash;
+    char name[];
+} lsym;
+
+// A single symbol binding in an lenv
+typedef struct {
+    lsym* sym;
+    lval* val;
+} lentry;
+
 struct lenv {
+    // Number of owners: frames whose parent this is, lambdas which captured
+    // it, and the caller which created it
+    int refs;
     lenv* par;
     int count;
-    char** syms;
-    lval** vals;
+    int capacity;
+
+    // Bindings, in the order they were made
+    lentry* entries;
+
+    // Open addressed index over entries, built once count exceeds
+    // LENV_LINEAR_MAX. Each slot holds an entry index + 1, or 0 if empty.
+    int* slots;
+    int num_slots;
 };
 
 typedef lval*(*lbuiltin)(lenv*, lval*);
 
+// With LALLOC_USE_MALLOC, each pooled object is preceded by an lpool_node
+// linking it into a list of the pool's objects
+typedef struct lpool_node {
+    struct lpool_node* prev;
+    struct lpool_node* next;
+} lpool_node;
+
+// A pool of objects of the same size. Objects are carved out of slabs of
+// LPOOL_SLAB_SIZE bytes, and freed objects are kept on a free list. The link
+// is stored LPOOL_LINK bytes into a free object, leaving the refs of a free
+// lval or lenv intact at 0, so they can be told apart from live ones.
+typedef struct {
+    char* name;
+    size_t size;
+    void* free;
+
+    // Every slab taken from malloc, or with LALLOC_USE_MALLOC, every object
+    char** slab_list;
+    lpool_node* objects;
+
+    // Objects currently allocated, the most ever allocated at once, total
+    // allocations made, and slabs taken from malloc
+    long live;
+    long peak;
+    long allocs;
+    long slabs;
+} lpool;
+
+// Heap objects of each kind currently live, as counted by lmem_count
+typedef struct {
+    long lvals;
+    long lenvs;
+    long cells;
+    long strings;
+} lmem_stats;
+
+#define LPOOL_SLAB_SIZE 65536
+#define LPOOL_LINK 8
+
+// Variable sized blocks come from a pool per power of two size class, from
+// LALLOC_MIN_BLOCK bytes up to LALLOC_MIN_BLOCK << (LALLOC_NUM_CLASSES - 1).
+// Larger blocks are taken from malloc.
+#define LALLOC_NUM_CLASSES 6
+#define LALLOC_MIN_BLOCK 16
+
+// Define LALLOC_USE_MALLOC to allocate everything directly with malloc, so
+// that tools like ASan see every object
+
+// Bytecode instructions executed by lvm_run
+#define LVM_OPS(X) \
+    X(CONST) X(LOAD) X(LOCAL) X(JMP) X(IF) X(CALL) \
+    X(ADD) X(SUB) X(MUL) X(DIV) X(EQ) X(NEQ) X(GT) X(GE) X(LT) X(LE) \
+    X(LIST) X(HEAD) X(TAIL) X(JOIN) X(EVAL) X(DEF) X(LAMBDA) X(RET) \
+    X(DEEP)
+
+#define LVM_ENUM(op) LVM_##op,
+enum { LVM_OPS(LVM_ENUM) };
+#undef LVM_ENUM
+
+// A list compiled for evaluation as an s-expression
+typedef struct {
+    // Instructions, each followed by its operands
+    int count;
+    int capacity;
+    int* ops;
+
+    // Values referred to by the instructions
+    int num_consts;
+    int consts_capacity;
+    lval** consts;
+
+    // Stack depth reached while compiling, and the most the code needs
+    int depth;
+    int max_stack;
+
+    // Set if the list was nested too deeply to compile on the C stack
+    int deep;
+
+    // Set if the list is a lambda's body, whose symbols with a lexical
+    // address are loaded from it directly
+    int body;
+} lcode;
+
+// Values being worked on by the evaluators, kept off the C stack. Each
+// invocation of lvm_run or lval_eval_sexpr uses the part from top upwards
+// as it finds it, and addresses it by index, as growing it moves it.
+typedef struct {
+    lval** vals;
+    int size;
+    int top;
+} lstack;
+
+// Code which called a lambda, saved by lvm_run while it runs the body
+typedef struct {
+    lcode* c;
+    int* pc;
+    lenv* e;
+
+    // The list the code was compiled from and the frame it runs in, if they
+    // belong to lvm_run rather than to its caller
+    lval* src;
+    lenv* frame;
+
+    // Where the caller's values start in the value stack, and how many
+    // it had below the one the call returns into
+    int base;
+    int sp;
+} lvm_frame;
+
+// A function being called repeatedly by a builtin
+typedef struct {
+    lenv* e;
+    lval* f;
+
+    // Frame of the last call, kept for the next if nothing captured it
+    lenv* frame;
+} lcall;
+
+// Evaluators for s-expressions. The tree walker is kept as a reference.
+enum { LEVAL_VM, LEVAL_TREE };
+int lval_eval_mode = LEVAL_VM;
+
+// Values of both evaluators, and the calls lvm_run is in the middle of
+lstack leval_stack;
+struct {
+    lvm_frame* frames;
+    int size;
+    int top;
+} lvm_calls;
+
+// Lowest address the evaluators may recurse down to on the C stack, set by
+// leval_limit_stack
+char* leval_stack_limit = NULL;
+
 struct lval {
     int type;
 
-    // Fields for basic LVAL types
+    // Number of owners of this lval. Values are shared by reference and are
+    // immutable while refs > 1; mutating sites must call lval_unshare first.
+    int refs;
+
+    // Fields for basic LVAL types. num is only used by boxed integers.
     long num;
+    double dbl;
     char* err;
-    char* sym;
-    int bool;
+    lsym* sym;
     char* str;
 
+    // Elements of a vector, of which there are count
+    int64_t* vec;
+
+    // Lexical address of a symbol, filled in by lval_resolve. The binding is
+    // expected at entries[slot] of the environment depth frames up. A depth
+    // of -1 means the symbol isn't bound in a lambda's frame, and slot then
+    // caches its index in the global environment.
+    int depth;
+    int slot;
+
     // Fields for funcion LVAL types
     lbuiltin builtin;
     lenv* env;
     lval* formals;
     lval* body;
 
-    // Fields for expression LVAL types
+    // Number of formals, or -1 if the lambda takes '&' or repeats a formal
+    int arity;
+
+    // Fields for expression LVAL types. capacity is the number of cells
+    // allocated, of which the first count are in use.
     int count;
+    int capacity;
     struct lval** cell;
+
+    // For a slice, the list whose cells cell points into. The slice borrows
+    // those cells rather than owning references to them, and base is kept
+    // alive, and so unchanged, until the slice is deleted. NULL if the list
+    // owns its cells.
+    struct lval* base;
+
+    // Bytecode for evaluating the list, compiled on first use
+    lcode* code;
+
+    // For a list held in a tree, the root node, and the index in it of the
+    // list's first element. Such a list's cell is NULL, or a view of its
+    // elements made by lval_flat which borrows them from the tree.
+    struct lval* tree;
+    int offset;
+
+    // Fields for LVAL_RRB tree nodes. A node of height 0 holds elements in
+    // cell, and otherwise holds nodes of height - 1, with sizes[i] the
+    // number of elements in children 0 to i.
+    int height;
+    int* sizes;
 };
 
 char* ltype_name(int t);
 
+unsigned long lsym_hash(char* s);
+lsym* lsym_intern(char* s);
+void lsym_init(void);
+
+void* lpool_alloc(lpool* p);
+void lpool_free(lpool* p, void* x);
+void lpool_each(lpool* p, void (*fn)(void*));
+void* lalloc(size_t n);
+void* lrealloc(void* x, size_t n);
+void lfree(void* x);
+void lalloc_print_stats(void);
+void lmem_count_lval(void* x);
+lmem_stats lmem_count(void);
+
+void lgc_mark_lval(lval* v);
+void lgc_mark_lenv(lenv* e);
+void lgc_drop_lval(lval* v);
+void lgc_drop_lenv(lenv* e);
+void lgc_visit(lval* v, void (*fn)(lval*), void (*env_fn)(lenv*));
+void lgc_visit_env(lenv* e, void (*fn)(lval*), void (*env_fn)(lenv*));
+void lgc_sweep_lval(void* x);
+void lgc_sweep_lenv(void* x);
+void lgc_unmark_lval(void* x);
+void lgc_unmark_lenv(void* x);
+void lgc_collect(lenv* e, lval* v);
+void lgc_maybe_collect(lenv* e, lval* v);
+
 lenv* lenv_new(void);
+lenv* lenv_ref(lenv* e);
 void lenv_del(lenv* e);
+void lenv_index_add(lenv* e, int i);
+void lenv_index_resize(lenv* e, int num_slots);
+int lenv_find(lenv* e, lval* k);
 lval* lenv_get(lenv* e, lval* k);
 void lenv_def(lenv*e, lval* k, lval* v);
+void lenv_def_move(lenv*e, lval* k, lval* v);
 void lenv_put(lenv* e, lval* k, lval* v);
+void lenv_put_move(lenv* e, lval* k, lval* v);
+lenv* lenv_copy(lenv* e);
+lenv* lenv_unshare(lenv* e);
 
 lval* lval_num(long x);
+lval* lval_dbl(double x);
+int lval_type(lval* v);
+int lval_is_number(lval* v);
+long lval_to_num(lval* v);
+double lval_to_dbl(lval* v);
+int lval_to_bool(lval* v);
 lval* lval_err(char* fmt, ...);
 lval* lval_sym(char* s);
 lval* lval_bool(int b);
@@ -108,28 +393,76 @@ lval* lval_fun(lbuiltin func);
 lval* lval_sexpr(void);
 lval* lval_qexpr(void);
 
-lval* lval_lambda(lval* formals, lval* body);
+lval* lval_lambda(lenv* e, lval* formals, lval* body);
 void lval_del(lval* v);
 lval* lval_pop(lval* v, int i);
 lval* lval_take(lval* v, int i);
 lval* lval_join(lval* x, lval* y);
+lval* lval_resolve(lval* v, lval* formals, lenv* e);
+int lval_has_locals(lval* v);
+lval* lval_ref(lval* v);
 lval* lval_copy(lval* v);
+lval* lval_unshare(lval* v);
+lval* lval_slice(lval* v, int start, int count);
+lval* lval_flat(lval* v);
+lval* lval_tree_list(lval* t, int offset, int count);
+
+lval* lrrb_node(int height, lval** children, int n);
+int lrrb_size(lval* t);
+lval* lrrb_build(lval** cells, int n);
+int lrrb_child(lval* t, int* i);
+lval* lrrb_get(lval* t, int i);
+void lrrb_flatten(lval* t, int start, int end, lval** out);
+lval* lrrb_slice(lval* t, int start, int end);
+lval* lrrb_slice_node(lval* t, int start, int end);
+int lrrb_merge(lval* a, lval* b, lval** out);
+int lrrb_pack(int height, lval** items, int n, lval** out);
+lval* lrrb_concat(lval* a, lval* b);
+lval* lrrb_of(lval* v);
 
 lval* lval_read(mpc_ast_t* t);
 lval* lval_read_str(mpc_ast_t* t);
 lval* lval_read_num(mpc_ast_t* t);
+lval* lval_read_dbl(mpc_ast_t* t);
 lval* lval_add(lval* v, lval* x);
+void lval_reserve(lval* v, int n);
 int lval_eq(lval* x, lval* y);
+lval* lval_bind(lenv* e, lval* f, lval* a);
 lval* lval_call(lenv* e, lval* f, lval* a);
+lval* lval_tail_expr(lval* f, lval** a, int n);
 
 void lval_println(lval* v);
 void lval_print(lval* v);
 void lval_print_str(lval* v);
+void lval_print_dbl(double x);
+void lval_vec_print(lval* v);
 void lval_expr_print(lval* v, char open, char close);
 
+void leval_limit_stack(char* top);
+int leval_stack_full(void);
+lval** leval_reserve(int base, int n);
+lval* lval_eval_list(lenv* e, lval* v);
 lval* lval_eval_sexpr(lenv* e, lval* v);
 lval* lval_eval(lenv* e, lval* v);
 
+void lcode_emit(lcode* c, int x);
+int lcode_const(lcode* c, lval* v);
+void lcode_push(lcode* c, int n);
+void lcode_compile_expr(lcode* c, lval* v, int tail);
+void lcode_compile_if(lcode* c, lval* v, int tail);
+void lcode_compile_list(lcode* c, lval* v, int tail);
+lcode* lcode_compile(lval* v, int body);
+void lcode_del(lcode* c);
+lcode* lcode_get(lval* v, int body);
+
+lval* lvm_eval(lenv* e, lval* v);
+lval* lvm_call(lenv* e, lval** a, int n);
+lval* lvm_builtin(lenv* e, int op, lval** a, int n);
+lval* lvm_run(lenv* e, lcode* c);
+
+void lval_load(lenv* e, mpc_context_t* c, char* filename, mpc_parser_t* p);
+void lval_print_parse_stats(mpc_context_t* c);
+
 void lenv_add_builtins(lenv* e);
 void lenv_add_builtin(lenv* e, char* name, lbuiltin func);
 
@@ -137,18 +470,21 @@ lval* builtin(lval* a, char* func);
 lval* builtin_add(lenv* e, lval* a);
 lval* builtin_sub(lenv* e, lval* a);
 lval* builtin_mul(lenv* e, lval* a);
-lval* builtin_op(lenv* e, lval* a, char* op);
+lval* builtin_op(lenv* e, lval* a, int op);
+lval* lnum_arith(int op, lval** a, int n);
+lval* lnum_arith_dbl(int op, lval** a, int n);
+int lnum_order(int op, lval* x, lval* y);
+int lnum_cmp_dbl(lval* x, lval* y);
 
 lval* builtin_eq(lenv* e, lval* a);
 lval* builtin_neq(lenv* e, lval* a);
-lval* builtin_cmp(lenv* e, lval* a, char* op);
 
 lval* builtin_gt(lenv* e, lval* a);
 lval* builtin_ge(lenv* e, lval* a);
 lval* builtin_lt(lenv* e, lval* a);
 lval* builtin_le(lenv* e, lval* a);
 lval* builtin_div(lenv* e, lval* a);
-lval* builtin_ord(lenv* e, lval* a, char* cmp);
+lval* builtin_ord(lenv* e, lval* a, int op);
 
 lval* builtin_head(lenv* e, lval* a);
 lval* builtin_tail(lenv* e, lval* a);
@@ -161,8 +497,37 @@ lval* builtin_var(lenv* e, lval* a, char* func);
 lval* builtin_lambda(lenv* e, lval* a);
 lval* builtin_if(lenv* e, lval*a);
 
+void lcall_init(lcall* c, lenv* e, lval* f);
+void lcall_done(lcall* c);
+lval* lcall_run(lcall* c, lval** a, int n);
+int lcall_test(lcall* c, lval* x, char* func, lval** err);
+lval* builtin_map(lenv* e, lval* a);
+lval* builtin_filter(lenv* e, lval* a);
+lval* builtin_fold(lenv* e, lval* a, char* func, int left);
+lval* builtin_foldl(lenv* e, lval* a);
+lval* builtin_foldr(lenv* e, lval* a);
+lval* builtin_find(lenv* e, lval* a, char* func, int want);
+lval* builtin_any(lenv* e, lval* a);
+lval* builtin_all(lenv* e, lval* a);
+lval* builtin_mem_stats(lenv* e, lval* a);
+
+int lvec_init(char* name);
+lval* lval_vec(int n);
+int64_t* lvec_alloc(int n);
+void lvec_free(int64_t* x);
+lval* builtin_vec(lenv* e, lval* a);
+lval* builtin_vlist(lenv* e, lval* a);
+lval* builtin_vsum(lenv* e, lval* a);
+lval* builtin_vmin(lenv* e, lval* a);
+lval* builtin_vmax(lenv* e, lval* a);
+lval* builtin_vadd(lenv* e, lval* a);
+lval* builtin_vmul(lenv* e, lval* a);
+lval* builtin_vdot(lenv* e, lval* a);
+lval* builtin_vfilter_gt(lenv* e, lval* a);
+
 int main(int argc, char** argv) {
     // Create parsers
+    mpc_parser_t* Double = mpc_new("double");
     mpc_parser_t* Number = mpc_new("number");
     mpc_parser_t* Symbol = mpc_new("symbol");
     mpc_parser_t* Bool = mpc_new("bool");
@@ -176,6 +541,7 @@ int main(int argc, char** argv) {
     // Define parsers with the following language
     mpca_lang(MPCA_LANG_DEFAULT,
         " \
+            double  : /-?[0-9]+\\.[0-9]+([eE][-+]?[0-9]+)?/ ;       \
             number  : /-?[0-9]+/ ;                                  \
             symbol  : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;            \
             bool    : /#[tf]/ ;                                     \
@@ -183,37 +549,100 @@ int main(int argc, char** argv) {
             comment : /;[^\\r\\n]*/ ;                               \
             sexpr   : '(' <expr>* ')' ;                             \
             qexpr   : '{' <expr>* '}' ;                             \
-            expr    : <number> | <symbol> | <bool> | <string>       \
-                    | <comment> | <sexpr> | <qexpr> ;               \
+            expr    : <double> | <number> | <symbol> | <bool>       \
+                    | <string> | <comment> | <sexpr> | <qexpr> ;    \
             lispy   : /^/ <expr>* /$/ ;                             \
         ",
-        Number, Symbol, Bool, String, Comment, Sexpr, Qexpr, Expr, Lispy);
-
-    puts("Lispy version 0.0.1");
-    puts("Press ctrl+c to exit");
+        Double, Number, Symbol, Bool, String, Comment, Sexpr, Qexpr, Expr,
+        Lispy);
 
+    leval_limit_stack((char*)&argc);
+    lsym_init();
     lenv* e = lenv_new();
     lenv_add_builtins(e);
 
+    lvec_init(NULL);
+
+    // One parse context is reused for every file and REPL line, and the
+    // grammar is compiled for the parser VM, which doesn't recurse on the C
+    // stack however deeply the input is nested
+    mpc_context_t* ctx = mpc_context_new();
+    mpc_parser_t* Program = mpc_compile(Lispy);
+
+    // --tree selects the reference tree walking evaluator
+    // --alloc-stats prints allocator statistics and live objects on exit
+    // --simd=NAME forces the vector kernels for one instruction set
+    int first = 1;
+    int alloc_stats = 0;
+    for (; first < argc && strncmp(argv[first], "--", 2) == 0; first++) {
+        if (strcmp(argv[first], "--tree") == 0) {
+            lval_eval_mode = LEVAL_TREE;
+        } else if (strcmp(argv[first], "--alloc-stats") == 0) {
+            alloc_stats = 1;
+        } else if (strncmp(argv[first], "--simd=", 7) == 0) {
+            if (!lvec_init(argv[first] + 7)) {
+                fprintf(stderr, "Unknown instruction set '%s'\n",
+                    argv[first] + 7);
+                return 1;
+            }
+        } else {
+            fprintf(stderr, "Unknown option '%s'\n", argv[first]);
+            return 1;
+        }
+    }
+
+    // Run any files given on the command line instead of starting the REPL
+    if (argc > first) {
+        for (int i = first; i < argc; i++) {
+            lval_load(e, ctx, argv[i], Program);
+        }
+        lenv_del(e);
+        lgc_collect(NULL, NULL);
+        mpc_delete(Program);
+        mpc_cleanup(10, Double, Number, Symbol, Bool, String, Comment,
+            Sexpr, Qexpr, Expr, Lispy);
+        if (alloc_stats) {
+            lalloc_print_stats();
+            lval_print_parse_stats(ctx);
+        }
+        mpc_context_delete(ctx);
+        return 0;
+    }
+
+    puts("Lispy version 0.0.1");
+    puts("Press ctrl+c to exit");
+
     while (1) {
         char* input = readline("lispy> ");
+
+        // Exit on end of input
+        if (!input) { break; }
         add_history(input);
 
         // Attempt to parse user input
         mpc_result_t r;
-        if (mpc_parse("<stdin>", input, Lispy, &r)) {
+        if (mpc_context_parse(ctx, "<stdin>", input, Program, &r)) {
             lval* x = lval_eval(e, lval_read(r.output));
             lval_println(x);
             lval_del(x);
             mpc_ast_delete(r.output);
+            lgc_maybe_collect(e, NULL);
         } else {
             mpc_err_print(r.error);
             mpc_err_delete(r.error);
         }
         free(input);
     }
-    mpc_cleanup(8, Number, Symbol, Bool, String, Comment, Sexpr, 
+    lenv_del(e);
+    lgc_collect(NULL, NULL);
+    mpc_delete(Program);
+    mpc_cleanup(10, Double, Number, Symbol, Bool, String, Comment, Sexpr,
         Qexpr, Expr, Lispy);
+    if (alloc_stats) {
+        lalloc_print_stats();
+        lval_print_parse_stats(ctx);
+    }
+    mpc_context_delete(ctx);
     return 0;
 }
 
@@ -221,908 +650,4144 @@ char* ltype_name(int t) {
     switch(t) {
         case LVAL_FUN: return "Function";
         case LVAL_NUM: return "Number";
+        case LVAL_DBL: return "Double";
         case LVAL_ERR: return "Error";
         case LVAL_SYM: return "Symbol";
         case LVAL_BOOL: return "Boolean";
         case LVAL_STR: return "String";
         case LVAL_SEXPR: return "S-Expression";
         case LVAL_QEXPR: return "Q-Expression";
+        case LVAL_VEC: return "Vector";
         default: return "Unknown";
     }
 }
 
 /*
- * Conjure a new lenv
+ * Hash the symbol name s (FNV-1a)
  */
-lenv* lenv_new(void) {
-    lenv* e = malloc(sizeof(lenv));
-    e->par = NULL;
-    e->count = 0;
-    e->syms = NULL;
-    e->vals = NULL;
-    return e;
+unsigned long lsym_hash(char* s) {
+    unsigned long h = 14695981039346656037UL;
+    for (; *s; s++) {
+        h ^= (unsigned char)*s;
+        h *= 1099511628211UL;
+    }
+    return h;
 }
 
+// Table of every interned symbol, open addressed on lsym->hash
+static lsym** lsym_table = NULL;
+static int lsym_count = 0;
+static int lsym_slots = 0;
+
+// Symbols the interpreter itself needs to recognise
+static lsym* lsym_amp;
+
 /*
- * Delete the lenv e
+ * Return the unique interned lsym with the name s, creating it if needed
  */
-void lenv_del(lenv* e) {
-    for (int i = 0; i < e->count; i++) {
-        free(e->syms[i]);
-        lval_del(e->vals[i]);
+lsym* lsym_intern(char* s) {
+    unsigned long hash = lsym_hash(s);
+
+    if (lsym_table) {
+        int mask = lsym_slots - 1;
+        for (int i = hash & mask; lsym_table[i]; i = (i + 1) & mask) {
+            if (lsym_table[i]->hash == hash &&
+                    strcmp(lsym_table[i]->name, s) == 0) {
+                return lsym_table[i];
+            }
+        }
+    }
+
+    // Keep the table at most half full
+    if ((lsym_count + 1) * 2 > lsym_slots) {
+        int old_slots = lsym_slots;
+        lsym** old = lsym_table;
+        lsym_slots = lsym_slots ? lsym_slots * 2 : 256;
+        lsym_table = calloc(lsym_slots, sizeof(lsym*));
+        for (int i = 0; i < old_slots; i++) {
+            if (!old[i]) { continue; }
+            int j = old[i]->hash & (lsym_slots - 1);
+            while (lsym_table[j]) { j = (j + 1) & (lsym_slots - 1); }
+            lsym_table[j] = old[i];
+        }
+        free(old);
     }
-    free(e->syms);
-    free(e->vals);
-    free(e);
+
+    lsym* sym = malloc(sizeof(lsym) + strlen(s) + 1);
+    sym->hash = hash;
+    strcpy(sym->name, s);
+
+    int i = hash & (lsym_slots - 1);
+    while (lsym_table[i]) { i = (i + 1) & (lsym_slots - 1); }
+    lsym_table[i] = sym;
+    lsym_count++;
+    return sym;
 }
 
 /*
- * Return a copy of the value associated with the symbol k->sym
+ * Intern the symbols the interpreter refers to directly
  */
-lval* lenv_get(lenv* e, lval* k) {
-    for (int i = 0; i < e->count; i++) {
-        if (strcmp(e->syms[i], k->sym) == 0) {
-            return lval_copy(e->vals[i]);
-        }
-    }
+void lsym_init(void) {
+    lsym_amp = lsym_intern("&");
+}
 
-    if (e->par) {
-        return lenv_get(e->par, k);
-    } else {
-        return lval_err("unbound symbol '%s'", k->sym);
+/*
+ * Allocator
+ *
+ * lvals and lenvs are allocated from a pool each, and cell arrays, binding
+ * arrays and strings from the size class pools behind lalloc. Pools keep
+ * freed objects for reuse rather than returning them to malloc.
+ */
+
+lpool lval_pool = { "lval", sizeof(lval) };
+lpool lenv_pool = { "lenv", sizeof(lenv) };
+
+// The size class pools. Each block starts with a header giving its class, or
+// LALLOC_NUM_CLASSES if it came from malloc.
+typedef union {
+    size_t cls;
+    void* align;
+} lalloc_header;
+
+lpool lalloc_pools[LALLOC_NUM_CLASSES];
+
+// Blocks currently allocated from malloc by lalloc
+long lalloc_large = 0;
+
+// The free list link of the free object x
+#define LPOOL_NEXT(x) (*(void**)((char*)(x) + LPOOL_LINK))
+
+/*
+ * Return the space taken by each object in the pool p
+ */
+size_t lpool_stride(lpool* p) {
+    return (p->size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+}
+
+/*
+ * Allocate an object from the pool p
+ */
+void* lpool_alloc(lpool* p) {
+    p->allocs++;
+    if (++p->live > p->peak) { p->peak = p->live; }
+
+#ifdef LALLOC_USE_MALLOC
+    lpool_node* n = malloc(sizeof(lpool_node) + p->size);
+    n->prev = NULL;
+    n->next = p->objects;
+    if (p->objects) { p->objects->prev = n; }
+    p->objects = n;
+    return n + 1;
+#else
+    if (!p->free) {
+        // Thread a new, zeroed slab onto the free list
+        size_t stride = lpool_stride(p);
+        char* slab = calloc(1, LPOOL_SLAB_SIZE);
+        for (size_t i = 0; i + stride <= LPOOL_SLAB_SIZE; i += stride) {
+            LPOOL_NEXT(slab + i) = p->free;
+            p->free = slab + i;
+        }
+        p->slab_list = realloc(p->slab_list, sizeof(char*) * (p->slabs + 1));
+        p->slab_list[p->slabs++] = slab;
     }
+    void* x = p->free;
+    p->free = LPOOL_NEXT(x);
+    return x;
+#endif
 }
 
 /*
- * Put a sym, val pair in the top-level global environment
+ * Return the object x to the pool p
  */
-void lenv_def(lenv*e, lval* k, lval* v) {
-    while (e->par) { e = e->par; }
-    lenv_put(e, k, v);
+void lpool_free(lpool* p, void* x) {
+    p->live--;
+
+#ifdef LALLOC_USE_MALLOC
+    lpool_node* n = (lpool_node*)x - 1;
+    if (n->prev) { n->prev->next = n->next; } else { p->objects = n->next; }
+    if (n->next) { n->next->prev = n->prev; }
+    free(n);
+#else
+    LPOOL_NEXT(x) = p->free;
+    p->free = x;
+#endif
 }
 
 /*
- * Put a new sym, val pair in the lenv e
+ * Call fn on each object in the pool p, which may free the object
  *
- * If sym k previously existed, replace it's val with a copy of v. If it
- * didn't, add it.
+ * Objects on the free list are visited too, so fn must recognise them.
  */
-void lenv_put(lenv* e, lval* k, lval* v) {
-    for (int i = 0; i < e->count; i++) {
-        if (strcmp(e->syms[i], k->sym) == 0) {
-            e->vals[i] = lval_copy(v);
-            return;
+void lpool_each(lpool* p, void (*fn)(void*)) {
+#ifdef LALLOC_USE_MALLOC
+    for (lpool_node* n = p->objects; n;) {
+        lpool_node* next = n->next;
+        fn(n + 1);
+        n = next;
+    }
+#else
+    size_t stride = lpool_stride(p);
+    for (long i = 0; i < p->slabs; i++) {
+        for (size_t j = 0; j + stride <= LPOOL_SLAB_SIZE; j += stride) {
+            fn(p->slab_list[i] + j);
         }
     }
-    e->count++;
-    e->vals = realloc(e->vals, sizeof(lval*) * e->count);
-    e->syms = realloc(e->syms, sizeof(char*) * e->count);
-    
-    e->vals[e->count-1] = lval_copy(v);
-    e->syms[e->count-1] = malloc(strlen(k->sym) + 1);
-    strcpy(e->syms[e->count-1], k->sym);
+#endif
 }
 
-lenv* lenv_copy(lenv* e) {
-    lenv* n = malloc(sizeof(lenv));
-    n->par = e->par;
-    n->count = e->count;
-    n->syms = malloc(sizeof(char*) * n->count);
-    n->vals = malloc(sizeof(lval*) * n->count);
-    for (int i = 0; i < e->count; i++) {
-        n->syms[i] = malloc(strlen(e->syms[i]) + 1);
-        strcpy(n->syms[i], e->syms[i]);
-        n->vals[i] = lval_copy(e->vals[i]);
+/*
+ * Return the size class holding blocks of n bytes, or LALLOC_NUM_CLASSES if
+ * a block that big comes from malloc
+ */
+size_t lalloc_class(size_t n) {
+    size_t cls = 0;
+    while (cls < LALLOC_NUM_CLASSES && (LALLOC_MIN_BLOCK << cls) < n) {
+        cls++;
     }
-    return n;
+    return cls;
 }
 
-lval* lval_num(long x) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_NUM;
-    v->num = x;
-    return v;
+/*
+ * Allocate a block of n bytes
+ */
+void* lalloc(size_t n) {
+#ifdef LALLOC_USE_MALLOC
+    return malloc(n);
+#else
+    size_t cls = lalloc_class(n);
+    lalloc_header* h;
+    if (cls < LALLOC_NUM_CLASSES) {
+        lpool* p = &lalloc_pools[cls];
+        if (!p->size) {
+            p->name = "block";
+            p->size = sizeof(lalloc_header) + (LALLOC_MIN_BLOCK << cls);
+        }
+        h = lpool_alloc(p);
+    } else {
+        h = malloc(sizeof(lalloc_header) + n);
+        lalloc_large++;
+    }
+    h->cls = cls;
+    return h + 1;
+#endif
 }
 
-lval* lval_err(char* fmt, ...) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_ERR;
+/*
+ * Resize the block x, which may be NULL, to n bytes
+ *
+ * x is only moved if it changes size class, or if it came from malloc.
+ */
+void* lrealloc(void* x, size_t n) {
+#ifdef LALLOC_USE_MALLOC
+    return realloc(x, n);
+#else
+    if (!x) { return lalloc(n); }
+
+    lalloc_header* h = (lalloc_header*)x - 1;
+    size_t cls = lalloc_class(n);
+    if (cls == h->cls && cls < LALLOC_NUM_CLASSES) { return x; }
+    if (cls == LALLOC_NUM_CLASSES && h->cls == LALLOC_NUM_CLASSES) {
+        h = realloc(h, sizeof(lalloc_header) + n);
+        return h + 1;
+    }
 
-    va_list va;
-    va_start(va, fmt);
+    // Move between pools, or between a pool and malloc
+    void* y = lalloc(n);
+    size_t old = h->cls < LALLOC_NUM_CLASSES ?
+        (size_t)LALLOC_MIN_BLOCK << h->cls : n;
+    memcpy(y, x, old < n ? old : n);
+    lfree(x);
+    return y;
+#endif
+}
 
-    // Allocate 152 bytes of space for the error message
-    v->err = malloc(512);
+/*
+ * Free the block x, which may be NULL
+ */
+void lfree(void* x) {
+#ifdef LALLOC_USE_MALLOC
+    free(x);
+#else
+    if (!x) { return; }
+    lalloc_header* h = (lalloc_header*)x - 1;
+    if (h->cls < LALLOC_NUM_CLASSES) {
+        lpool_free(&lalloc_pools[h->cls], h);
+    } else {
+        free(h);
+        lalloc_large--;
+    }
+#endif
+}
 
-    // Print the error string (max 511 chars)
-    vsnprintf(v->err, 511, fmt, va);
+/*
+ * Garbage collector
+ *
+ * Reference counting frees values as soon as their last owner drops them,
+ * but never frees a cycle, such as a lambda bound in the environment it
+ * captured. lgc_collect finds these by marking everything reachable from its
+ * roots and freeing every other lval and lenv in the pools. Values held in C
+ * locals, on leval_stack or in the VM's saved frames aren't roots, so it must
+ * only be called where the evaluator holds nothing: between top level
+ * expressions.
+ *
+ * This means a cycle is only reclaimed once the top level expression which
+ * dropped it has returned. A long running expression, such as a loop which
+ * defines a local recursive lambda on each iteration, keeps every cycle it
+ * makes until it finishes.
+ */
 
-    // Reallocate to number of bytes acutally used
-    v->err = realloc(v->err, strlen(v->err) + 1);
+// Set in the refs of an object marked reachable during a collection
+#define LGC_MARK (1 << 30)
 
-    // Clean up va list
-    va_end(va); 
+// Collect once this many lvals and lenvs are live
+#define LGC_MIN_THRESHOLD 100000
+long lgc_threshold = LGC_MIN_THRESHOLD;
 
-    return v;
-}
+// Objects waiting to be scanned, then the garbage found by the sweep. lenvs
+// are tagged by setting their low bit.
+void** lgc_stack = NULL;
+long lgc_count = 0;
+long lgc_capacity = 0;
 
-lval* lval_sym(char* s) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_SYM;
-    v->sym = malloc(strlen(s) + 1);
-    strcpy(v->sym, s);
-    return v;
-}
+// Collections run, and the objects they freed
+long lgc_collections = 0;
+long lgc_freed = 0;
 
-lval* lval_bool(int b) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_BOOL;
-    v->bool = b;
-    return v;
+/*
+ * Push the object x onto lgc_stack
+ */
+void lgc_push(void* x) {
+    if (lgc_count == lgc_capacity) {
+        lgc_capacity = lgc_capacity ? lgc_capacity * 2 : 256;
+        lgc_stack = realloc(lgc_stack, sizeof(void*) * lgc_capacity);
+    }
+    lgc_stack[lgc_count++] = x;
 }
 
-lval* lval_str(char* s) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_STR;
-    v->str = malloc(strlen(s) + 1);
-    strcpy(v->str, s);
-    return(v);
+/*
+ * Mark v reachable, queueing it to have its children marked
+ */
+void lgc_mark_lval(lval* v) {
+    if (LVAL_IS_IMM(v) || (v->refs & LGC_MARK)) { return; }
+    v->refs |= LGC_MARK;
+    lgc_push(v);
 }
 
-lval* lval_fun(lbuiltin func) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_FUN;
-    v->builtin = func;
-    return v;
+void lgc_mark_lenv(lenv* e) {
+    if (e->refs & LGC_MARK) { return; }
+    e->refs |= LGC_MARK;
+    lgc_push((char*)e + 1);
 }
 
-lval* lval_sexpr(void) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_SEXPR;
-    v->count = 0;
-    v->cell = NULL;
-    return v;
+/*
+ * Drop a garbage object's reference to v. Garbage is freed by the sweep
+ * regardless of its refs, so only references to survivors are counted.
+ */
+void lgc_drop_lval(lval* v) {
+    if (!LVAL_IS_IMM(v) && (v->refs & LGC_MARK)) { v->refs--; }
 }
 
-lval* lval_qexpr(void) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_QEXPR;
-    v->count = 0;
-    v->cell = NULL;
-    return v;
+void lgc_drop_lenv(lenv* e) {
+    if (e->refs & LGC_MARK) { e->refs--; }
 }
 
-lval* lval_lambda(lval* formals, lval* body) {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_FUN;
-
-    v->builtin = NULL;
-
-    v->env = lenv_new();
+/*
+ * Call fn on each lval v holds a reference to, and env_fn on each lenv
+ */
+void lgc_visit(lval* v, void (*fn)(lval*), void (*env_fn)(lenv*)) {
+    switch (v->type) {
+        case LVAL_FUN:
+            if (!v->builtin) {
+                env_fn(v->env);
+                fn(v->formals);
+                fn(v->body);
+            }
+            break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            if (v->base) {
+                fn(v->base);
+            } else if (v->tree) {
+                fn(v->tree);
+            } else {
+                for (int i = 0; i < v->count; i++) { fn(v->cell[i]); }
+            }
+            if (v->code) {
+                for (int i = 0; i < v->code->num_consts; i++) {
+                    fn(v->code->consts[i]);
+                }
+            }
+            break;
+        case LVAL_RRB:
+            for (int i = 0; i < v->count; i++) { fn(v->cell[i]); }
+            break;
+    }
+}
 
-    v->formals = formals;
-    v->body = body;
-    return v;
+void lgc_visit_env(lenv* e, void (*fn)(lval*), void (*env_fn)(lenv*)) {
+    for (int i = 0; i < e->count; i++) { fn(e->entries[i].val); }
+    if (e->par) { env_fn(e->par); }
 }
 
-void lval_del(lval* v) {
+/*
+ * If the pooled lval x is unreachable garbage, release what it holds and
+ * queue it to be freed
+ */
+void lgc_sweep_lval(void* x) {
+    lval* v = x;
+    if (v->refs == 0 || (v->refs & LGC_MARK)) { return; }
+
+    lgc_visit(v, lgc_drop_lval, lgc_drop_lenv);
     switch (v->type) {
-        case LVAL_NUM: break;
-        case LVAL_ERR: break;
-        case LVAL_SYM: break;
-        case LVAL_BOOL: break;
-        case LVAL_STR: break;
-        case LVAL_FUN:
-           if (!v->builtin) {
-               lenv_del(v->env);
-               lval_del(v->formals);
-               lval_del(v->body);
-           }
-           break;
-        case LVAL_QEXPR:
+        case LVAL_ERR: lfree(v->err); break;
+        case LVAL_STR: lfree(v->str); break;
         case LVAL_SEXPR:
-            for (int i = 0; i < v->count; i++) {
-               lval_del(v->cell[i]);
+        case LVAL_QEXPR:
+            if (!v->base) { lfree(v->cell); }
+            if (v->code) {
+                // The constants were dropped above
+                v->code->num_consts = 0;
+                lcode_del(v->code);
             }
-            // also free memory allocated to contain the pointers
-            free(v->cell);
+            break;
+        case LVAL_VEC: lvec_free(v->vec); break;
+        case LVAL_RRB:
+            lfree(v->cell);
+            lfree(v->sizes);
             break;
     }
-    // Free memory allocated to the lval struct itself
-    free(v);
+    lgc_push(v);
+}
+
+void lgc_sweep_lenv(void* x) {
+    lenv* e = x;
+    if (e->refs == 0 || (e->refs & LGC_MARK)) { return; }
+
+    lgc_visit_env(e, lgc_drop_lval, lgc_drop_lenv);
+    lfree(e->entries);
+    lfree(e->slots);
+    lgc_push((char*)e + 1);
 }
 
 /*
- * Pop the LVAL at v's ith cell
+ * Clear the mark on the pooled lval or lenv x
  */
-lval* lval_pop(lval* v, int i) {
-    // Find item at i
-    lval* x = v->cell[i];
+void lgc_unmark_lval(void* x) { ((lval*)x)->refs &= ~LGC_MARK; }
+void lgc_unmark_lenv(void* x) { ((lenv*)x)->refs &= ~LGC_MARK; }
 
-    // Shift memory after the item at i over the top
-    memmove(&v->cell[i], &v->cell[i+1], sizeof(lval*) * (v->count-i-1));
+/*
+ * Free every lval and lenv which isn't reachable from the environment e or
+ * the value v, either of which may be NULL. Nothing the evaluator is holding
+ * is a root, so this must not be called during an evaluation.
+ */
+void lgc_collect(lenv* e, lval* v) {
+    // Mark everything reachable from the roots
+    if (e) { lgc_mark_lenv(e); }
+    if (v) { lgc_mark_lval(v); }
+    while (lgc_count) {
+        void* x = lgc_stack[--lgc_count];
+        if ((uintptr_t)x & 1) {
+            lgc_visit_env((lenv*)((char*)x - 1), lgc_mark_lval,
+                lgc_mark_lenv);
+        } else {
+            lgc_visit(x, lgc_mark_lval, lgc_mark_lenv);
+        }
+    }
 
-    // Decrease count of items in the list
-    v->count--;
+    // Release everything held by unmarked objects. Nothing is freed until
+    // every object has been looked at, as marks are read through pointers
+    // from garbage.
+    lpool_each(&lval_pool, lgc_sweep_lval);
+    lpool_each(&lenv_pool, lgc_sweep_lenv);
+    lgc_freed += lgc_count;
+    while (lgc_count) {
+        void* x = lgc_stack[--lgc_count];
+        if ((uintptr_t)x & 1) {
+            lenv* g = (lenv*)((char*)x - 1);
+            g->refs = 0;
+            lpool_free(&lenv_pool, g);
+        } else {
+            ((lval*)x)->refs = 0;
+            lpool_free(&lval_pool, x);
+        }
+    }
 
-    v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-    return x;
+    lpool_each(&lval_pool, lgc_unmark_lval);
+    lpool_each(&lenv_pool, lgc_unmark_lenv);
+    lgc_collections++;
 }
 
 /*
- * Return the LVAL at v's ith cell. Delete v.
+ * Collect garbage, with e and v as roots, if enough objects are live
  */
-lval* lval_take(lval* v, int i) {
-    lval* x = lval_pop(v, i);
-    lval_del(v);
-    return x;
+void lgc_maybe_collect(lenv* e, lval* v) {
+    if (lval_pool.live + lenv_pool.live < lgc_threshold) { return; }
+    lgc_collect(e, v);
+
+    // Let the heap grow to twice what survived before collecting again
+    lgc_threshold = (lval_pool.live + lenv_pool.live) * 2;
+    if (lgc_threshold < LGC_MIN_THRESHOLD) {
+        lgc_threshold = LGC_MIN_THRESHOLD;
+    }
 }
 
 /*
- * Add each cell in y to x, delete y
+ * Print the usage of each pool to stderr
  */
-lval* lval_join(lval*x, lval*y) {
-    while (y->count) {
-        x = lval_add(x, lval_pop(y, 0));
+void lalloc_print_stats(void) {
+    lpool* pools[2 + LALLOC_NUM_CLASSES] = { &lval_pool, &lenv_pool };
+    for (int i = 0; i < LALLOC_NUM_CLASSES; i++) {
+        pools[2 + i] = &lalloc_pools[i];
     }
 
-    lval_del(y);
-    return x;
+    fprintf(stderr, "%-8s %6s %10s %10s %12s %6s\n",
+        "pool", "size", "live", "peak", "allocs", "slabs");
+    for (int i = 0; i < 2 + LALLOC_NUM_CLASSES; i++) {
+        lpool* p = pools[i];
+        if (!p->allocs) { continue; }
+        fprintf(stderr, "%-8s %6zu %10ld %10ld %12ld %6ld\n",
+            p->name, p->size, p->live, p->peak, p->allocs, p->slabs);
+    }
+#ifndef LALLOC_USE_MALLOC
+    fprintf(stderr, "large blocks live: %ld\n", lalloc_large);
+#endif
+    fprintf(stderr, "collections: %ld, objects freed: %ld\n",
+        lgc_collections, lgc_freed);
+
+    lmem_stats m = lmem_count();
+    fprintf(stderr, "live: %ld lvals, %ld lenvs, %ld cell arrays, "
+        "%ld strings\n", m.lvals, m.lenvs, m.cells, m.strings);
 }
 
-lval* lval_copy(lval* v) {
-    lval* x = malloc(sizeof(lval));
-    x->type = v->type;
+// The counts being gathered by lmem_count
+lmem_stats lmem_counted;
+
+/*
+ * Count the arrays and strings owned by the pooled lval x
+ */
+void lmem_count_lval(void* x) {
+    lval* v = x;
+    if (v->refs == 0) { return; }
 
     switch (v->type) {
-        case LVAL_NUM: x->num = v->num; break;
-        case LVAL_BOOL: x->bool = v->bool; break;
         case LVAL_ERR:
-            x->err = malloc(strlen(v->err) + 1);
-            strcpy(x->err, v->err);
-            break;
-        case LVAL_SYM:
-            x->sym = malloc(strlen(v->sym) + 1);
-            strcpy(x->sym, v->sym);
-            break;
-        
         case LVAL_STR:
-            x->str = malloc(strlen(v->str) + 1);
-            strcpy(x->str, v->str);
-            break;
-        
-        case LVAL_FUN: 
-            if (v->builtin) {
-               x->builtin = v->builtin; 
-            } else {
-               x->builtin = NULL;
-               x->env = lenv_copy(v->env);
-               x->formals = lval_copy(v->formals);
-               x->body = lval_copy(v->body);
-            }
+            lmem_counted.strings++;
             break;
-
         case LVAL_SEXPR:
         case LVAL_QEXPR:
-            x->count = v->count;
-            x->cell = malloc(sizeof(lval*) * x->count);
-            for (int i = 0; i < x->count; i++) {
-                x->cell[i] = lval_copy(v->cell[i]);
-            }
+            // A slice borrows its base's cells
+            if (v->cell && !v->base) { lmem_counted.cells++; }
+            break;
+        case LVAL_RRB:
+            lmem_counted.cells++;
             break;
     }
-    return x;
 }
 
 /*
- * Recursively read the AST into a tree of LVAL nodes.
+ * Count the live heap objects of each kind
+ *
+ * lvals and lenvs are counted by their pools, and the arrays and strings
+ * they own by looking at every live lval, so nothing is tracked on the
+ * allocation paths themselves. A count which keeps growing while a program
+ * repeats the same work is a leak.
  */
-lval* lval_read(mpc_ast_t* t) {
-    if (strstr(t->tag, "number")) { return lval_read_num(t); }
-    if (strstr(t->tag, "symbol")) { return lval_sym(t->contents); }
-    if (strstr(t->tag, "bool")) {
-        if (strcmp(t->contents, "#t") == 0) {
-            return lval_bool(1);
-        } else {
-            return lval_bool(0);
-        }
-    }
-    if (strstr(t->tag, "string")) { return lval_read_str(t); }
-
-    // If root ('>') or sexpr, create an empty list
-    lval* x = NULL;
-    if (strcmp(t->tag, ">") == 0) { x = lval_sexpr(); }
-    if (strstr(t->tag, "sexpr")) { x = lval_sexpr(); }
-    if (strstr(t->tag, "qexpr")) { x = lval_qexpr(); }
+lmem_stats lmem_count(void) {
+    lmem_counted = (lmem_stats){ lval_pool.live, lenv_pool.live, 0, 0 };
+    lpool_each(&lval_pool, lmem_count_lval);
+    return lmem_counted;
+}
 
-    // Fill in the list with any valid expressions
-    for (int i = 0; i < t->children_num; i++) {
-        if (strcmp(t->children[i]->contents, "(") == 0) { continue; }
-        if (strcmp(t->children[i]->contents, ")") == 0) { continue; }
-        if (strcmp(t->children[i]->contents, "{") == 0) { continue; }
-        if (strcmp(t->children[i]->contents, "}") == 0) { continue; }
-        if (strcmp(t->children[i]->tag, "regex") == 0) { continue; }
-        if (strstr(t->children[i]->tag, "comment")) { continue; }
-        x = lval_add(x, lval_read(t->children[i]));
-    }
-    return x;
+/*
+ * Conjure a new lenv
+ */
+lenv* lenv_new(void) {
+    lenv* e = lpool_alloc(&lenv_pool);
+    e->refs = 1;
+    e->par = NULL;
+    e->count = 0;
+    e->capacity = 0;
+    e->entries = NULL;
+    e->slots = NULL;
+    e->num_slots = 0;
+    return e;
 }
 
 /*
- * Create an LVAL number node
- *
- * Converts the number string at t->contents to a c long.
- * If the number can't be parsed, returns an LVAL error node.
+ * Add an owner to the lenv e, returning e
  */
-lval* lval_read_num(mpc_ast_t* t) {
-    errno = 0;
-    long x = strtol(t->contents, NULL, 10);
-    return errno != ERANGE ? lval_num(x) : lval_err("invalid number");
+lenv* lenv_ref(lenv* e) {
+    e->refs++;
+    return e;
 }
 
 /*
- * Create an LVAL string node
+ * Release the caller's hold on the lenv e, deleting it if it has no other
+ * owner
  */
-lval* lval_read_str(mpc_ast_t* t) {
-    // Remove quote characters (") from around raw string
-    t->contents[strlen(t->contents) - 1] = '\0';
-    char* unescaped = malloc(strlen(t->contents+1) + 1);
-    strcpy(unescaped, t->contents+1);
-    // Pass though unescape function
-    unescaped = mpcf_unescape(unescaped);
+void lenv_del(lenv* e) {
+    if (--e->refs > 0) { return; }
 
-    // Construct new LVAL
-    lval* str = lval_str(unescaped);
-    free(unescaped);
-    return str;
-} 
+    for (int i = 0; i < e->count; i++) {
+        lval_del(e->entries[i].val);
+    }
+    if (e->par) { lenv_del(e->par); }
+    lfree(e->entries);
+    lfree(e->slots);
+    lpool_free(&lenv_pool, e);
+}
 
 /*
- * Add x to v's cell array.
+ * Add entry i to the slot index of e. The index must have a free slot.
  */
-lval* lval_add(lval* v, lval* x) {
-    v->count++;
-    v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-    v->cell[v->count-1] = x;
-    return v;
+void lenv_index_add(lenv* e, int i) {
+    int mask = e->num_slots - 1;
+    int s = e->entries[i].sym->hash & mask;
+    while (e->slots[s]) { s = (s + 1) & mask; }
+    e->slots[s] = i + 1;
 }
 
 /*
- * Returns an 1 or 0 indicating whether x and y are equal.
+ * Rebuild the slot index of e with num_slots slots
  */
-int lval_eq(lval* x, lval* y) {
-    if (x->type != y->type) { return 0; }
-    switch (x->type) {
-        case LVAL_NUM: { return x->num == y->num; }
-        case LVAL_BOOL: { return x->bool == y->bool; }
-        case LVAL_ERR: { return strcmp(x->err, y->err) == 0; }
-        case LVAL_SYM: { return strcmp(x->sym, y->sym) == 0; }
-        case LVAL_STR: { return strcmp(x->str, y->str) == 0; }
+void lenv_index_resize(lenv* e, int num_slots) {
+    lfree(e->slots);
+    e->slots = lalloc(sizeof(int) * num_slots);
+    memset(e->slots, 0, sizeof(int) * num_slots);
+    e->num_slots = num_slots;
+    for (int i = 0; i < e->count; i++) { lenv_index_add(e, i); }
+}
 
-        case LVAL_FUN: {
-            if (x->builtin || y->builtin) {
-                return x->builtin == y->builtin;
-            } else {
-                return lval_eq(x->formals, y->formals) && 
-                    lval_eq(x->body, y->body);
-            }
+/*
+ * Return the index of the entry binding k->sym in e (not its parents), or -1
+ */
+int lenv_find(lenv* e, lval* k) {
+    // Small environments are cheaper to scan than to hash into
+    if (!e->slots) {
+        for (int i = 0; i < e->count; i++) {
+            if (e->entries[i].sym == k->sym) { return i; }
         }
-        case LVAL_QEXPR:
-        case LVAL_SEXPR:
-            if (x->count != y->count) { return 0; }
-            for (int i = 0; i < x->count; i++) {
-                if (!lval_eq(x->cell[i], y->cell[i])) { return 0; }
-            }
-            return 1;
+        return -1;
     }
-    return 0;
+
+    int mask = e->num_slots - 1;
+    for (int s = k->sym->hash & mask; e->slots[s]; s = (s + 1) & mask) {
+        if (e->entries[e->slots[s] - 1].sym == k->sym) {
+            return e->slots[s] - 1;
+        }
+    }
+    return -1;
 }
 
 /*
- * Call the function f with arguments a
- *
- * If the number of arguments < number of f's formals, partially evaluate
- * f and return the partially evaluated function.
+ * Return a new reference to the value associated with the symbol k->sym
  */
-lval* lval_call(lenv* e, lval* f, lval* a) {
-    // If function is builtin, call it
-    if (f->builtin) { return f->builtin(e, a); }
-
-    // Record arg counts
-    int given = a->count;
-    int total = f->formals->count;
-
-    while (a->count) {
-        // If we run out of formal arguments to bind
-        if (f->formals->count == 0) {
-            lval_del(a);
-            return lval_err(
-                "Function passed too many arguments. "
-                "Expected %d, got %d", total, given);
+lval* lenv_get(lenv* e, lval* k) {
+    // k's lexical address is only a hint. Quoted code, such as a branch
+    // passed to another function, is evaluated in whatever frames its eval
+    // runs in, where a nearer frame may bind the same name. Jumping straight
+    // to the frame depth parents up would then find a binding the name
+    // lookup wouldn't, even with the symbol there matching.
+    for (int depth = 0; e; e = e->par, depth++) {
+        // Try k's lexical address before searching the frame. Nearer frames
+        // have already been searched, so a hit is the binding we'd find.
+        int i = depth == k->depth || !e->par ? k->slot : -1;
+        if (i < 0 || i >= e->count || e->entries[i].sym != k->sym) {
+            i = lenv_find(e, k);
         }
+        if (i < 0) { continue; }
 
-        // Pop the first symbol from the formals
-        lval* sym = lval_pop(f->formals, 0);
-
-        // Check for &, which indicates a function with a variable number of
-        // arguments
-        if (strcmp(sym->sym, "&") == 0) {
-            // Ensure '&' is followed by another symbol
-            if (f->formals->count != 1) {
-                lval_del(a);
-                return lval_err("function format invalid. "
-                    "Symbol '&' not followed by a single symbol");
-            }
+        // Remember where unresolved symbols live in the global environment
+        if (!e->par && k->depth < 0) { k->slot = i; }
+        return lval_ref(e->entries[i].val);
+    }
+    return lval_err("unbound symbol '%s'", k->sym->name);
+}
 
-            // Next formal should be bound to the remaining arguments
-            lval* nsym = lval_pop(f->formals, 0);
-            lenv_put(f->env, nsym, builtin_list(e, a));
-            lval_del(sym);
-            lval_del(nsym);
-            break;
-        }
+/*
+ * Put a sym, val pair in the top-level global environment
+ */
+void lenv_def(lenv*e, lval* k, lval* v) {
+    lenv_def_move(e, k, lval_ref(v));
+}
 
-        // Pop the next argument from the list
-        lval* val = lval_pop(a, 0);
+/*
+ * As lenv_def, but taking the caller's reference to v
+ */
+void lenv_def_move(lenv*e, lval* k, lval* v) {
+    while (e->par) { e = e->par; }
+    lenv_put_move(e, k, v);
+}
 
-        // Bind a copy into the function's environment
-        lenv_put(f->env, sym, val);
+/*
+ * Put a new sym, val pair in the lenv e
+ *
+ * If sym k previously existed, replace it's val with a reference to v. If it
+ * didn't, add it.
+ */
+void lenv_put(lenv* e, lval* k, lval* v) {
+    lenv_put_move(e, k, lval_ref(v));
+}
 
-        // Delete symbol and value
-        lval_del(sym); lval_del(val);
+/*
+ * As lenv_put, but taking the caller's reference to v. A value which v
+ * replaces is deleted.
+ */
+void lenv_put_move(lenv* e, lval* k, lval* v) {
+    int i = lenv_find(e, k);
+    if (i >= 0) {
+        lval_del(e->entries[i].val);
+        e->entries[i].val = v;
+        return;
     }
 
-    // Argument list is now bound, so it can be cleaned up
-    lval_del(a);
+    if (e->count == e->capacity) {
+        e->capacity = e->capacity ? e->capacity * 2 : 4;
+        e->entries = lrealloc(e->entries, sizeof(lentry) * e->capacity);
+    }
 
-    // If '&' remains in the formal list, bind to an empty list
-    if (f->formals->count > 0 &&
-            strcmp(f->formals->cell[0]->sym, "&") == 0) {
+    lentry* en = &e->entries[e->count++];
+    en->sym = k->sym;
+    en->val = v;
 
-        // Check to ensure '&' is not passed invalidly
-        if (f->formals->count != 2) {
-            return lval_err("function format invalid. "
-                "Symbol '&' not followed by a single symbol");
+    // Keep the index at most half full
+    if (e->count > LENV_LINEAR_MAX) {
+        if (e->count * 2 > e->num_slots) {
+            lenv_index_resize(e, e->num_slots ? e->num_slots * 2 : 32);
+        } else {
+            lenv_index_add(e, e->count - 1);
         }
+    }
+}
 
-        // Pop and delete '&'
-        lval_del(lval_pop(f->formals, 0));
+lenv* lenv_copy(lenv* e) {
+    lenv* n = lpool_alloc(&lenv_pool);
+    n->refs = 1;
+    n->par = e->par ? lenv_ref(e->par) : NULL;
+    n->count = e->count;
+    n->capacity = e->count;
+    n->entries = lalloc(sizeof(lentry) * n->count);
+    for (int i = 0; i < e->count; i++) {
+        n->entries[i].sym = e->entries[i].sym;
+        n->entries[i].val = lval_ref(e->entries[i].val);
+    }
+    n->num_slots = e->num_slots;
+    n->slots = NULL;
+    if (e->slots) {
+        n->slots = lalloc(sizeof(int) * n->num_slots);
+        memcpy(n->slots, e->slots, sizeof(int) * n->num_slots);
+    }
+    return n;
+}
 
-        // Pop next symbol and create empty list
-        lval* sym = lval_pop(f->formals, 0);
-        lval* val = lval_qexpr();
+/*
+ * Return an lenv with the bindings of e which the caller owns outright,
+ * copying e only if something else holds it too. Consumes e.
+ */
+lenv* lenv_unshare(lenv* e) {
+    if (e->refs == 1) { return e; }
+    lenv* n = lenv_copy(e);
+    lenv_del(e);
+    return n;
+}
 
-        // Bind to environment and delete
-        lenv_put(f->env, sym, val);
-        lval_del(sym);
-        lval_del(val);
+lval* lval_num(long x) {
+    if (x >= LVAL_INT_MIN && x <= LVAL_INT_MAX) {
+        return (lval*)(((uintptr_t)x << 1) | 1);
     }
 
-    // If all formals have been bound, evaluate
-    if (f->formals->count == 0) {
-        f->env->par = e;
-        return builtin_eval(
-            f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
-    } else {
-        // Otherwise return the partially evaluated function
-        return lval_copy(f);
-    }
+    lval* v = lpool_alloc(&lval_pool);
+    v->type = LVAL_NUM;
+    v->refs = 1;
+    v->num = x;
+    return v;
+}
+
+lval* lval_dbl(double x) {
+    lval* v = lpool_alloc(&lval_pool);
+    v->type = LVAL_DBL;
+    v->refs = 1;
+    v->dbl = x;
+    return v;
 }
 
 /*
- * Print an LVAL and a newline
+ * Return the type of v, which may be an immediate
  */
-void lval_println(lval* v) { lval_print(v); putchar('\n'); }
+int lval_type(lval* v) {
+    if (!LVAL_IS_IMM(v)) { return v->type; }
+    return LVAL_IS_INT(v) ? LVAL_NUM : LVAL_BOOL;
+}
 
 /*
- * Print an LVAL
+ * Return whether v is an integer or a double
  */
-void lval_print(lval* v) {
-    switch (v->type) {
-        case LVAL_NUM: printf("%li", v->num); break;
-        case LVAL_ERR: printf("Error: %s", v->err); break;
-        case LVAL_SYM: printf("%s", v->sym); break;
-        case LVAL_STR: lval_print_str(v); break;
-        case LVAL_BOOL:
-           if (v->bool) {
-               printf("#t"); break;
-           } else {
-               printf("#f"); break;
-           }
-        case LVAL_FUN: 
-            if (v->builtin) {
-                printf("<builtin>");
-            } else {
-                printf("(\\ ");
-                lval_print(v->formals);
-                putchar(' ');
-                lval_print(v->body);
-                putchar(')');
-            }
-            break;
-        case LVAL_SEXPR: lval_expr_print(v, '(', ')'); break;
-        case LVAL_QEXPR: lval_expr_print(v, '{', '}'); break;
-    }
+int lval_is_number(lval* v) {
+    int t = lval_type(v);
+    return t == LVAL_NUM || t == LVAL_DBL;
+}
+
+/*
+ * Return the value of the number v
+ */
+long lval_to_num(lval* v) {
+    if (LVAL_IS_INT(v)) { return (long)((intptr_t)v >> 1); }
+    return v->num;
+}
+
+/*
+ * Return the value of the integer or double v as a double
+ */
+double lval_to_dbl(lval* v) {
+    if (LVAL_IS_INT(v)) { return (double)((intptr_t)v >> 1); }
+    return v->type == LVAL_DBL ? v->dbl : (double)v->num;
+}
+
+/*
+ * Return the value of the boolean v
+ */
+int lval_to_bool(lval* v) {
+    return v == LVAL_TRUE;
+}
+
+lval* lval_err(char* fmt, ...) {
+    lval* v = lpool_alloc(&lval_pool);
+    v->type = LVAL_ERR;
+    v->refs = 1;
+
+    va_list va;
+    va_start(va, fmt);
+
+    // Allocate 152 bytes of space for the error message
+    v->err = lalloc(512);
+
+    // Print the error string (max 511 chars)
+    vsnprintf(v->err, 511, fmt, va);
+
+    // Reallocate to number of bytes acutally used
+    v->err = lrealloc(v->err, strlen(v->err) + 1);
+
+    // Clean up va list
+    va_end(va); 
+
+    return v;
+}
+
+lval* lval_sym(char* s) {
+    lval* v = lpool_alloc(&lval_pool);
+    v->type = LVAL_SYM;
+    v->refs = 1;
+    v->sym = lsym_intern(s);
+    v->depth = -1;
+    v->slot = -1;
+    return v;
+}
+
+lval* lval_bool(int b) {
+    return b ? LVAL_TRUE : LVAL_FALSE;
+}
+
+lval* lval_str(char* s) {
+    lval* v = lpool_alloc(&lval_pool);
+    v->type = LVAL_STR;
+    v->refs = 1;
+    v->str = lalloc(strlen(s) + 1);
+    strcpy(v->str, s);
+    return(v);
+}
+
+lval* lval_fun(lbuiltin func) {
+    lval* v = lpool_alloc(&lval_pool);
+    v->type = LVAL_FUN;
+    v->refs = 1;
+    v->builtin = func;
+    return v;
+}
+
+lval* lval_sexpr(void) {
+    lval* v = lpool_alloc(&lval_pool);
+    v->type = LVAL_SEXPR;
+    v->refs = 1;
+    v->count = 0;
+    v->capacity = 0;
+    v->cell = NULL;
+    v->base = NULL;
+    v->code = NULL;
+    v->tree = NULL;
+    return v;
+}
+
+lval* lval_qexpr(void) {
+    lval* v = lpool_alloc(&lval_pool);
+    v->type = LVAL_QEXPR;
+    v->refs = 1;
+    v->count = 0;
+    v->capacity = 0;
+    v->cell = NULL;
+    v->base = NULL;
+    v->code = NULL;
+    v->tree = NULL;
+    return v;
+}
+
+/*
+ * Conjure a lambda closing over the lenv e
+ *
+ * The lambda's env holds the arguments it has been partially applied to, and
+ * its parent is e. Both are shared by every copy of the lambda.
+ */
+lval* lval_lambda(lenv* e, lval* formals, lval* body) {
+    lval* v = lpool_alloc(&lval_pool);
+    v->type = LVAL_FUN;
+    v->refs = 1;
+
+    v->builtin = NULL;
+
+    v->env = lenv_new();
+    v->env->par = lenv_ref(e);
+
+    v->formals = formals;
+    v->body = body;
+
+    v->arity = formals->count;
+    for (int i = 0; i < formals->count; i++) {
+        if (formals->cell[i]->sym == lsym_amp) { v->arity = -1; }
+        for (int j = 0; j < i; j++) {
+            if (formals->cell[i]->sym == formals->cell[j]->sym) {
+                v->arity = -1;
+            }
+        }
+    }
+    return v;
+}
+
+void lval_del(lval* v) {
+    // Immediates aren't allocated, and v is only freed once its last owner
+    // lets go of it
+    if (LVAL_IS_IMM(v) || --v->refs > 0) { return; }
+
+    switch (v->type) {
+        case LVAL_NUM: break;
+        case LVAL_DBL: break;
+        case LVAL_ERR: lfree(v->err); break;
+        case LVAL_SYM: break;
+        case LVAL_STR: lfree(v->str); break;
+        case LVAL_FUN:
+           if (!v->builtin) {
+               lenv_del(v->env);
+               lval_del(v->formals);
+               lval_del(v->body);
+           }
+           break;
+        case LVAL_QEXPR:
+        case LVAL_SEXPR:
+            if (v->base) {
+                // A slice's cells belong to its base
+                lval_del(v->base);
+                if (v->code) { lcode_del(v->code); }
+                break;
+            }
+            if (v->tree) {
+                // The elements belong to the tree, and cell is only a view
+                lval_del(v->tree);
+                lfree(v->cell);
+                if (v->code) { lcode_del(v->code); }
+                break;
+            }
+            for (int i = 0; i < v->count; i++) {
+               lval_del(v->cell[i]);
+            }
+            // also free memory allocated to contain the pointers
+            lfree(v->cell);
+            if (v->code) { lcode_del(v->code); }
+            break;
+        case LVAL_VEC: lvec_free(v->vec); break;
+        case LVAL_RRB:
+            for (int i = 0; i < v->count; i++) { lval_del(v->cell[i]); }
+            lfree(v->cell);
+            lfree(v->sizes);
+            break;
+    }
+    // Free memory allocated to the lval struct itself
+    lpool_free(&lval_pool, v);
+}
+
+/*
+ * Pop the LVAL at v's ith cell
+ *
+ * Mutates v, so the caller must hold the only reference to it.
+ */
+lval* lval_pop(lval* v, int i) {
+    // Find item at i
+    lval* x = v->cell[i];
+
+    // Shift memory after the item at i over the top
+    memmove(&v->cell[i], &v->cell[i+1], sizeof(lval*) * (v->count-i-1));
+
+    // Decrease count of items in the list, keeping the space for reuse
+    v->count--;
+    return x;
+}
+
+/*
+ * Return the LVAL at v's ith cell. Delete v.
+ */
+lval* lval_take(lval* v, int i) {
+    lval* x = lval_pop(v, i);
+    lval_del(v);
+    return x;
+}
+
+/*
+ * Return the q-expression of the cells of x followed by those of y, deleting
+ * both
+ *
+ * Once the result has LRRB_MIN elements it is held in a tree, and joining
+ * trees is O(log n). Shorter results are joined by adding y's cells to x.
+ */
+lval* lval_join(lval*x, lval*y) {
+    if (x->count && y->count &&
+            (x->tree || y->tree || x->count + y->count >= LRRB_MIN)) {
+        lval* a = lrrb_of(x);
+        lval* b = lrrb_of(y);
+        lval* t = lrrb_concat(a, b);
+        int count = x->count + y->count;
+        lval_del(a);
+        lval_del(b);
+        lval_del(x);
+        lval_del(y);
+        return lval_tree_list(t, 0, count);
+    }
+    if (!y->count) {
+        lval_del(y);
+        return x;
+    }
+    if (!x->count) {
+        lval_del(x);
+        return y;
+    }
+
+    x = lval_unshare(x);
+    lval_flat(y);
+    lval_reserve(x, x->count + y->count);
+    if (y->refs == 1 && !y->base && !y->tree) {
+        // Move y's references across, leaving y empty
+        memcpy(&x->cell[x->count], y->cell, sizeof(lval*) * y->count);
+        x->count += y->count;
+        y->count = 0;
+    } else {
+        for (int i = 0; i < y->count; i++) {
+            x->cell[x->count++] = lval_ref(y->cell[i]);
+        }
+    }
+
+    lval_del(y);
+    return x;
+}
+
+/*
+ * Take another reference to v
+ */
+lval* lval_ref(lval* v) {
+    if (!LVAL_IS_IMM(v)) { v->refs++; }
+    return v;
+}
+
+/*
+ * Make a shallow copy of v
+ *
+ * Children of expressions and the formals and body of lambdas are shared with
+ * v rather than copied, so the copy is only as deep as the caller mutates it.
+ */
+lval* lval_copy(lval* v) {
+    if (LVAL_IS_IMM(v)) { return v; }
+
+    lval* x = lpool_alloc(&lval_pool);
+    x->type = v->type;
+    x->refs = 1;
+
+    switch (v->type) {
+        case LVAL_NUM: x->num = v->num; break;
+        case LVAL_DBL: x->dbl = v->dbl; break;
+        case LVAL_ERR:
+            x->err = lalloc(strlen(v->err) + 1);
+            strcpy(x->err, v->err);
+            break;
+        case LVAL_SYM:
+            x->sym = v->sym;
+            x->depth = v->depth;
+            x->slot = v->slot;
+            break;
+        
+        case LVAL_STR:
+            x->str = lalloc(strlen(v->str) + 1);
+            strcpy(x->str, v->str);
+            break;
+        
+        case LVAL_FUN: 
+            if (v->builtin) {
+               x->builtin = v->builtin; 
+            } else {
+               x->builtin = NULL;
+               x->env = lenv_ref(v->env);
+               x->formals = lval_ref(v->formals);
+               x->body = lval_ref(v->body);
+               x->arity = v->arity;
+            }
+            break;
+
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            lval_flat(v);
+            x->count = v->count;
+            x->capacity = v->count;
+            x->code = NULL;
+            x->base = NULL;
+            x->tree = NULL;
+            x->cell = lalloc(sizeof(lval*) * x->count);
+            for (int i = 0; i < x->count; i++) {
+                x->cell[i] = lval_ref(v->cell[i]);
+            }
+            break;
+
+        case LVAL_VEC:
+            x->count = v->count;
+            x->vec = lvec_alloc(v->count);
+            memcpy(x->vec, v->vec, sizeof(int64_t) * v->count);
+            break;
+    }
+    return x;
+}
+
+/*
+ * Return a version of v which the caller may mutate
+ *
+ * If v has other owners, or is a slice, it is copied and the caller's
+ * reference to v is dropped.
+ */
+lval* lval_unshare(lval* v) {
+    if (LVAL_IS_IMM(v)) { return v; }
+
+    // Slices and lists held in trees don't own their cells, so are copied
+    // even if nothing else holds them
+    int list = v->type == LVAL_SEXPR || v->type == LVAL_QEXPR;
+    if (v->refs == 1 && !(list && (v->base || v->tree))) {
+        // v is about to change, so code compiled from it will be stale
+        if (list && v->code) {
+            lcode_del(v->code);
+            v->code = NULL;
+        }
+        return v;
+    }
+    lval* x = lval_copy(v);
+    lval_del(v);
+    return x;
+}
+
+/*
+ * Return the count elements of the list v from index start on, deleting v
+ *
+ * The result is a slice sharing v's cells, or if v is held in a tree another
+ * window onto it, so making it is O(1) whatever the length of v.
+ */
+lval* lval_slice(lval* v, int start, int count) {
+    if (v->tree) {
+        lval* x = lval_tree_list(lval_ref(v->tree), v->offset + start, count);
+        lval_del(v);
+        return x;
+    }
+
+    if (v->refs == 1 && v->base) {
+        // v is a slice only the caller holds, so narrow it in place
+        if (v->code) {
+            lcode_del(v->code);
+            v->code = NULL;
+        }
+        v->cell += start;
+        v->count = count;
+        return v;
+    }
+
+    lval* x = v->type == LVAL_SEXPR ? lval_sexpr() : lval_qexpr();
+    x->cell = v->cell + start;
+    x->count = count;
+    x->base = lval_ref(v->base ? v->base : v);
+    lval_del(v);
+    return x;
+}
+
+/*
+ * Return v, giving it a flat view of its cells if it is a list held in a
+ * tree. The view borrows the elements from the tree, and is kept until v is
+ * deleted.
+ */
+lval* lval_flat(lval* v) {
+    if (LVAL_IS_IMM(v) || v->type != LVAL_QEXPR || !v->tree || v->cell) {
+        return v;
+    }
+    v->cell = lalloc(sizeof(lval*) * v->count);
+    lrrb_flatten(v->tree, v->offset, v->offset + v->count, v->cell);
+    return v;
+}
+
+/*
+ * Return a q-expression of the count elements of the tree t from index
+ * offset on, consuming the caller's reference to t. Lists shorter than
+ * LRRB_MIN are made flat.
+ */
+lval* lval_tree_list(lval* t, int offset, int count) {
+    lval* x = lval_qexpr();
+    x->count = count;
+    if (count < LRRB_MIN) {
+        x->capacity = count;
+        x->cell = lalloc(sizeof(lval*) * count);
+        lrrb_flatten(t, offset, offset + count, x->cell);
+        for (int i = 0; i < count; i++) { lval_ref(x->cell[i]); }
+        lval_del(t);
+        return x;
+    }
+    x->tree = t;
+    x->offset = offset;
+    return x;
+}
+
+/*
+ * Persistent vectors
+ *
+ * Long q-expressions are held in relaxed radix balanced trees, so that they
+ * can be joined and sliced without copying their cells. Nodes are LVAL_RRB
+ * lvals, which are never changed once made, so versions of a list share
+ * every node they have in common. Each node has up to LRRB_WIDTH children
+ * and records the number of elements under each prefix of its children, so
+ * nodes needn't be full and an element is found in O(log n).
+ */
+
+/*
+ * Make a node of the given height from the n children, taking the caller's
+ * references to them
+ */
+lval* lrrb_node(int height, lval** children, int n) {
+    lval* t = lpool_alloc(&lval_pool);
+    t->type = LVAL_RRB;
+    t->refs = 1;
+    t->height = height;
+    t->count = n;
+    t->cell = lalloc(sizeof(lval*) * n);
+    memcpy(t->cell, children, sizeof(lval*) * n);
+    t->sizes = NULL;
+    if (height > 0) {
+        t->sizes = lalloc(sizeof(int) * n);
+        for (int i = 0, size = 0; i < n; i++) {
+            size += lrrb_size(children[i]);
+            t->sizes[i] = size;
+        }
+    }
+    return t;
+}
+
+/*
+ * Return the number of elements under the node t
+ */
+int lrrb_size(lval* t) {
+    return t->height ? t->sizes[t->count - 1] : t->count;
+}
+
+/*
+ * Return the index of the child of t holding element i, and make i relative
+ * to that child
+ */
+int lrrb_child(lval* t, int* i) {
+    int c = *i / LRRB_WIDTH;
+    if (c >= t->count) { c = t->count - 1; }
+    while (c > 0 && t->sizes[c - 1] > *i) { c--; }
+    while (t->sizes[c] <= *i) { c++; }
+    if (c > 0) { *i -= t->sizes[c - 1]; }
+    return c;
+}
+
+/*
+ * Build a tree of the n cells, which are borrowed rather than consumed
+ */
+lval* lrrb_build(lval** cells, int n) {
+    int count = (n + LRRB_WIDTH - 1) / LRRB_WIDTH;
+    lval** level = lalloc(sizeof(lval*) * count);
+    for (int i = 0; i < count; i++) {
+        int start = i * LRRB_WIDTH;
+        int size = n - start < LRRB_WIDTH ? n - start : LRRB_WIDTH;
+        for (int j = 0; j < size; j++) { lval_ref(cells[start + j]); }
+        level[i] = lrrb_node(0, &cells[start], size);
+    }
+
+    // Group each level into parents until one node is left
+    for (int height = 1; count > 1; height++) {
+        int parents = (count + LRRB_WIDTH - 1) / LRRB_WIDTH;
+        for (int i = 0; i < parents; i++) {
+            int start = i * LRRB_WIDTH;
+            int size = count - start < LRRB_WIDTH ?
+                count - start : LRRB_WIDTH;
+            level[i] = lrrb_node(height, &level[start], size);
+        }
+        count = parents;
+    }
+
+    lval* t = level[0];
+    lfree(level);
+    return t;
+}
+
+/*
+ * Return element i of the tree t, without taking a reference to it
+ */
+lval* lrrb_get(lval* t, int i) {
+    while (t->height) { t = t->cell[lrrb_child(t, &i)]; }
+    return t->cell[i];
+}
+
+/*
+ * Write the elements of t from index start up to end to out, without taking
+ * references to them
+ */
+void lrrb_flatten(lval* t, int start, int end, lval** out) {
+    if (!t->height) {
+        memcpy(out, &t->cell[start], sizeof(lval*) * (end - start));
+        return;
+    }
+    int first = start;
+    for (int c = lrrb_child(t, &first); start < end; c++) {
+        int size = lrrb_size(t->cell[c]);
+        int n = size - first < end - start ? size - first : end - start;
+        lrrb_flatten(t->cell[c], first, first + n, out);
+        out += n;
+        start += n;
+        first = 0;
+    }
+}
+
+/*
+ * Return a tree of the elements of t from index start up to end, which must
+ * not be empty
+ */
+lval* lrrb_slice(lval* t, int start, int end) {
+    lval* x = lrrb_slice_node(t, start, end);
+
+    // Drop any levels with only one child
+    while (x->height && x->count == 1) {
+        lval* child = lval_ref(x->cell[0]);
+        lval_del(x);
+        x = child;
+    }
+    return x;
+}
+
+/*
+ * Return a node of the same height as t, holding its elements from index
+ * start up to end. Children wholly inside the range are shared.
+ */
+lval* lrrb_slice_node(lval* t, int start, int end) {
+    if (start == 0 && end == lrrb_size(t)) { return lval_ref(t); }
+    if (!t->height) {
+        for (int i = start; i < end; i++) { lval_ref(t->cell[i]); }
+        return lrrb_node(0, &t->cell[start], end - start);
+    }
+
+    lval* children[LRRB_WIDTH];
+    int n = 0;
+    int first = start;
+    for (int c = lrrb_child(t, &first); start < end; c++) {
+        int size = lrrb_size(t->cell[c]);
+        int count = size - first < end - start ? size - first : end - start;
+        children[n++] = lrrb_slice_node(t->cell[c], first, first + count);
+        start += count;
+        first = 0;
+    }
+    return lrrb_node(t->height, children, n);
+}
+
+/*
+ * Make nodes of the given height from the n items, taking the caller's
+ * references to them. n is at most twice LRRB_WIDTH, and the items are
+ * split evenly between two nodes if they don't fit in one. Returns the
+ * number of nodes written to out.
+ */
+int lrrb_pack(int height, lval** items, int n, lval** out) {
+    if (n <= LRRB_WIDTH) {
+        out[0] = lrrb_node(height, items, n);
+        return 1;
+    }
+    out[0] = lrrb_node(height, items, n / 2);
+    out[1] = lrrb_node(height, &items[n / 2], n - n / 2);
+    return 2;
+}
+
+/*
+ * Write one or two nodes holding the elements of a followed by those of b to
+ * out, returning how many. They have the height of the taller of a and b.
+ *
+ * Only the nodes along the right edge of a and the left edge of b are
+ * remade, merging neighbours which fit in one node, so that joining many
+ * short lists still gives a shallow tree.
+ */
+int lrrb_merge(lval* a, lval* b, lval** out) {
+    lval* items[2 * LRRB_WIDTH];
+    int n = 0;
+    int height = a->height > b->height ? a->height : b->height;
+
+    if (a->height == 0 && b->height == 0) {
+        for (int i = 0; i < a->count; i++) {
+            items[n++] = lval_ref(a->cell[i]);
+        }
+        for (int i = 0; i < b->count; i++) {
+            items[n++] = lval_ref(b->cell[i]);
+        }
+        return lrrb_pack(0, items, n, out);
+    }
+
+    // Merge the edges below this level, keeping the rest of the children
+    lval* mid[2];
+    int m;
+    if (a->height > b->height) {
+        m = lrrb_merge(a->cell[a->count - 1], b, mid);
+        for (int i = 0; i < a->count - 1; i++) {
+            items[n++] = lval_ref(a->cell[i]);
+        }
+        memcpy(&items[n], mid, sizeof(lval*) * m);
+        n += m;
+    } else if (b->height > a->height) {
+        m = lrrb_merge(a, b->cell[0], mid);
+        memcpy(&items[n], mid, sizeof(lval*) * m);
+        n += m;
+        for (int i = 1; i < b->count; i++) {
+            items[n++] = lval_ref(b->cell[i]);
+        }
+    } else {
+        m = lrrb_merge(a->cell[a->count - 1], b->cell[0], mid);
+        for (int i = 0; i < a->count - 1; i++) {
+            items[n++] = lval_ref(a->cell[i]);
+        }
+        memcpy(&items[n], mid, sizeof(lval*) * m);
+        n += m;
+        for (int i = 1; i < b->count; i++) {
+            items[n++] = lval_ref(b->cell[i]);
+        }
+    }
+    return lrrb_pack(height, items, n, out);
+}
+
+/*
+ * Return a tree of the elements of a followed by those of b
+ */
+lval* lrrb_concat(lval* a, lval* b) {
+    lval* out[2];
+    if (lrrb_merge(a, b, out) == 1) { return out[0]; }
+    return lrrb_node(out[0]->height + 1, out, 2);
+}
+
+/*
+ * Return a tree of the elements of the non-empty list v
+ */
+lval* lrrb_of(lval* v) {
+    if (!v->tree) { return lrrb_build(v->cell, v->count); }
+    if (v->offset == 0 && v->count == lrrb_size(v->tree)) {
+        return lval_ref(v->tree);
+    }
+    return lrrb_slice(v->tree, v->offset, v->offset + v->count);
+}
+
+/*
+ * Annotate the symbols in the body v of a lambda created in e with their
+ * lexical addresses
+ *
+ * Symbols naming one of formals are bound in the lambda's own frame, at the
+ * slot given by the formal's position. Other symbols are looked up in the
+ * frames of e, which a lambda's frame never gains bindings in once its body
+ * runs, so the address found is exact for code run as the lambda's body.
+ * Symbols bound in no frame are left to the global environment. v may be
+ * shared, so changed nodes are copied and the rest of the tree is shared with
+ * the returned value.
+ */
+lval* lval_resolve(lval* v, lval* formals, lenv* e) {
+    switch (lval_type(v)) {
+        case LVAL_SYM: {
+            int depth = -1;
+            int slot = v->depth < 0 ? v->slot : -1;
+
+            // Formals are bound in order, except for '&' which isn't bound,
+            // and repeats, which are bound over the first
+            int formal = 0;
+            for (int i = 0, bound = 0; i < formals->count; i++) {
+                lsym* s = formals->cell[i]->sym;
+                if (s == v->sym) {
+                    depth = 0;
+                    slot = bound;
+                    formal = 1;
+                    break;
+                }
+                int repeat = s == lsym_amp;
+                for (int j = 0; j < i && !repeat; j++) {
+                    repeat = formals->cell[j]->sym == s;
+                }
+                if (!repeat) { bound++; }
+            }
+
+            // Stop short of the global environment, which can gain bindings
+            for (int d = 1; !formal && e && e->par; e = e->par, d++) {
+                int i = lenv_find(e, v);
+                if (i >= 0) {
+                    depth = d;
+                    slot = i;
+                    break;
+                }
+            }
+
+            if (depth == v->depth && slot == v->slot) { return lval_ref(v); }
+            lval* x = lval_copy(v);
+            x->depth = depth;
+            x->slot = slot;
+            return x;
+        }
+
+        case LVAL_SEXPR:
+        case LVAL_QEXPR: {
+            // Only copy v if one of its children changed
+            lval_flat(v);
+            lval* x = NULL;
+            for (int i = 0; i < v->count; i++) {
+                lval* c = lval_resolve(v->cell[i], formals, e);
+                if (c == v->cell[i] && !x) {
+                    lval_del(c);
+                    continue;
+                }
+                if (!x) { x = lval_copy(v); }
+                lval_del(x->cell[i]);
+                x->cell[i] = c;
+            }
+            return x ? x : lval_ref(v);
+        }
+
+        default: return lval_ref(v);
+    }
+}
+
+/*
+ * Return whether v holds a symbol with a lexical address in a lambda's frame
+ */
+int lval_has_locals(lval* v) {
+    if (lval_type(v) == LVAL_SYM) { return v->depth >= 0; }
+    if (lval_type(v) != LVAL_SEXPR && lval_type(v) != LVAL_QEXPR) { return 0; }
+    lval_flat(v);
+    for (int i = 0; i < v->count; i++) {
+        if (lval_has_locals(v->cell[i])) { return 1; }
+    }
+    return 0;
+}
+
+/*
+ * Recursively read the AST into a tree of LVAL nodes.
+ */
+lval* lval_read(mpc_ast_t* t) {
+    if (strstr(t->tag, "double")) { return lval_read_dbl(t); }
+    if (strstr(t->tag, "number")) { return lval_read_num(t); }
+    if (strstr(t->tag, "symbol")) { return lval_sym(t->contents); }
+    if (strstr(t->tag, "bool")) {
+        if (strcmp(t->contents, "#t") == 0) {
+            return lval_bool(1);
+        } else {
+            return lval_bool(0);
+        }
+    }
+    if (strstr(t->tag, "string")) { return lval_read_str(t); }
+
+    // If root ('>') or sexpr, create an empty list
+    lval* x = NULL;
+    if (strcmp(t->tag, ">") == 0) { x = lval_sexpr(); }
+    if (strstr(t->tag, "sexpr")) { x = lval_sexpr(); }
+    if (strstr(t->tag, "qexpr")) { x = lval_qexpr(); }
+
+    // Fill in the list with any valid expressions
+    for (int i = 0; i < t->children_num; i++) {
+        if (strcmp(t->children[i]->contents, "(") == 0) { continue; }
+        if (strcmp(t->children[i]->contents, ")") == 0) { continue; }
+        if (strcmp(t->children[i]->contents, "{") == 0) { continue; }
+        if (strcmp(t->children[i]->contents, "}") == 0) { continue; }
+        if (strcmp(t->children[i]->tag, "regex") == 0) { continue; }
+        if (strstr(t->children[i]->tag, "comment")) { continue; }
+        x = lval_add(x, lval_read(t->children[i]));
+    }
+    return x;
+}
+
+/*
+ * Create an LVAL number node
+ *
+ * Converts the number string at t->contents to a c long.
+ * If the number can't be parsed, returns an LVAL error node.
+ */
+lval* lval_read_num(mpc_ast_t* t) {
+    errno = 0;
+    long x = strtol(t->contents, NULL, 10);
+    return errno != ERANGE ? lval_num(x) : lval_err("invalid number");
+}
+
+/*
+ * Create an LVAL double node from the string at t->contents
+ */
+lval* lval_read_dbl(mpc_ast_t* t) {
+    errno = 0;
+    double x = strtod(t->contents, NULL);
+    return errno != ERANGE ? lval_dbl(x) : lval_err("invalid number");
+}
+
+/*
+ * Create an LVAL string node
+ */
+lval* lval_read_str(mpc_ast_t* t) {
+    // Remove quote characters (") from around raw string
+    t->contents[strlen(t->contents) - 1] = '\0';
+    char* unescaped = malloc(strlen(t->contents+1) + 1);
+    strcpy(unescaped, t->contents+1);
+    // Pass though unescape function
+    unescaped = mpcf_unescape(unescaped);
+
+    // Construct new LVAL
+    lval* str = lval_str(unescaped);
+    free(unescaped);
+    return str;
+} 
+
+/*
+ * Add x to v's cell array.
+ */
+lval* lval_add(lval* v, lval* x) {
+    lval_reserve(v, v->count + 1);
+    v->cell[v->count++] = x;
+    return v;
+}
+
+/*
+ * Make room for at least n cells in the list v
+ *
+ * The capacity at least doubles when it grows, so appending to a list one
+ * cell at a time is amortized O(1).
+ */
+void lval_reserve(lval* v, int n) {
+    if (n <= v->capacity) { return; }
+    int capacity = v->capacity ? v->capacity * 2 : 4;
+    if (capacity < n) { capacity = n; }
+    v->cell = lrealloc(v->cell, sizeof(lval*) * capacity);
+    v->capacity = capacity;
+}
+
+/*
+ * Returns an 1 or 0 indicating whether x and y are equal. An integer and a
+ * double are equal if they are exactly the same number.
+ */
+int lval_eq(lval* x, lval* y) {
+    if (lval_type(x) != lval_type(y)) {
+        return lval_is_number(x) && lval_is_number(y) &&
+            lnum_cmp_dbl(x, y) == 0;
+    }
+    switch (lval_type(x)) {
+        case LVAL_NUM: { return lval_to_num(x) == lval_to_num(y); }
+        case LVAL_DBL: { return x->dbl == y->dbl; }
+        case LVAL_BOOL: { return x == y; }
+        case LVAL_ERR: { return strcmp(x->err, y->err) == 0; }
+        case LVAL_SYM: { return x->sym == y->sym; }
+        case LVAL_STR: { return strcmp(x->str, y->str) == 0; }
+
+        case LVAL_FUN: {
+            if (x->builtin || y->builtin) {
+                return x->builtin == y->builtin;
+            } else {
+                return lval_eq(x->formals, y->formals) && 
+                    lval_eq(x->body, y->body);
+            }
+        }
+        case LVAL_QEXPR:
+        case LVAL_SEXPR:
+            if (x->count != y->count) { return 0; }
+            lval_flat(x);
+            lval_flat(y);
+            for (int i = 0; i < x->count; i++) {
+                if (!lval_eq(x->cell[i], y->cell[i])) { return 0; }
+            }
+            return 1;
+        case LVAL_VEC:
+            return x->count == y->count &&
+                memcmp(x->vec, y->vec, sizeof(int64_t) * x->count) == 0;
+    }
+    return 0;
+}
+
+/*
+ * Bind the arguments a to the formals of the lambda f, deleting a
+ *
+ * Bound formals are popped from f->formals and put in f->env, which is first
+ * copied if other functions share it. Returns an error if a doesn't fit f's
+ * formals, otherwise NULL.
+ */
+lval* lval_bind(lenv* e, lval* f, lval* a) {
+    // Record arg counts
+    int given = a->count;
+    int total = f->formals->count;
+
+    // Partial applications share the arguments bound so far, so bind into a
+    // frame of our own
+    f->env = lenv_unshare(f->env);
+
+    while (a->count) {
+        // If we run out of formal arguments to bind
+        if (f->formals->count == 0) {
+            lval_del(a);
+            return lval_err(
+                "Function passed too many arguments. "
+                "Expected %d, got %d", total, given);
+        }
+
+        // Pop the first symbol from the formals
+        f->formals = lval_unshare(f->formals);
+        lval* sym = lval_pop(f->formals, 0);
+
+        // Check for &, which indicates a function with a variable number of
+        // arguments
+        if (sym->sym == lsym_amp) {
+            // Ensure '&' is followed by another symbol
+            if (f->formals->count != 1) {
+                lval_del(a);
+                return lval_err("function format invalid. "
+                    "Symbol '&' not followed by a single symbol");
+            }
+
+            // Next formal should be bound to the remaining arguments, which
+            // uses up the formals and the argument list
+            lval* nsym = lval_pop(f->formals, 0);
+            lenv_put_move(f->env, nsym, builtin_list(e, a));
+            lval_del(sym);
+            lval_del(nsym);
+            return NULL;
+        }
+
+        // Move the next argument into the function's environment
+        lenv_put_move(f->env, sym, lval_pop(a, 0));
+        lval_del(sym);
+    }
+
+    // Argument list is now bound, so it can be cleaned up
+    lval_del(a);
+
+    // If '&' remains in the formal list, bind to an empty list
+    if (f->formals->count > 0 &&
+            f->formals->cell[0]->sym == lsym_amp) {
+
+        // Check to ensure '&' is not passed invalidly
+        if (f->formals->count != 2) {
+            return lval_err("function format invalid. "
+                "Symbol '&' not followed by a single symbol");
+        }
+
+        // Pop and delete '&'
+        f->formals = lval_unshare(f->formals);
+        lval_del(lval_pop(f->formals, 0));
+
+        // Pop next symbol and bind it to an empty list
+        lval* sym = lval_pop(f->formals, 0);
+        lenv_put_move(f->env, sym, lval_qexpr());
+        lval_del(sym);
+    }
+    return NULL;
+}
+
+/*
+ * Call the function f with arguments a
+ *
+ * If the number of arguments < number of f's formals, partially evaluate
+ * f and return the partially evaluated function.
+ */
+lval* lval_call(lenv* e, lval* f, lval* a) {
+    // If function is builtin, call it
+    if (f->builtin) { return f->builtin(e, a); }
+
+    lval* err = lval_bind(e, f, a);
+    if (err) { return err; }
+
+    // If all formals have been bound, evaluate
+    if (f->formals->count == 0) {
+        if (lval_eval_mode == LEVAL_VM) {
+            return lvm_run(f->env, lcode_get(f->body, 1));
+        }
+        return lval_eval_sexpr(f->env, lval_ref(f->body));
+    } else {
+        // Otherwise return the partially evaluated function
+        return lval_ref(f);
+    }
+}
+
+/*
+ * Return the q-expression which calling the builtin f with the n arguments a
+ * would evaluate as its result, or NULL if f must be called normally
+ *
+ * These are the tail positions of 'eval' and 'if', which the evaluators run
+ * in place of the call rather than nesting a new evaluation.
+ */
+lval* lval_tail_expr(lval* f, lval** a, int n) {
+    if (f->builtin == builtin_eval) {
+        return n == 1 && lval_type(a[0]) == LVAL_QEXPR ? a[0] : NULL;
+    }
+    if (f->builtin == builtin_if) {
+        if ((n != 2 && n != 3) || lval_type(a[0]) != LVAL_BOOL) {
+            return NULL;
+        }
+        for (int i = 1; i < n; i++) {
+            if (lval_type(a[i]) != LVAL_QEXPR) { return NULL; }
+        }
+        if (lval_to_bool(a[0])) { return a[1]; }
+        return n == 3 ? a[2] : NULL;
+    }
+    return NULL;
+}
+
+/*
+ * Print an LVAL and a newline
+ */
+void lval_println(lval* v) { lval_print(v); putchar('\n'); }
+
+/*
+ * Print a vector's elements between square brackets
+ */
+void lval_vec_print(lval* v) {
+    putchar('[');
+    for (int i = 0; i < v->count; i++) {
+        if (i != 0) { putchar(' '); }
+        printf("%lli", (long long)v->vec[i]);
+    }
+    putchar(']');
+}
+
+/*
+ * Print an LVAL
+ */
+void lval_print(lval* v) {
+    switch (lval_type(v)) {
+        case LVAL_NUM: printf("%li", lval_to_num(v)); break;
+        case LVAL_DBL: lval_print_dbl(v->dbl); break;
+        case LVAL_ERR: printf("Error: %s", v->err); break;
+        case LVAL_SYM: printf("%s", v->sym->name); break;
+        case LVAL_STR: lval_print_str(v); break;
+        case LVAL_BOOL:
+           if (lval_to_bool(v)) {
+               printf("#t"); break;
+           } else {
+               printf("#f"); break;
+           }
+        case LVAL_FUN: 
+            if (v->builtin) {
+                printf("<builtin>");
+            } else {
+                printf("(\\ ");
+                lval_print(v->formals);
+                putchar(' ');
+                lval_print(v->body);
+                putchar(')');
+            }
+            break;
+        case LVAL_SEXPR: lval_expr_print(v, '(', ')'); break;
+        case LVAL_QEXPR: lval_expr_print(v, '{', '}'); break;
+        case LVAL_VEC: lval_vec_print(v); break;
+    }
+}
+
+/*
+ * Print a double with the fewest digits that read back as the same value,
+ * and with a decimal point so that it reads back as a double at all
+ */
+void lval_print_dbl(double x) {
+    char buf[32];
+    for (int digits = 15; digits <= 17; digits++) {
+        snprintf(buf, sizeof(buf), "%.*g", digits, x);
+        if (strtod(buf, NULL) == x) { break; }
+    }
+    if (isfinite(x) && !strpbrk(buf, ".e")) { strcat(buf, ".0"); }
+    printf("%s", buf);
+}
+
+void lval_print_str(lval* v) {
+    char* escaped = malloc(strlen(v->str) + 1);
+    strcpy(escaped, v->str);
+
+    escaped = mpcf_escape(escaped);
+
+    printf("\"%s\"", escaped);
+
+    free(escaped);
+}
+
+/*
+ * Print an LVAL s expression
+ */
+void lval_expr_print(lval* v, char open, char close) {
+    lval_flat(v);
+    putchar(open);
+    for (int i = 0; i < v->count; i++) {
+        lval_print(v->cell[i]);
+        if (i != (v->count - 1)) {
+            putchar(' ');
+        }
+    }
+    putchar(close);
+}
+
+/*
+ * Let the evaluators recurse on the C stack until it is nearly full, taking
+ * top as an address near its start
+ */
+void leval_limit_stack(char* top) {
+#ifdef _WIN32
+    size_t size = 1 << 20;
+#else
+    size_t size = 8 << 20;
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_STACK, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+        size = rl.rlim_cur;
+    }
+#endif
+    // Leave an eighth of it for the builtins the evaluators call
+    leval_stack_limit = top - (size - size / 8);
+}
+
+/*
+ * Return whether the C stack is too deep for the evaluators to recurse
+ */
+int leval_stack_full(void) {
+    char here;
+    return (uintptr_t)&here < (uintptr_t)leval_stack_limit;
+}
+
+/*
+ * Make room for n values from base in the value stack, returning where
+ * they start. Nested evaluations use the stack from base + n.
+ */
+lval** leval_reserve(int base, int n) {
+    lstack* s = &leval_stack;
+    if (base + n > s->size) {
+        s->size = (base + n) * 2;
+        s->vals = realloc(s->vals, sizeof(lval*) * s->size);
+    }
+    s->top = base + n;
+    return s->vals + base;
+}
+
+/*
+ * Recursively evaluate the LVAL AST
+ */
+lval* lval_eval(lenv* e, lval* v) {
+    if (lval_type(v) == LVAL_SYM) {
+        lval* x = lenv_get(e, v);
+        lval_del(v);
+        return x;
+    }
+    // Evaluate s expressions
+    if (lval_type(v) == LVAL_SEXPR) { return lval_eval_list(e, v); }
+    return v;
+}
+
+/*
+ * Evaluate the list v as an s-expression, whether it is one or a
+ * q-expression, deleting v
+ *
+ * Neither evaluator changes v, so code can be evaluated where it is, however
+ * many owners it has.
+ */
+lval* lval_eval_list(lenv* e, lval* v) {
+    if (lval_eval_mode == LEVAL_VM) { return lvm_eval(e, v); }
+    return lval_eval_sexpr(e, v);
+}
+
+/*
+ * Recursively evaluate the list v as an s-expression, deleting v
+ *
+ * The values of v's children are put in the value stack, so v itself is
+ * only read, and lambda bodies are evaluated without being copied. A lambda
+ * given exactly its arguments is bound straight from the stack into a new
+ * frame. Expressions in tail position (the body of a called lambda, and
+ * whatever 'if' or 'eval' evaluate as their result) are evaluated by looping
+ * rather than recursing, so tail recursion runs in constant C stack. Other
+ * calls recurse, and return an error rather than overflow the C stack.
+ */
+lval* lval_eval_sexpr(lenv* e, lval* v) {
+    if (leval_stack_full()) {
+        lval_del(v);
+        return lval_err("Recursion too deep");
+    }
+
+    // The frame e is, once a tail call has replaced the caller's
+    lenv* frame = NULL;
+    lval* result;
+
+    // Values of the children of v go in the value stack from base
+    int base = leval_stack.top;
+
+    while (1) {
+        lval_flat(v);
+
+        // A single nested expression is in tail position too
+        if (v->count == 1 && lval_type(v->cell[0]) == LVAL_SEXPR) {
+            lval* next = lval_ref(v->cell[0]);
+            lval_del(v);
+            v = next;
+            continue;
+        }
+
+        // Evaluate children
+        int n = v->count;
+        leval_reserve(base, n);
+        for (int i = 0; i < n; i++) {
+            // Nested expressions recurse straight back in here, keeping the
+            // C stack used per level of nesting small
+            lval* x = lval_ref(v->cell[i]);
+            x = lval_type(x) == LVAL_SEXPR ?
+                lval_eval_sexpr(e, x) : lval_eval(e, x);
+            leval_stack.vals[base + i] = x;
+        }
+        lval** a = leval_stack.vals + base;
+        lval_del(v);
+
+        // Error checking
+        int err = -1;
+        for (int i = 0; i < n && err < 0; i++) {
+            if (lval_type(a[i]) == LVAL_ERR) { err = i; }
+        }
+        if (err >= 0) {
+            result = lval_ref(a[err]);
+            for (int i = 0; i < n; i++) { lval_del(a[i]); }
+            break;
+        }
+
+        // Empty expression
+        if (n == 0) { result = lval_sexpr(); break; }
+
+        // Single expression
+        if (n == 1) { result = a[0]; break; }
+
+        // Ensure first element is a function
+        lval* f = a[0];
+        if (lval_type(f) != LVAL_FUN) {
+            result = lval_err(
+                "s-expression starts with incorrect type. "
+                "Expected %s, got %s", ltype_name(LVAL_FUN),
+                ltype_name(lval_type(f)));
+            for (int i = 0; i < n; i++) { lval_del(a[i]); }
+            break;
+        }
+
+        if (f->builtin) {
+            // Evaluate the result of 'if' and 'eval' in place
+            lval* next = lval_tail_expr(f, &a[1], n - 1);
+            if (next) {
+                v = lval_ref(next);
+                for (int i = 0; i < n; i++) { lval_del(a[i]); }
+                continue;
+            }
+
+            lval* args = lval_sexpr();
+            lval_reserve(args, n - 1);
+            memcpy(args->cell, &a[1], sizeof(lval*) * (n - 1));
+            args->count = n - 1;
+            result = f->builtin(e, args);
+            lval_del(f);
+            break;
+        }
+
+        lenv* next_frame;
+        if (f->arity == n - 1 && f->env->count == 0) {
+            next_frame = lenv_new();
+            next_frame->par = lenv_ref(f->env->par);
+            for (int i = 1; i < n; i++) {
+                lenv_put_move(next_frame, f->formals->cell[i - 1], a[i]);
+            }
+        } else {
+            lval* args = lval_sexpr();
+            lval_reserve(args, n - 1);
+            memcpy(args->cell, &a[1], sizeof(lval*) * (n - 1));
+            args->count = n - 1;
+
+            // Binding arguments mutates a lambda, so it mustn't be shared
+            f = lval_unshare(f);
+            lval* bind_err = lval_bind(e, f, args);
+            if (bind_err || f->formals->count) {
+                // Return errors, or the partially evaluated function
+                result = bind_err ? bind_err : lval_ref(f);
+                lval_del(f);
+                break;
+            }
+            next_frame = lenv_ref(f->env);
+        }
+
+        // Evaluate the body in place
+        v = lval_ref(f->body);
+        lval_del(f);
+        if (frame) { lenv_del(frame); }
+        frame = next_frame;
+        e = frame;
+    }
+
+    if (frame) { lenv_del(frame); }
+    leval_stack.top = base;
+    return result;
+}
+
+/*
+ * Bytecode compiler and VM
+ *
+ * Any list evaluated as an s-expression can be compiled to an lcode: a flat
+ * array of instructions operating on a value stack. The code for a list is
+ * cached on it, so a lambda body is compiled the first time it is called and
+ * reused afterwards. lval_eval_sexpr remains as the reference evaluator.
+ */
+
+// Builtins with a dedicated opcode, by the name they are registered under
+struct {
+    char* name;
+    int op;
+} lvm_builtin_ops[] = {
+    {"+", LVM_ADD}, {"-", LVM_SUB}, {"*", LVM_MUL}, {"/", LVM_DIV},
+    {"==", LVM_EQ}, {"!=", LVM_NEQ}, {">", LVM_GT}, {">=", LVM_GE},
+    {"<", LVM_LT}, {"<=", LVM_LE}, {"if", LVM_IF}, {"list", LVM_LIST},
+    {"head", LVM_HEAD}, {"tail", LVM_TAIL}, {"join", LVM_JOIN},
+    {"eval", LVM_EVAL}, {"def", LVM_DEF}, {"\\", LVM_LAMBDA},
+    {NULL, 0}
+};
+
+// Run in place of a list nested too deeply to compile, returning an error
+int lcode_deep_ops[] = { LVM_DEEP, LVM_RET };
+lcode lcode_deep = { 2, 2, lcode_deep_ops, 0, 0, NULL, 0, 1, 0, 0 };
+
+/*
+ * Append the instruction word x to c
+ */
+void lcode_emit(lcode* c, int x) {
+    if (c->count == c->capacity) {
+        c->capacity = c->capacity ? c->capacity * 2 : 16;
+        c->ops = realloc(c->ops, sizeof(int) * c->capacity);
+    }
+    c->ops[c->count++] = x;
+}
+
+/*
+ * Add a reference to v to c's constants, returning its index
+ */
+int lcode_const(lcode* c, lval* v) {
+    if (c->num_consts == c->consts_capacity) {
+        c->consts_capacity = c->consts_capacity ? c->consts_capacity * 2 : 8;
+        c->consts = realloc(c->consts, sizeof(lval*) * c->consts_capacity);
+    }
+    c->consts[c->num_consts] = lval_ref(v);
+    return c->num_consts++;
+}
+
+/*
+ * Record that the code emitted so far leaves n more values on the stack
+ */
+void lcode_push(lcode* c, int n) {
+    c->depth += n;
+    if (c->depth > c->max_stack) { c->max_stack = c->depth; }
+}
+
+/*
+ * Emit code which pushes the value of the expression v
+ *
+ * If tail is set, the code is followed by RET.
+ */
+void lcode_compile_expr(lcode* c, lval* v, int tail) {
+    switch (lval_type(v)) {
+        case LVAL_SYM:
+            if (c->body && v->depth >= 0) {
+                lcode_emit(c, LVM_LOCAL);
+                lcode_emit(c, v->depth);
+                lcode_emit(c, v->slot);
+                lcode_emit(c, lcode_const(c, v));
+            } else {
+                lcode_emit(c, LVM_LOAD);
+                lcode_emit(c, lcode_const(c, v));
+            }
+            lcode_push(c, 1);
+            break;
+        case LVAL_SEXPR:
+            lcode_compile_list(c, v, tail);
+            break;
+        default:
+            lcode_emit(c, LVM_CONST);
+            lcode_emit(c, lcode_const(c, v));
+            lcode_push(c, 1);
+            break;
+    }
+}
+
+/*
+ * Emit code for 'if' called with literal branches
+ *
+ * The branches are compiled inline. If at run time 'if' is no longer the
+ * builtin, or the condition isn't a boolean, whatever 'if' is bound to is
+ * called with the branches as q-expressions instead.
+ */
+void lcode_compile_if(lcode* c, lval* v, int tail) {
+    lcode_compile_expr(c, v->cell[0], 0);
+    lcode_compile_expr(c, v->cell[1], 0);
+
+    lcode_emit(c, LVM_IF);
+    lcode_emit(c, lcode_const(c, v->cell[2]));
+    lcode_emit(c, v->count == 4 ? lcode_const(c, v->cell[3]) : -1);
+    int patch = c->count;
+    lcode_emit(c, 0);
+    lcode_emit(c, 0);
+
+    // The fallback call needs room for the branches
+    lcode_push(c, 2);
+    c->depth -= 4;
+
+    // In tail position the branches return directly, so that calls at the
+    // end of them are followed by RET
+    lcode_compile_list(c, v->cell[2], tail);
+    c->depth--;
+    int jmp = -1;
+    if (tail) {
+        lcode_emit(c, LVM_RET);
+    } else {
+        lcode_emit(c, LVM_JMP);
+        jmp = c->count;
+        lcode_emit(c, 0);
+    }
+
+    c->ops[patch] = c->count;
+    if (v->count == 4) {
+        lcode_compile_list(c, v->cell[3], tail);
+    } else {
+        lval* empty = lval_sexpr();
+        lcode_emit(c, LVM_CONST);
+        lcode_emit(c, lcode_const(c, empty));
+        lcode_push(c, 1);
+        lval_del(empty);
+    }
+    c->ops[patch + 1] = c->count;
+    if (jmp >= 0) { c->ops[jmp] = c->count; }
+}
+
+/*
+ * Emit code which evaluates the list v as an s-expression
+ *
+ * If tail is set, the code is followed by RET.
+ */
+void lcode_compile_list(lcode* c, lval* v, int tail) {
+    // Each level of nesting recurses, so stop before the C stack overflows
+    if (leval_stack_full()) {
+        c->deep = 1;
+        return;
+    }
+
+    // A single nested expression is compiled as the expression itself,
+    // without recursing
+    lval_flat(v);
+    while (v->count == 1 && lval_type(v->cell[0]) == LVAL_SEXPR) {
+        v = v->cell[0];
+        lval_flat(v);
+    }
+
+    // Empty expression
+    if (v->count == 0) {
+        lval* empty = lval_sexpr();
+        lcode_emit(c, LVM_CONST);
+        lcode_emit(c, lcode_const(c, empty));
+        lcode_push(c, 1);
+        lval_del(empty);
+        return;
+    }
+
+    // Single expression
+    if (v->count == 1) {
+        lcode_compile_expr(c, v->cell[0], tail);
+        return;
+    }
+
+    // Calls to builtins get their own opcode
+    int op = LVM_CALL;
+    if (lval_type(v->cell[0]) == LVAL_SYM) {
+        for (int i = 0; lvm_builtin_ops[i].name; i++) {
+            if (strcmp(v->cell[0]->sym->name, lvm_builtin_ops[i].name) == 0) {
+                op = lvm_builtin_ops[i].op;
+                break;
+            }
+        }
+    }
+
+    if (op == LVM_IF && (v->count == 3 || v->count == 4) &&
+            lval_type(v->cell[2]) == LVAL_QEXPR &&
+            (v->count == 3 || lval_type(v->cell[3]) == LVAL_QEXPR)) {
+        lcode_compile_if(c, v, tail);
+        return;
+    }
+    if (op == LVM_IF) { op = LVM_CALL; }
+
+    for (int i = 0; i < v->count; i++) {
+        lcode_compile_expr(c, v->cell[i], 0);
+    }
+    lcode_emit(c, op);
+    lcode_emit(c, v->count - 1);
+    c->depth -= v->count - 1;
+}
+
+/*
+ * Compile the list v, to be evaluated as an s-expression, or run as a
+ * lambda's body if body is set
+ */
+lcode* lcode_compile(lval* v, int body) {
+    lcode* c = malloc(sizeof(lcode));
+    c->count = 0;
+    c->capacity = 0;
+    c->ops = NULL;
+    c->num_consts = 0;
+    c->consts_capacity = 0;
+    c->consts = NULL;
+    c->depth = 0;
+    c->max_stack = 0;
+    c->deep = 0;
+    c->body = body;
+
+    lcode_compile_list(c, v, 1);
+    lcode_emit(c, LVM_RET);
+    return c;
+}
+
+void lcode_del(lcode* c) {
+    for (int i = 0; i < c->num_consts; i++) {
+        lval_del(c->consts[i]);
+    }
+    free(c->consts);
+    free(c->ops);
+    free(c);
+}
+
+/*
+ * Return the code for the list v, compiling it the first time, with body
+ * set if v is a lambda's body
+ *
+ * builtin_lambda makes sure a body which loads locals directly is a list of
+ * its own, so v is always compiled the same way. A list too deeply nested to
+ * compile gets lcode_deep instead, which isn't cached, as the list may
+ * compile from a shallower point in the C stack.
+ */
+lcode* lcode_get(lval* v, int body) {
+    if (v->code) { return v->code; }
+    lcode* c = lcode_compile(v, body);
+    if (c->deep) {
+        lcode_del(c);
+        return &lcode_deep;
+    }
+    v->code = c;
+    return c;
+}
+
+/*
+ * Evaluate the s-expression v with the VM
+ */
+lval* lvm_eval(lenv* e, lval* v) {
+    lval* x = lvm_run(e, lcode_get(v, 0));
+    lval_del(v);
+    return x;
+}
+
+/*
+ * Call the function a[0] with the n arguments a[1..n], consuming them all
+ *
+ * Lambdas without errors in their arguments are run by lvm_run itself, so
+ * this calls builtins, and returns errors. The arguments are taken out of a
+ * before anything is evaluated, which may move the value stack a is in.
+ */
+lval* lvm_call(lenv* e, lval** a, int n) {
+    // Errors in the function or its arguments are returned as is
+    for (int i = 0; i <= n; i++) {
+        if (lval_type(a[i]) == LVAL_ERR) {
+            lval* err = lval_ref(a[i]);
+            for (int j = 0; j <= n; j++) { lval_del(a[j]); }
+            return err;
+        }
+    }
+
+    lval* f = a[0];
+    if (lval_type(f) != LVAL_FUN) {
+        for (int i = 0; i <= n; i++) { lval_del(a[i]); }
+        return lval_err(
+            "s-expression starts with incorrect type. "
+            "Expected %s, got %s", ltype_name(LVAL_FUN),
+            ltype_name(lval_type(f)));
+    }
+
+    lval* args = lval_sexpr();
+    args->count = n;
+    args->capacity = n;
+    args->cell = lalloc(sizeof(lval*) * n);
+    memcpy(args->cell, &a[1], sizeof(lval*) * n);
+
+    lval* x = lval_call(e, f, args);
+    lval_del(f);
+    return x;
+}
+
+/*
+ * Try the dedicated implementation of op's builtin on a[0..n]
+ *
+ * Returns NULL, leaving a untouched, if a[0] isn't the builtin op was
+ * compiled for or the arguments need the builtin's error handling.
+ * Otherwise a is consumed.
+ */
+lval* lvm_builtin(lenv* e, int op, lval** a, int n) {
+    lval* f = a[0];
+    if (lval_type(f) != LVAL_FUN || !f->builtin) { return NULL; }
+
+    lval* x = NULL;
+    switch (op) {
+        case LVM_ADD:
+        case LVM_SUB:
+        case LVM_MUL:
+        case LVM_DIV: {
+            lbuiltin fns[] = { builtin_add, builtin_sub, builtin_mul,
+                builtin_div };
+            if (f->builtin != fns[op - LVM_ADD]) { return NULL; }
+            for (int i = 1; i <= n; i++) {
+                if (lval_type(a[i]) == LVAL_ERR) { return NULL; }
+            }
+            x = lnum_arith(LOP_ADD + op - LVM_ADD, &a[1], n);
+            break;
+        }
+
+        case LVM_GT:
+        case LVM_GE:
+        case LVM_LT:
+        case LVM_LE: {
+            lbuiltin fns[] = { builtin_gt, builtin_ge, builtin_lt,
+                builtin_le };
+            if (f->builtin != fns[op - LVM_GT]) { return NULL; }
+            if (n != 2 || !lval_is_number(a[1]) || !lval_is_number(a[2])) {
+                return NULL;
+            }
+            x = lval_bool(lnum_order(LOP_GT + op - LVM_GT, a[1], a[2]));
+            break;
+        }
+
+        case LVM_EQ:
+        case LVM_NEQ:
+            if (f->builtin != (op == LVM_EQ ? builtin_eq : builtin_neq)) {
+                return NULL;
+            }
+            if (n != 2 || lval_type(a[1]) == LVAL_ERR ||
+                    lval_type(a[2]) == LVAL_ERR) {
+                return NULL;
+            }
+            x = lval_bool(lval_eq(a[1], a[2]) == (op == LVM_EQ));
+            break;
+
+        case LVM_LIST: {
+            if (f->builtin != builtin_list) { return NULL; }
+            for (int i = 1; i <= n; i++) {
+                if (lval_type(a[i]) == LVAL_ERR) { return NULL; }
+            }
+            x = lval_qexpr();
+            x->count = n;
+            x->capacity = n;
+            x->cell = lalloc(sizeof(lval*) * n);
+            memcpy(x->cell, &a[1], sizeof(lval*) * n);
+            lval_del(f);
+            return x;
+        }
+
+        case LVM_HEAD:
+        case LVM_TAIL: {
+            lbuiltin fn = op == LVM_HEAD ? builtin_head : builtin_tail;
+            if (f->builtin != fn || n != 1 || lval_type(a[1]) != LVAL_QEXPR ||
+                    a[1]->count == 0) {
+                return NULL;
+            }
+
+            lval_del(f);
+            if (op == LVM_HEAD) { return lval_slice(a[1], 0, 1); }
+            return lval_slice(a[1], 1, a[1]->count - 1);
+        }
+
+        case LVM_JOIN: {
+            if (f->builtin != builtin_join) { return NULL; }
+            for (int i = 1; i <= n; i++) {
+                if (lval_type(a[i]) != LVAL_QEXPR) { return NULL; }
+            }
+            x = a[1];
+            for (int i = 2; i <= n; i++) { x = lval_join(x, a[i]); }
+            lval_del(f);
+            return x;
+        }
+
+        case LVM_EVAL:
+            if (f->builtin != builtin_eval || n != 1 ||
+                    lval_type(a[1]) != LVAL_QEXPR) {
+                return NULL;
+            }
+
+            // Evaluating may move the value stack, and so a
+            lval_del(f);
+            return lvm_eval(e, a[1]);
+
+        case LVM_DEF:
+        case LVM_LAMBDA: {
+            lbuiltin fn = op == LVM_DEF ? builtin_def : builtin_lambda;
+            if (f->builtin != fn) { return NULL; }
+            for (int i = 1; i <= n; i++) {
+                if (lval_type(a[i]) == LVAL_ERR) { return NULL; }
+            }
+            lval* args = lval_sexpr();
+            args->count = n;
+            args->capacity = n;
+            args->cell = lalloc(sizeof(lval*) * n);
+            memcpy(args->cell, &a[1], sizeof(lval*) * n);
+            lval_del(f);
+            return fn(e, args);
+        }
+
+        default: return NULL;
+    }
+
+    for (int i = 0; i <= n; i++) { lval_del(a[i]); }
+    return x;
+}
+
+// Use computed goto for dispatch where the compiler supports it
+#if defined(__GNUC__)
+#define LVM_COMPUTED_GOTO
+#endif
+
+/*
+ * Run the code c in the environment e, returning the result
+ *
+ * A lambda's body is run by this invocation too, with its caller saved in
+ * lvm_calls until it returns, so calls only recurse on the C stack through
+ * builtins which evaluate code. A call immediately followed by RET is a tail
+ * call. If it is to a lambda, or to 'if' or 'eval', the code it would run
+ * replaces the caller's rather than being called, so tail recursion runs in
+ * constant space.
+ */
+lval* lvm_run(lenv* e, lcode* c) {
+    if (leval_stack_full()) { return lval_err("Recursion too deep"); }
+
+    // The running code's values start at base in the value stack, and the
+    // calls this invocation has saved at calls in lvm_calls
+    int base = leval_stack.top;
+    int calls = lvm_calls.top;
+    lval** stack = leval_reserve(base, c->max_stack);
+
+    // Once a call has been made, the list the running code was compiled from
+    // and the frame it runs in belong to this invocation rather than its
+    // caller
+    lval* src = NULL;
+    lenv* frame = NULL;
+
+    int sp = 0;
+    int n = 0;
+    int* pc = c->ops;
+    lval** k = c->consts;
+    lval* result;
+
+#ifdef LVM_COMPUTED_GOTO
+#define LVM_LABEL(op) &&lvm_op_##op,
+    static void* labels[] = { LVM_OPS(LVM_LABEL) };
+#undef LVM_LABEL
+#define LVM_CASE(op) lvm_op_##op:
+#define LVM_NEXT() goto *labels[*pc++]
+    LVM_NEXT();
+#else
+#define LVM_CASE(op) case LVM_##op:
+#define LVM_NEXT() goto dispatch
+dispatch:
+    switch (*pc++) {
+#endif
+
+    LVM_CASE(CONST)
+        stack[sp++] = lval_ref(k[*pc++]);
+        LVM_NEXT();
+
+    LVM_CASE(LOAD)
+        stack[sp++] = lenv_get(e, k[*pc++]);
+        LVM_NEXT();
+
+    LVM_CASE(LOCAL) {
+        // The body was resolved against the frames it runs in, so the
+        // binding is where its address says
+        lenv* f = e;
+        for (int d = pc[0]; d > 0; d--) { f = f->par; }
+        assert(f->entries[pc[1]].sym == k[pc[2]]->sym);
+        stack[sp++] = lval_ref(f->entries[pc[1]].val);
+        pc += 3;
+    } LVM_NEXT();
+
+    LVM_CASE(JMP)
+        pc = c->ops + *pc;
+        LVM_NEXT();
+
+    LVM_CASE(IF) {
+        lval* f = stack[sp-2];
+        lval* cond = stack[sp-1];
+        if (lval_type(f) == LVAL_FUN && f->builtin == builtin_if &&
+                lval_type(cond) == LVAL_BOOL) {
+            int b = lval_to_bool(cond);
+            lval_del(f);
+            lval_del(cond);
+            sp -= 2;
+            pc = b ? pc + 4 : c->ops + pc[2];
+            LVM_NEXT();
+        }
+
+        // Call whatever 'if' is, with the branches as q-expressions
+        n = 2;
+        stack[sp++] = lval_ref(k[pc[0]]);
+        if (pc[1] >= 0) { stack[sp++] = lval_ref(k[pc[1]]); n++; }
+        pc = c->ops + pc[3];
+        goto call;
+    }
+
+    LVM_CASE(CALL)
+        n = *pc++;
+        goto call;
+
+    LVM_CASE(ADD) LVM_CASE(SUB) LVM_CASE(MUL) LVM_CASE(DIV)
+    LVM_CASE(EQ) LVM_CASE(NEQ) LVM_CASE(GT) LVM_CASE(GE) LVM_CASE(LT)
+    LVM_CASE(LE) LVM_CASE(LIST) LVM_CASE(HEAD) LVM_CASE(TAIL) LVM_CASE(JOIN)
+    LVM_CASE(EVAL) LVM_CASE(DEF) LVM_CASE(LAMBDA) {
+        int op = pc[-1];
+        n = *pc++;
+
+        // 'eval' in tail position is left to the tail call below
+        if (op == LVM_EVAL && *pc == LVM_RET) { goto call; }
+
+        lval* x = lvm_builtin(e, op, &stack[sp-n-1], n);
+        stack = leval_stack.vals + base;
+        if (!x) { goto call; }
+        sp -= n;
+        stack[sp-1] = x;
+    } LVM_NEXT();
+
+    LVM_CASE(DEEP)
+        stack[sp++] = lval_err("Recursion too deep");
+        LVM_NEXT();
+
+    LVM_CASE(RET) {
+        result = stack[--sp];
+        if (lvm_calls.top == calls) { goto done; }
+
+        // Return to the lambda's caller
+        if (frame) { lenv_del(frame); }
+        if (src) { lval_del(src); }
+        lvm_frame* r = &lvm_calls.frames[--lvm_calls.top];
+        c = r->c;
+        pc = r->pc;
+        e = r->e;
+        src = r->src;
+        frame = r->frame;
+        base = r->base;
+        sp = r->sp;
+        k = c->consts;
+        stack = leval_reserve(base, c->max_stack);
+        stack[sp++] = result;
+    } LVM_NEXT();
+
+#ifndef LVM_COMPUTED_GOTO
+    }
+#endif
+
+call: {
+    // Call stack[sp-n-1] with the n values above it
+    lval** a = &stack[sp-n-1];
+    lval* f = a[0];
+
+    // Only calls to lambdas, and tail calls to 'if' and 'eval', without
+    // errors are run here
+    int tail = *pc == LVM_RET;
+    int run = lval_type(f) == LVAL_FUN;
+    for (int i = 1; run && i <= n; i++) {
+        if (lval_type(a[i]) == LVAL_ERR) { run = 0; }
+    }
+    lval* next = NULL;
+    if (run && f->builtin) {
+        next = tail ? lval_tail_expr(f, &a[1], n) : NULL;
+        run = next != NULL;
+    }
+
+    if (!run) {
+        lval* x = lvm_call(e, a, n);
+        stack = leval_stack.vals + base;
+        sp -= n;
+        stack[sp-1] = x;
+        LVM_NEXT();
+    }
+    sp -= n + 1;
+
+    lenv* next_frame = frame;
+    int body = !f->builtin;
+    if (f->builtin) {
+        // Evaluate the result of 'if' or 'eval' in the same frame
+        next = lval_ref(next);
+        for (int i = 0; i <= n; i++) { lval_del(a[i]); }
+    } else {
+        if (f->arity == n && f->env->count == 0) {
+            next_frame = lenv_new();
+            next_frame->par = lenv_ref(f->env->par);
+            for (int i = 0; i < n; i++) {
+                lenv_put_move(next_frame, f->formals->cell[i], a[i+1]);
+            }
+        } else {
+            lval* args = lval_sexpr();
+            args->count = n;
+            args->capacity = n;
+            args->cell = lalloc(sizeof(lval*) * n);
+            memcpy(args->cell, &a[1], sizeof(lval*) * n);
+
+            f = lval_unshare(f);
+            lval* err = lval_bind(e, f, args);
+            if (err || f->formals->count) {
+                // Return errors, or the partially evaluated function
+                stack[sp++] = err ? err : lval_ref(f);
+                lval_del(f);
+                LVM_NEXT();
+            }
+
+            next_frame = lenv_ref(f->env);
+        }
+
+        next = lval_ref(f->body);
+        lval_del(f);
+    }
+
+    if (tail) {
+        // Switch to the new code, releasing what the old code needed
+        if (frame && frame != next_frame) { lenv_del(frame); }
+        if (src) { lval_del(src); }
+    } else {
+        // Save the caller, whose values the new code's go above
+        if (lvm_calls.top == lvm_calls.size) {
+            lvm_calls.size = lvm_calls.size ? lvm_calls.size * 2 : 64;
+            lvm_calls.frames = realloc(lvm_calls.frames,
+                sizeof(lvm_frame) * lvm_calls.size);
+        }
+        lvm_frame* r = &lvm_calls.frames[lvm_calls.top++];
+        r->c = c;
+        r->pc = pc;
+        r->e = e;
+        r->src = src;
+        r->frame = frame;
+        r->base = base;
+        r->sp = sp;
+        base += sp;
+    }
+    frame = next_frame;
+    src = next;
+    if (frame) { e = frame; }
+
+    c = lcode_get(src, body);
+    stack = leval_reserve(base, c->max_stack);
+    sp = 0;
+    pc = c->ops;
+    k = c->consts;
+    }
+    LVM_NEXT();
+#undef LVM_CASE
+#undef LVM_NEXT
+
+done:
+    if (frame) { lenv_del(frame); }
+    if (src) { lval_del(src); }
+    leval_stack.top = base;
+    return result;
+}
+
+/*
+ * Evaluate each expression in the file filename, printing the results
+ */
+void lval_load(lenv* e, mpc_context_t* c, char* filename, mpc_parser_t* p) {
+    mpc_result_t r;
+    if (!mpc_context_parse_contents(c, filename, p, &r)) {
+        mpc_err_print(r.error);
+        mpc_err_delete(r.error);
+        return;
+    }
+
+    lval* exprs = lval_read(r.output);
+    mpc_ast_delete(r.output);
+
+    for (int i = 0; i < exprs->count; i++) {
+        lval* x = lval_eval(e, lval_ref(exprs->cell[i]));
+        lval_println(x);
+        lval_del(x);
+        lgc_maybe_collect(e, exprs);
+    }
+    lval_del(exprs);
+}
+
+/*
+ * Print how much of the parser's memory came from the reused pool
+ */
+void lval_print_parse_stats(mpc_context_t* c) {
+    mpc_mem_stats_t s;
+    mpc_context_stats(c, &s);
+    unsigned long total = s.pooled + s.fallback + s.large;
+    fprintf(stderr, "parses: %lu, parser allocs: %lu pooled, %lu fallback, "
+        "%lu large (%.1f%% pooled)\n", s.parses, s.pooled, s.fallback,
+        s.large, total ? 100.0 * s.pooled / total : 0.0);
+}
+
+void lenv_add_builtins(lenv* e) {
+    // List Functions
+    lenv_add_builtin(e, "list", builtin_list);
+    lenv_add_builtin(e, "head", builtin_head);
+    lenv_add_builtin(e, "tail", builtin_tail);
+    lenv_add_builtin(e, "eval", builtin_eval);
+    lenv_add_builtin(e, "join", builtin_join);
+
+    // Mathematical Functions
+    lenv_add_builtin(e, "+", builtin_add);
+    lenv_add_builtin(e, "-", builtin_sub);
+    lenv_add_builtin(e, "*", builtin_mul);
+    lenv_add_builtin(e, "/", builtin_div);
+
+    // Comarison functions
+    lenv_add_builtin(e, "==", builtin_eq);
+    lenv_add_builtin(e, "!=", builtin_neq);
+    lenv_add_builtin(e, ">", builtin_gt);
+    lenv_add_builtin(e, ">=", builtin_ge);
+    lenv_add_builtin(e, "<", builtin_lt);
+    lenv_add_builtin(e, "<=", builtin_le);
+
+    // Branching
+    lenv_add_builtin(e, "if", builtin_if);
+
+    // Variable functions
+    lenv_add_builtin(e, "def", builtin_def);
+
+    // Lambdas
+    lenv_add_builtin(e, "\\", builtin_lambda);
+
+    // Higher order functions
+    lenv_add_builtin(e, "map", builtin_map);
+    lenv_add_builtin(e, "filter", builtin_filter);
+    lenv_add_builtin(e, "foldl", builtin_foldl);
+    lenv_add_builtin(e, "foldr", builtin_foldr);
+    lenv_add_builtin(e, "any", builtin_any);
+    lenv_add_builtin(e, "all", builtin_all);
+
+    // Memory
+    lenv_add_builtin(e, "mem-stats", builtin_mem_stats);
+
+    // Vector functions
+    lenv_add_builtin(e, "vec", builtin_vec);
+    lenv_add_builtin(e, "vlist", builtin_vlist);
+    lenv_add_builtin(e, "vsum", builtin_vsum);
+    lenv_add_builtin(e, "vmin", builtin_vmin);
+    lenv_add_builtin(e, "vmax", builtin_vmax);
+    lenv_add_builtin(e, "v+", builtin_vadd);
+    lenv_add_builtin(e, "v*", builtin_vmul);
+    lenv_add_builtin(e, "vdot", builtin_vdot);
+    lenv_add_builtin(e, "vfilter-gt", builtin_vfilter_gt);
+}
+
+void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
+    lval* k = lval_sym(name);
+    lenv_put_move(e, k, lval_fun(func));
+    lval_del(k);
+}
+
+lval* builtin_add(lenv* e, lval* a) {
+    return builtin_op(e, a, LOP_ADD);
+}
+
+lval* builtin_sub(lenv* e, lval* a) {
+    return builtin_op(e, a, LOP_SUB);
+}
+
+lval* builtin_mul(lenv* e, lval* a) {
+    return builtin_op(e, a, LOP_MUL);
+}
+
+lval* builtin_div(lenv* e, lval* a) {
+    return builtin_op(e, a, LOP_DIV);
+}
+
+/*
+ * Apply the arithmetic operator op to the arguments in a->cell
+ */
+lval* builtin_op(lenv* e, lval* a, int op) {
+    lval* x = lnum_arith(op, a->cell, a->count);
+    lval_del(a);
+    return x;
+}
+
+#if !defined(__GNUC__)
+/*
+ * Portable equivalents of the compiler's overflow checking builtins
+ */
+int lnum_add(long x, long y, long* r) {
+    if ((y > 0 && x > LONG_MAX - y) || (y < 0 && x < LONG_MIN - y)) {
+        return 1;
+    }
+    *r = x + y;
+    return 0;
+}
+
+int lnum_sub(long x, long y, long* r) {
+    if ((y < 0 && x > LONG_MAX + y) || (y > 0 && x < LONG_MIN + y)) {
+        return 1;
+    }
+    *r = x - y;
+    return 0;
+}
+
+int lnum_mul(long x, long y, long* r) {
+    if (x > 0 ? (y > 0 ? x > LONG_MAX / y : y < LONG_MIN / x)
+              : (y > 0 ? x < LONG_MIN / y : x != 0 && y < LONG_MAX / x)) {
+        return 1;
+    }
+    *r = x * y;
+    return 0;
+}
+#endif
+
+/*
+ * Fold the arithmetic operator op over the n numbers in a, or negate a[0] if
+ * op is LOP_SUB and n is 1
+ *
+ * The operator is dispatched on once, not per element, and a sum or
+ * difference of two immediates is done without unpacking them. If any of a
+ * is a double the result is too, and is computed by lnum_arith_dbl. Returns
+ * an error if any of a isn't a number, or an integer result overflows a long.
+ */
+lval* lnum_arith(int op, lval** a, int n) {
+    // Adding the tagged forms of x and y, less one tag, tags x + y
+    if (n == 2 && LVAL_IS_INT(a[0]) && LVAL_IS_INT(a[1])) {
+        long x = (long)(intptr_t)a[0], y = (long)(intptr_t)a[1], r;
+        if (op == LOP_ADD && !LNUM_ADD(x, y - 1, &r)) {
+            return (lval*)(intptr_t)r;
+        }
+        if (op == LOP_SUB && !LNUM_SUB(x, y - 1, &r)) {
+            return (lval*)(intptr_t)r;
+        }
+    }
+
+    // Ensure all arguments are numbers
+    int dbl = 0;
+    for (int i = 0; i < n; i++) {
+        int t = lval_type(a[i]);
+        if (t == LVAL_DBL) { dbl = 1; continue; }
+        if (t != LVAL_NUM) {
+            return lval_err("cannot operate on a non-number");
+        }
+    }
+    if (n == 0) {
+        return lval_err("function '%s' passed no arguments", lop_names[op]);
+    }
+    if (dbl) { return lnum_arith_dbl(op, a, n); }
+
+    // Accumulate the result unboxed, and only make an lval of it at the end
+    long r = lval_to_num(a[0]);
+    int overflow = 0;
+    switch (op) {
+        case LOP_ADD:
+            for (int i = 1; i < n && !overflow; i++) {
+                overflow = LNUM_ADD(r, lval_to_num(a[i]), &r);
+            }
+            break;
+        case LOP_SUB:
+            // If there's one argument, negate it
+            if (n == 1) { overflow = LNUM_SUB(0, r, &r); }
+            for (int i = 1; i < n && !overflow; i++) {
+                overflow = LNUM_SUB(r, lval_to_num(a[i]), &r);
+            }
+            break;
+        case LOP_MUL:
+            for (int i = 1; i < n && !overflow; i++) {
+                overflow = LNUM_MUL(r, lval_to_num(a[i]), &r);
+            }
+            break;
+        case LOP_DIV:
+            for (int i = 1; i < n && !overflow; i++) {
+                long y = lval_to_num(a[i]);
+                if (y == 0) { return lval_err("division by zero"); }
+                overflow = r == LONG_MIN && y == -1;
+                r /= overflow ? 1 : y;
+            }
+            break;
+    }
+    if (overflow) {
+        return lval_err("integer overflow in '%s'", lop_names[op]);
+    }
+    return lval_num(r);
+}
+
+/*
+ * Fold the arithmetic operator op over the n integers and doubles in a, of
+ * which at least one is a double, promoting the integers to doubles
+ *
+ * The result is written over a double in a which nothing else holds, if there
+ * is one, so that a chain of operations on doubles allocates nothing. The
+ * caller must delete a after the call, as lnum_arith's callers do.
+ */
+lval* lnum_arith_dbl(int op, lval** a, int n) {
+    double r = lval_to_dbl(a[0]);
+    switch (op) {
+        case LOP_ADD:
+            for (int i = 1; i < n; i++) { r += lval_to_dbl(a[i]); }
+            break;
+        case LOP_SUB:
+            if (n == 1) { r = -r; }
+            for (int i = 1; i < n; i++) { r -= lval_to_dbl(a[i]); }
+            break;
+        case LOP_MUL:
+            for (int i = 1; i < n; i++) { r *= lval_to_dbl(a[i]); }
+            break;
+        case LOP_DIV:
+            for (int i = 1; i < n; i++) {
+                double y = lval_to_dbl(a[i]);
+                if (y == 0) { return lval_err("division by zero"); }
+                r /= y;
+            }
+            break;
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (!LVAL_IS_IMM(a[i]) && a[i]->type == LVAL_DBL &&
+                a[i]->refs == 1) {
+            a[i]->dbl = r;
+            return lval_ref(a[i]);
+        }
+    }
+    return lval_dbl(r);
+}
+
+/*
+ * Return whether x op y holds, for the ordering operator op
+ */
+int lnum_order(int op, lval* x, lval* y) {
+    // Tagging preserves order, so immediates are compared as they are
+    if (LVAL_IS_INT(x) && LVAL_IS_INT(y)) {
+        intptr_t l = (intptr_t)x, r = (intptr_t)y;
+        switch (op) {
+            case LOP_GT: return l > r;
+            case LOP_GE: return l >= r;
+            case LOP_LT: return l < r;
+            default: return l <= r;
+        }
+    }
+
+    if (lval_type(x) == LVAL_DBL || lval_type(y) == LVAL_DBL) {
+        int c = lnum_cmp_dbl(x, y);
+        switch (op) {
+            case LOP_GT: return c == 1;
+            case LOP_GE: return c == 1 || c == 0;
+            case LOP_LT: return c == -1;
+            default: return c == -1 || c == 0;
+        }
+    }
+
+    long l = lval_to_num(x), r = lval_to_num(y);
+    switch (op) {
+        case LOP_GT: return l > r;
+        case LOP_GE: return l >= r;
+        case LOP_LT: return l < r;
+        default: return l <= r;
+    }
+}
+
+/*
+ * Compare the numbers x and y, at least one of which is a double, returning
+ * -1, 0 or 1 as x is less than, equal to or greater than y, or 2 if either
+ * is NaN. An integer is compared with a double exactly, rather than rounded
+ * to the nearest double, which large integers may not be.
+ */
+int lnum_cmp_dbl(lval* x, lval* y) {
+    if (lval_type(y) != LVAL_DBL) {
+        int c = lnum_cmp_dbl(y, x);
+        return c == 2 ? 2 : -c;
+    }
+
+    double r = y->dbl;
+    if (isnan(r)) { return 2; }
+    if (lval_type(x) == LVAL_DBL) {
+        double l = x->dbl;
+        if (isnan(l)) { return 2; }
+        return (l > r) - (l < r);
+    }
+
+    // Doubles outside the range of long are beyond every integer
+    long l = lval_to_num(x);
+    if (r >= -(double)LONG_MIN) { return -1; }
+    if (r < (double)LONG_MIN) { return 1; }
+
+    // Otherwise compare with the double's integer part, then its fraction
+    long t = (long)r;
+    if (l != t) { return l < t ? -1 : 1; }
+    double f = r - (double)t;
+    return (f < 0) - (f > 0);
+}
+
+lval* builtin_eq(lenv* e, lval* a) {
+    LASSERT_NUM("==", a, 2);
+    lval* x = lval_bool(lval_eq(a->cell[0], a->cell[1]));
+    lval_del(a);
+    return x;
+}
+
+lval* builtin_neq(lenv* e, lval* a) {
+    LASSERT_NUM("!=", a, 2);
+    lval* x = lval_bool(!lval_eq(a->cell[0], a->cell[1]));
+    lval_del(a);
+    return x;
+}
+
+lval* builtin_gt(lenv* e, lval* a) {
+    return builtin_ord(e, a, LOP_GT);
+}
+
+lval* builtin_ge(lenv* e, lval* a) {
+    return builtin_ord(e, a, LOP_GE);
+}
+
+lval* builtin_lt(lenv* e, lval* a) {
+    return builtin_ord(e, a, LOP_LT);
+}
+
+lval* builtin_le(lenv* e, lval* a) {
+    return builtin_ord(e, a, LOP_LE);
+}
+
+lval* builtin_ord(lenv* e, lval* a, int op) {
+    LASSERT_NUM(lop_names[op], a, 2);
+    for (int i = 0; i < a->count; i++) {
+        LASSERT(a, lval_is_number(a->cell[i]),
+            "function '%s' argument %d was type %s, expected %s",
+            lop_names[op], i, ltype_name(lval_type(a->cell[i])),
+            ltype_name(LVAL_NUM));
+    }
+
+    lval* x = lval_bool(lnum_order(op, a->cell[0], a->cell[1]));
+    lval_del(a);
+    return x;
+}
+
+/*
+ * Return the first element of a q-expression
+ */
+lval* builtin_head(lenv* e, lval* a) {
+    LASSERT_NUM("head", a, 1);
+    LASSERT_TYPE("head", a, 0, LVAL_QEXPR);
+    LASSERT_NOT_EMPTY("head", a, 0);
+
+    // Return the first element as a slice of the list
+    lval* v = lval_take(a, 0);
+    return lval_slice(v, 0, 1);
+}
+
+/*
+ * Return all but the first element of a q-expression
+ */
+lval* builtin_tail(lenv* e, lval* a) {
+    LASSERT_NUM("tail", a, 1);
+    LASSERT_TYPE("tail", a, 0, LVAL_QEXPR);
+    LASSERT_NOT_EMPTY("tail", a, 0);
+
+    // Return the rest of the list as a slice of it
+    lval* v = lval_take(a, 0);
+    return lval_slice(v, 1, v->count - 1);
+}
+
+/*
+ * Convert an s-expression to a q-expression
+ */
+lval* builtin_list(lenv* e, lval* a) {
+    a = lval_unshare(a);
+    a->type = LVAL_QEXPR;
+    return a;
+}
+
+/*
+ * Evaluate a q-expression as an s-expression
+ */
+lval* builtin_eval(lenv* e, lval* a) {
+    LASSERT_NUM("eval", a, 1);
+    LASSERT_TYPE("eval", a, 0, LVAL_QEXPR);
+    
+    return lval_eval_list(e, lval_take(a, 0));
+}
+
+/*
+ * Join two or more q-expressions
+ */
+lval* builtin_join(lenv* e, lval* a) {
+    for (int i = 0; i < a->count; i++) {
+        LASSERT_TYPE("join", a, i, LVAL_QEXPR);
+    }
+
+    lval* x = lval_pop(a, 0);
+
+    while (a->count) {
+        x = lval_join(x, lval_pop(a, 0));
+    }
+    lval_del(a);
+    return x;
+}
+
+lval* builtin_def(lenv* e, lval* a) {
+    return builtin_var(e, a, "def");
+}
+
+lval* builtin_put(lenv* e, lval* a) {
+    return builtin_var(e, a, "=");
+}
+
+/*
+ * Bind a list of symbols in a q-expression to values
+ */
+lval* builtin_var(lenv* e, lval* a, char* func) {
+    LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
+
+    lval* syms = lval_flat(a->cell[0]);
+    
+    for (int i = 0; i < syms->count; i++) {
+        LASSERT(a, lval_type(syms->cell[i]) == LVAL_SYM,
+            "function '%s' can only define items of type %s. Argument %d is "
+            "type %s", func,
+            ltype_name(LVAL_SYM), i, ltype_name(lval_type(syms->cell[i])));
+    }
+
+    LASSERT(a, syms->count == a->count-1, 
+        "function '%s' cannot define an incorrect number of values to symbols. "
+        "Num values: %d, num symbols: %d", func, syms->count, a->count-1);
+
+    // Def defines globally, '=' defines locally. The values are moved out
+    // of a, leaving only the symbols to delete.
+    for (int i = 0; i < syms->count; i++) {
+        if (strcmp(func, "def") == 0) {
+            lenv_def_move(e, syms->cell[i], a->cell[i+1]);
+        }
+
+        if (strcmp(func, "=") == 0) {
+            lenv_put_move(e, syms->cell[i], a->cell[i+1]);
+        }
+    }
+    a->count = 1;
+    lval_del(a);
+    return lval_sexpr();
+}
+
+lval* builtin_lambda(lenv* e, lval* a) {
+    LASSERT_NUM("\\", a, 2);
+    LASSERT_TYPE("\\", a, 0, LVAL_QEXPR);
+    LASSERT_TYPE("\\", a, 1, LVAL_QEXPR);
+
+    // Check the first q-expression only contains symbols
+    lval_flat(a->cell[0]);
+    for (int i = 0; i < a->cell[0]->count; i++) {
+        LASSERT(a, (lval_type(a->cell[0]->cell[i]) == LVAL_SYM),
+            "cannot define a non-symbol. Got %s, expected %s",
+            ltype_name(lval_type(a->cell[0]->cell[i])), ltype_name(LVAL_SYM));
+    }
+
+    // Pop the first two arguments and pass them to lval_lambda
+    lval* formals = lval_pop(a, 0);
+    lval* body = lval_pop(a, 0);
+    lval_del(a);
+
+    // Resolve the body's symbols ahead of time. Its code loads locals by
+    // their addresses, so it mustn't be a list evaluated anywhere else, as
+    // an unchanged body would be.
+    lval* resolved = lval_resolve(body, formals, e);
+    if (resolved == body && lval_has_locals(resolved)) {
+        lval_del(resolved);
+        resolved = lval_copy(body);
+    }
+    lval_del(body);
+
+    return lval_lambda(e, formals, resolved);
+}
+
+lval* builtin_if(lenv* e, lval*a) {
+    LASSERT(a, a->count == 2 || a->count == 3, "'if' statements require 2 or "
+        "3 arguments. Got %d", a->count);
+    LASSERT_TYPE("if", a, 0, LVAL_BOOL);
+    LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
+    if (a->count == 3) {
+        LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
+    }
+
+    // Evaluate the chosen branch, or with no else branch, an empty expression
+    int branch = lval_to_bool(a->cell[0]) ? 1 : 2;
+    if (branch == a->count) {
+        lval_del(a);
+        return lval_sexpr();
+    }
+    return lval_eval_list(e, lval_take(a, branch));
+}
+
+/*
+ * Higher order functions
+ *
+ * map, filter, foldl, foldr, any and all call a function once per element of
+ * a list. Rather than building an s-expression and going through lval_call
+ * for each element, they call it through an lcall, which keeps the frame of
+ * a lambda's last call to rebind for the next one.
+ */
+
+void lcall_init(lcall* c, lenv* e, lval* f) {
+    c->e = e;
+    c->f = f;
+    c->frame = NULL;
+}
+
+void lcall_done(lcall* c) {
+    if (c->frame) { lenv_del(c->frame); }
+}
+
+/*
+ * Call c->f with the n arguments a, consuming them
+ */
+lval* lcall_run(lcall* c, lval** a, int n) {
+    lval* f = c->f;
+    if (f->builtin || f->arity != n || f->env->count != 0) {
+        // Go through lval_call, which handles partial application
+        lval* args = lval_sexpr();
+        lval_reserve(args, n);
+        memcpy(args->cell, a, sizeof(lval*) * n);
+        args->count = n;
+
+        f = f->builtin ? lval_ref(f) : lval_copy(f);
+        lval* x = lval_call(c->e, f, args);
+        lval_del(f);
+        return x;
+    }
+
+    // Bind the arguments, over those of the last call if its frame was kept
+    lenv* frame = c->frame;
+    c->frame = NULL;
+    if (frame) {
+        for (int i = 0; i < n; i++) {
+            lval_del(frame->entries[i].val);
+            frame->entries[i].val = a[i];
+        }
+    } else {
+        frame = lenv_new();
+        frame->par = lenv_ref(f->env->par);
+        for (int i = 0; i < n; i++) {
+            lenv_put_move(frame, f->formals->cell[i], a[i]);
+        }
+    }
+
+    lval* x;
+    if (lval_eval_mode == LEVAL_VM) {
+        x = lvm_run(frame, lcode_get(f->body, 1));
+    } else {
+        x = lval_eval_sexpr(frame, lval_ref(f->body));
+    }
+
+    // A frame which a closure captured, or which the body added bindings to,
+    // can't be reused
+    if (frame->refs == 1 && frame->count == n) {
+        c->frame = frame;
+    } else {
+        lenv_del(frame);
+    }
+    return x;
+}
+
+/*
+ * Call c->f on x, returning whether it holds. Stores an error in *err, and
+ * returns 0, if the call fails or doesn't return a boolean.
+ */
+int lcall_test(lcall* c, lval* x, char* func, lval** err) {
+    x = lcall_run(c, &x, 1);
+    int t = lval_type(x);
+    if (t == LVAL_BOOL) { return lval_to_bool(x); }
+    if (t == LVAL_ERR) {
+        *err = x;
+    } else {
+        *err = lval_err("function '%s' passed a function returning %s, "
+            "expected %s", func, ltype_name(t), ltype_name(LVAL_BOOL));
+        lval_del(x);
+    }
+    return 0;
+}
+
+/*
+ * Return a list of the results of calling a function on each element of a
+ * list
+ */
+lval* builtin_map(lenv* e, lval* a) {
+    LASSERT_NUM("map", a, 2);
+    LASSERT_TYPE("map", a, 0, LVAL_FUN);
+    LASSERT_TYPE("map", a, 1, LVAL_QEXPR);
+
+    lval* q = lval_flat(a->cell[1]);
+    lval* r = lval_qexpr();
+    lval_reserve(r, q->count);
+
+    lcall c;
+    lcall_init(&c, e, a->cell[0]);
+    for (int i = 0; i < q->count; i++) {
+        lval* x = lval_ref(q->cell[i]);
+        x = lcall_run(&c, &x, 1);
+        if (lval_type(x) == LVAL_ERR) {
+            lval_del(r);
+            r = x;
+            break;
+        }
+        r->cell[r->count++] = x;
+    }
+    lcall_done(&c);
+    lval_del(a);
+    return r;
+}
+
+/*
+ * Return the elements of a list for which a function returns #t
+ */
+lval* builtin_filter(lenv* e, lval* a) {
+    LASSERT_NUM("filter", a, 2);
+    LASSERT_TYPE("filter", a, 0, LVAL_FUN);
+    LASSERT_TYPE("filter", a, 1, LVAL_QEXPR);
+
+    lval* q = lval_flat(a->cell[1]);
+    lval* r = lval_qexpr();
+    lval* err = NULL;
+
+    lcall c;
+    lcall_init(&c, e, a->cell[0]);
+    for (int i = 0; i < q->count && !err; i++) {
+        if (lcall_test(&c, lval_ref(q->cell[i]), "filter", &err)) {
+            r = lval_add(r, lval_ref(q->cell[i]));
+        }
+    }
+    lcall_done(&c);
+    lval_del(a);
+    if (err) { lval_del(r); return err; }
+    return r;
+}
+
+/*
+ * Fold a function over a list, from the left if left is set and otherwise
+ * from the right. The function is called with the accumulated value first
+ * from the left, and last from the right.
+ */
+lval* builtin_fold(lenv* e, lval* a, char* func, int left) {
+    LASSERT_NUM(func, a, 3);
+    LASSERT_TYPE(func, a, 0, LVAL_FUN);
+    LASSERT_TYPE(func, a, 2, LVAL_QEXPR);
+
+    lval* q = lval_flat(a->cell[2]);
+    lval* acc = lval_ref(a->cell[1]);
+
+    lcall c;
+    lcall_init(&c, e, a->cell[0]);
+    for (int i = 0; i < q->count && lval_type(acc) != LVAL_ERR; i++) {
+        lval* args[2];
+        if (left) {
+            args[0] = acc;
+            args[1] = lval_ref(q->cell[i]);
+        } else {
+            args[0] = lval_ref(q->cell[q->count - 1 - i]);
+            args[1] = acc;
+        }
+        acc = lcall_run(&c, args, 2);
+    }
+    lcall_done(&c);
+    lval_del(a);
+    return acc;
+}
+
+lval* builtin_foldl(lenv* e, lval* a) {
+    return builtin_fold(e, a, "foldl", 1);
+}
+
+lval* builtin_foldr(lenv* e, lval* a) {
+    return builtin_fold(e, a, "foldr", 0);
+}
+
+/*
+ * Return whether a function returns want for any element of a list, stopping
+ * at the first which it does
+ */
+lval* builtin_find(lenv* e, lval* a, char* func, int want) {
+    LASSERT_NUM(func, a, 2);
+    LASSERT_TYPE(func, a, 0, LVAL_FUN);
+    LASSERT_TYPE(func, a, 1, LVAL_QEXPR);
+
+    lval* q = lval_flat(a->cell[1]);
+    lval* err = NULL;
+    int found = 0;
+
+    lcall c;
+    lcall_init(&c, e, a->cell[0]);
+    for (int i = 0; i < q->count && !found && !err; i++) {
+        found = lcall_test(&c, lval_ref(q->cell[i]), func, &err) == want;
+        if (err) { found = 0; }
+    }
+    lcall_done(&c);
+    lval_del(a);
+    return err ? err : lval_bool(found);
+}
+
+lval* builtin_any(lenv* e, lval* a) {
+    return builtin_find(e, a, "any", 1);
+}
+
+/*
+ * Return whether a function returns #t for every element of a list
+ */
+lval* builtin_all(lenv* e, lval* a) {
+    lval* x = builtin_find(e, a, "all", 0);
+    if (lval_type(x) != LVAL_BOOL) { return x; }
+    return lval_bool(!lval_to_bool(x));
+}
+
+/*
+ * Return the number of live lvals, lenvs, cell arrays and strings, as
+ * {lval n lenv n cells n strings n}
+ *
+ * An expression with a single element evaluates to that element, so this is
+ * called with an empty q-expression, as (mem-stats {}).
+ */
+lval* builtin_mem_stats(lenv* e, lval* a) {
+    LASSERT_NUM("mem-stats", a, 1);
+    LASSERT_TYPE("mem-stats", a, 0, LVAL_QEXPR);
+    LASSERT(a, a->cell[0]->count == 0,
+        "function 'mem-stats' expected {}");
+    lval_del(a);
+
+    lmem_stats m = lmem_count();
+    lval* x = lval_qexpr();
+    x = lval_add(x, lval_sym("lval"));
+    x = lval_add(x, lval_num(m.lvals));
+    x = lval_add(x, lval_sym("lenv"));
+    x = lval_add(x, lval_num(m.lenvs));
+    x = lval_add(x, lval_sym("cells"));
+    x = lval_add(x, lval_num(m.cells));
+    x = lval_add(x, lval_sym("strings"));
+    x = lval_add(x, lval_num(m.strings));
+    return x;
+}
+
+/*
+ * Vectors
+ *
+ * An LVAL_VEC holds count int64_t numbers in one aligned buffer, so numeric
+ * data can be processed without visiting an lval per element. The builtins
+ * below run on kernels chosen at startup for the CPU: AVX2 where it's
+ * available, SSE2 on other x86-64 machines, and plain C elsewhere. Vector
+ * arithmetic which overflows is an error, as it is for '+' and '*'. The
+ * kernels OR together a flag per lane and test it once, and leave lanes
+ * whose products might not fit to the portable kernels, which check each.
+ */
+
+// Buffers are aligned, and padded, to this many bytes
+#define LVEC_ALIGN 32
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define LVEC_X86
+#include <immintrin.h>
+#define LVEC_AVX2 __attribute__((target("avx2")))
+#endif
+
+/*
+ * Allocate an aligned buffer for n numbers
+ */
+int64_t* lvec_alloc(int n) {
+    size_t size = sizeof(int64_t) * n;
+    size = (size + LVEC_ALIGN - 1) & ~(size_t)(LVEC_ALIGN - 1);
+    if (size == 0) { size = LVEC_ALIGN; }
+#ifdef _WIN32
+    return _aligned_malloc(size, LVEC_ALIGN);
+#else
+    return aligned_alloc(LVEC_ALIGN, size);
+#endif
 }
 
-void lval_print_str(lval* v) {
-    char* escaped = malloc(strlen(v->str) + 1);
-    strcpy(escaped, v->str);
+void lvec_free(int64_t* x) {
+#ifdef _WIN32
+    _aligned_free(x);
+#else
+    free(x);
+#endif
+}
 
-    escaped = mpcf_escape(escaped);
+lval* lval_vec(int n) {
+    lval* v = lpool_alloc(&lval_pool);
+    v->type = LVAL_VEC;
+    v->refs = 1;
+    v->count = n;
+    v->vec = lvec_alloc(n);
+    return v;
+}
 
-    printf("\"%s\"", escaped);
+// Whether x + y, wrapped to r, overflowed: the sign of r differs from both
+#define LVEC_ADD_OVERFLOW(x, y, r) ((((x) ^ (r)) & ((y) ^ (r))) < 0)
 
-    free(escaped);
-}
+// Store x * y in *r, evaluating to nonzero if it overflowed. Lanes are
+// int64_t, which long may be narrower than, so LNUM_MUL won't do.
+#if defined(__GNUC__)
+#define LVEC_MUL(x, y, r) __builtin_mul_overflow(x, y, r)
+#else
+#define LVEC_MUL(x, y, r) lvec_mul_overflow(x, y, r)
 
-/*
- * Print an LVAL s expression
- */
-void lval_expr_print(lval* v, char open, char close) {
-    putchar(open);
-    for (int i = 0; i < v->count; i++) {
-        lval_print(v->cell[i]);
-        if (i != (v->count - 1)) {
-            putchar(' ');
-        }
+int lvec_mul_overflow(int64_t x, int64_t y, int64_t* r) {
+    if (x > 0 ? (y > 0 ? x > INT64_MAX / y : y < INT64_MIN / x)
+              : (y > 0 ? x < INT64_MIN / y : x != 0 && y < INT64_MAX / x)) {
+        return 1;
     }
-    putchar(close);
+    *r = x * y;
+    return 0;
 }
+#endif
 
 /*
- * Recursively evaluate the LVAL AST
+ * Portable kernels. Those doing arithmetic store their result in r, and
+ * return nonzero if it overflowed.
  */
-lval* lval_eval(lenv* e, lval* v) {
-    if (v->type == LVAL_SYM) {
-        lval* x = lenv_get(e, v);
-        lval_del(v);
-        return x;
-    }
-    // Evaluate s expressions
-    if (v->type == LVAL_SEXPR) { return lval_eval_sexpr(e, v); }
-    return v;
-}
 
 /*
- * Recursively evaluate an LVAL s-expression and its children
+ * Sum x, which only overflows if the total does. The running total is kept
+ * wrapped, counting how far it has wrapped, so partial sums out of range are
+ * fine, and the kernels below can finish their sums with this.
  */
-lval* lval_eval_sexpr(lenv* e, lval* v) {
-    // Evaluate children
-    for (int i = 0; i < v->count; i++) {
-        v->cell[i] = lval_eval(e, v->cell[i]);
-    }
-
-    // Error checking
-    for (int i = 0; i < v->count; i++) {
-        if (v->cell[i]->type == LVAL_ERR) { return lval_take(v, i); }
+int lvec_sum_c(int64_t* x, int n, int64_t* r) {
+    uint64_t s = 0;
+    int wraps = 0;
+    for (int i = 0; i < n; i++) {
+        int64_t t = (int64_t)(s + (uint64_t)x[i]);
+        if (LVEC_ADD_OVERFLOW((int64_t)s, x[i], t)) {
+            wraps += x[i] < 0 ? -1 : 1;
+        }
+        s = (uint64_t)t;
     }
+    *r = (int64_t)s;
+    return wraps != 0;
+}
 
-    // Empty expression
-    if (v->count == 0) { return v; }
+int64_t lvec_min_c(int64_t* x, int n) {
+    int64_t m = x[0];
+    for (int i = 1; i < n; i++) { if (x[i] < m) { m = x[i]; } }
+    return m;
+}
 
-    // Single expression
-    if (v->count == 1) { return lval_take(v, 0); }
+int64_t lvec_max_c(int64_t* x, int n) {
+    int64_t m = x[0];
+    for (int i = 1; i < n; i++) { if (x[i] > m) { m = x[i]; } }
+    return m;
+}
 
-    // Ensure first element is a function 
-    lval* f = lval_pop(v, 0);
-    if (f->type != LVAL_FUN) {
-        lval* err = lval_err(
-            "s-expression starts with incorrect type. "
-            "Expected %s, got %s", ltype_name(LVAL_FUN), ltype_name(f->type));
-        lval_del(f);
-        lval_del(v);
-        return err;
+int lvec_add_c(int64_t* r, int64_t* x, int64_t* y, int n) {
+    int overflow = 0;
+    for (int i = 0; i < n; i++) {
+        // r may be x, so x[i] is read before r[i] is written
+        int64_t t = (int64_t)((uint64_t)x[i] + (uint64_t)y[i]);
+        overflow |= LVEC_ADD_OVERFLOW(x[i], y[i], t);
+        r[i] = t;
     }
-
-    // Call function
-    lval* result = lval_call(e, f, v);
-    lval_del(f);
-    return result;
+    return overflow;
 }
 
-void lenv_add_builtins(lenv* e) {
-    // List Functions
-    lenv_add_builtin(e, "list", builtin_list);
-    lenv_add_builtin(e, "head", builtin_head);
-    lenv_add_builtin(e, "tail", builtin_tail);
-    lenv_add_builtin(e, "eval", builtin_eval);
-    lenv_add_builtin(e, "join", builtin_join);
+int lvec_mul_c(int64_t* r, int64_t* x, int64_t* y, int n) {
+    int overflow = 0;
+    for (int i = 0; i < n; i++) {
+        int64_t p = 0;
+        overflow |= LVEC_MUL(x[i], y[i], &p);
+        r[i] = p;
+    }
+    return overflow;
+}
 
-    // Mathematical Functions
-    lenv_add_builtin(e, "+", builtin_add);
-    lenv_add_builtin(e, "-", builtin_sub);
-    lenv_add_builtin(e, "*", builtin_mul);
-    lenv_add_builtin(e, "/", builtin_div);
+/*
+ * Sum the products of x and y, overflowing if any product or the total does
+ */
+int lvec_dot_c(int64_t* x, int64_t* y, int n, int64_t* r) {
+    uint64_t s = 0;
+    int wraps = 0;
+    int overflow = 0;
+    for (int i = 0; i < n; i++) {
+        int64_t p = 0;
+        overflow |= LVEC_MUL(x[i], y[i], &p);
+        int64_t t = (int64_t)(s + (uint64_t)p);
+        if (LVEC_ADD_OVERFLOW((int64_t)s, p, t)) { wraps += p < 0 ? -1 : 1; }
+        s = (uint64_t)t;
+    }
+    *r = (int64_t)s;
+    return overflow || wraps != 0;
+}
 
-    // Comarison functions
-    lenv_add_builtin(e, "==", builtin_eq);
-    lenv_add_builtin(e, "!=", builtin_neq);
-    lenv_add_builtin(e, ">", builtin_gt);
-    lenv_add_builtin(e, ">=", builtin_ge);
-    lenv_add_builtin(e, "<", builtin_lt);
-    lenv_add_builtin(e, "<=", builtin_le);
+int lvec_filter_gt_c(int64_t* r, int64_t* x, int64_t y, int n) {
+    int count = 0;
+    for (int i = 0; i < n; i++) { if (x[i] > y) { r[count++] = x[i]; } }
+    return count;
+}
 
-    // Branching
-    lenv_add_builtin(e, "if", builtin_if);
+#ifdef LVEC_X86
+/*
+ * SSE2 kernels. SSE2 can't compare 64 bit lanes, so the comparisons use the
+ * portable kernels.
+ */
 
-    // Variable functions
-    lenv_add_builtin(e, "def", builtin_def);
+// Multiply 64 bit lanes, keeping the low 64 bits, from 32 bit products
+__m128i lvec_mul64_sse2(__m128i a, __m128i b) {
+    __m128i lo = _mm_mul_epu32(a, b);
+    __m128i t1 = _mm_mul_epu32(_mm_srli_epi64(a, 32), b);
+    __m128i t2 = _mm_mul_epu32(a, _mm_srli_epi64(b, 32));
+    return _mm_add_epi64(lo, _mm_slli_epi64(_mm_add_epi64(t1, t2), 32));
+}
 
-    // Lambdas
-    lenv_add_builtin(e, "\\", builtin_lambda);
+// Set the sign bit of each lane in which x + y, summed to r, overflowed
+__m128i lvec_add_overflow_sse2(__m128i x, __m128i y, __m128i r) {
+    return _mm_and_si128(_mm_xor_si128(x, r), _mm_xor_si128(y, r));
 }
 
-void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
-    lval* k = lval_sym(name);
-    lval* v = lval_fun(func);
-    lenv_put(e, k, v);
-    lval_del(k);
-    lval_del(v);
+// Make each lane of x outside the range of an int32_t nonzero. Products of
+// lanes in that range can't overflow.
+__m128i lvec_wide_sse2(__m128i x) {
+    return _mm_srli_epi64(_mm_add_epi64(x, _mm_set1_epi64x(1LL << 31)), 32);
 }
 
-lval* builtin_add(lenv* e, lval* a) {
-    return builtin_op(e, a, "+");
+int lvec_sign_sse2(__m128i x) {
+    return _mm_movemask_pd(_mm_castsi128_pd(x));
 }
 
-lval* builtin_sub(lenv* e, lval* a) {
-    return builtin_op(e, a, "-");
+int lvec_nonzero_sse2(__m128i x) {
+    return _mm_movemask_epi8(_mm_cmpeq_epi32(x, _mm_setzero_si128()))
+        != 0xFFFF;
 }
 
-lval* builtin_mul(lenv* e, lval* a) {
-    return builtin_op(e, a, "*");
+int lvec_sum_sse2(int64_t* x, int n, int64_t* r) {
+    __m128i s = _mm_setzero_si128();
+    __m128i overflow = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i a = _mm_load_si128((__m128i*)&x[i]);
+        __m128i t = _mm_add_epi64(s, a);
+        overflow = _mm_or_si128(overflow, lvec_add_overflow_sse2(s, a, t));
+        s = t;
+    }
+
+    // A lane which overflowed lost its sum, so start again with a kernel
+    // which follows how far the total wraps
+    if (lvec_sign_sse2(overflow)) { return lvec_sum_c(x, n, r); }
+    int64_t lanes[3];
+    _mm_storeu_si128((__m128i*)lanes, s);
+    for (int j = 2; i < n; i++, j++) { lanes[j] = x[i]; }
+    return lvec_sum_c(lanes, 2 + n % 2, r);
 }
 
-lval* builtin_div(lenv* e, lval* a) {
-    return builtin_op(e, a, "/");
+int lvec_add_sse2(int64_t* r, int64_t* x, int64_t* y, int n) {
+    __m128i overflow = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i a = _mm_load_si128((__m128i*)&x[i]);
+        __m128i b = _mm_load_si128((__m128i*)&y[i]);
+        __m128i t = _mm_add_epi64(a, b);
+        overflow = _mm_or_si128(overflow, lvec_add_overflow_sse2(a, b, t));
+        _mm_store_si128((__m128i*)&r[i], t);
+    }
+    return lvec_sign_sse2(overflow) | lvec_add_c(&r[i], &x[i], &y[i], n - i);
 }
 
-/*
- * Apply the builtin operation op to each of the nodes in a->cell
- */
-lval* builtin_op(lenv* e, lval* a, char* op) {
-    // Ensure all arguments are numbers
-    for (int i = 0; i < a->count; i++) {
-        if (a->cell[i]->type != LVAL_NUM) {
-            lval_del(a);
-            return lval_err("cannot operate on a non-number");
+int lvec_mul_sse2(int64_t* r, int64_t* x, int64_t* y, int n) {
+    int overflow = 0;
+    int i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i a = _mm_load_si128((__m128i*)&x[i]);
+        __m128i b = _mm_load_si128((__m128i*)&y[i]);
+        if (lvec_nonzero_sse2(
+                _mm_or_si128(lvec_wide_sse2(a), lvec_wide_sse2(b)))) {
+            // The product may overflow, so let the portable kernel check
+            overflow |= lvec_mul_c(&r[i], &x[i], &y[i], 2);
+            continue;
         }
+        _mm_store_si128((__m128i*)&r[i], lvec_mul64_sse2(a, b));
     }
+    return overflow | lvec_mul_c(&r[i], &x[i], &y[i], n - i);
+}
 
-    // If operation is subtract and there's one argument, negate it
-    lval* x = lval_pop(a, 0);
-    if ((strcmp(op, "-") == 0) && a->count == 0) {
-        x->num = -x->num;
-    }
-
-    // While there are remaining elements, pop them and combine with the first
-    // using the operation op
-    while (a->count > 0) {
-        lval* y = lval_pop(a, 0);
-
-        if (strcmp(op, "+") == 0) { x->num += y->num; }
-        if (strcmp(op, "-") == 0) { x->num -= y->num; }
-        if (strcmp(op, "*") == 0) { x->num *= y->num; }
-        if (strcmp(op, "/") == 0) {
-            if (y->num == 0) {
-                lval_del(x); lval_del(y);
-                x = lval_err("division by zero");
-                break;
-            }
-            x->num /= y->num;
-        }
-        if (strcmp(op, "==") == 0) {  }
-        lval_del(y);
+int lvec_dot_sse2(int64_t* x, int64_t* y, int n, int64_t* r) {
+    __m128i s = _mm_setzero_si128();
+    __m128i wide = _mm_setzero_si128();
+    __m128i overflow = _mm_setzero_si128();
+    int i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i a = _mm_load_si128((__m128i*)&x[i]);
+        __m128i b = _mm_load_si128((__m128i*)&y[i]);
+        wide = _mm_or_si128(wide,
+            _mm_or_si128(lvec_wide_sse2(a), lvec_wide_sse2(b)));
+        __m128i p = lvec_mul64_sse2(a, b);
+        __m128i t = _mm_add_epi64(s, p);
+        overflow = _mm_or_si128(overflow, lvec_add_overflow_sse2(s, p, t));
+        s = t;
     }
-    lval_del(a);
-    return x;
+
+    // Start again with the portable kernel if any product may have
+    // overflowed, or any lane's sum did
+    int64_t lanes[3];
+    if (lvec_nonzero_sse2(wide) || lvec_sign_sse2(overflow) ||
+            lvec_dot_c(&x[i], &y[i], n - i, &lanes[2])) {
+        return lvec_dot_c(x, y, n, r);
+    }
+    _mm_storeu_si128((__m128i*)lanes, s);
+    return lvec_sum_c(lanes, 3, r);
 }
 
-lval* builtin_eq(lenv* e, lval* a) {
-    return builtin_cmp(e, a, "==");
+/*
+ * AVX2 kernels
+ */
+LVEC_AVX2 __m256i lvec_mul64_avx2(__m256i a, __m256i b) {
+    __m256i lo = _mm256_mul_epu32(a, b);
+    __m256i t1 = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), b);
+    __m256i t2 = _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32));
+    return _mm256_add_epi64(lo,
+        _mm256_slli_epi64(_mm256_add_epi64(t1, t2), 32));
 }
 
-lval* builtin_neq(lenv* e, lval* a) {
-    return builtin_cmp(e, a, "!=");
+// Reduce the four lanes of x and the value tail with the portable kernel k
+LVEC_AVX2 int64_t lvec_reduce_avx2(__m256i x, int64_t tail,
+        int64_t (*k)(int64_t*, int)) {
+    int64_t lanes[5];
+    _mm256_storeu_si256((__m256i*)lanes, x);
+    lanes[4] = tail;
+    return k(lanes, 5);
 }
 
-lval* builtin_cmp(lenv* e, lval* a, char* op) {
-    LASSERT_NUM(op, a, 2);
-    if (strcmp(op, "==") == 0) { 
-        return lval_bool(lval_eq(a->cell[0], a->cell[1])); }
-    if (strcmp(op, "!=") == 0) { 
-        return lval_bool(!lval_eq(a->cell[0], a->cell[1])); }
-    return lval_err("unrecognised comparison operator: '%s'", op);
+LVEC_AVX2 __m256i lvec_add_overflow_avx2(__m256i x, __m256i y, __m256i r) {
+    return _mm256_and_si256(_mm256_xor_si256(x, r), _mm256_xor_si256(y, r));
 }
 
-lval* builtin_gt(lenv* e, lval* a) {
-    return builtin_ord(e, a, ">");
+LVEC_AVX2 __m256i lvec_wide_avx2(__m256i x) {
+    return _mm256_srli_epi64(
+        _mm256_add_epi64(x, _mm256_set1_epi64x(1LL << 31)), 32);
 }
 
-lval* builtin_ge(lenv* e, lval* a) {
-    return builtin_ord(e, a, ">=");
+LVEC_AVX2 int lvec_sign_avx2(__m256i x) {
+    return _mm256_movemask_pd(_mm256_castsi256_pd(x));
 }
 
-lval* builtin_lt(lenv* e, lval* a) {
-    return builtin_ord(e, a, "<");
+LVEC_AVX2 int lvec_sum_avx2(int64_t* x, int n, int64_t* r) {
+    __m256i s = _mm256_setzero_si256();
+    __m256i overflow = _mm256_setzero_si256();
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i a = _mm256_load_si256((__m256i*)&x[i]);
+        __m256i t = _mm256_add_epi64(s, a);
+        overflow = _mm256_or_si256(overflow,
+            lvec_add_overflow_avx2(s, a, t));
+        s = t;
+    }
+
+    if (lvec_sign_avx2(overflow)) { return lvec_sum_c(x, n, r); }
+    int64_t lanes[7];
+    _mm256_storeu_si256((__m256i*)lanes, s);
+    for (int j = 4; i < n; i++, j++) { lanes[j] = x[i]; }
+    return lvec_sum_c(lanes, 4 + n % 4, r);
 }
 
-lval* builtin_le(lenv* e, lval* a) {
-    return builtin_ord(e, a, "<=");
+LVEC_AVX2 int64_t lvec_min_avx2(int64_t* x, int n) {
+    if (n < 4) { return lvec_min_c(x, n); }
+    __m256i m = _mm256_load_si256((__m256i*)x);
+    int i = 4;
+    for (; i + 4 <= n; i += 4) {
+        __m256i a = _mm256_load_si256((__m256i*)&x[i]);
+        m = _mm256_blendv_epi8(m, a, _mm256_cmpgt_epi64(m, a));
+    }
+    // The tail may be empty, so x[0] stands in for it
+    int64_t tail = i < n ? lvec_min_c(&x[i], n - i) : x[0];
+    return lvec_reduce_avx2(m, tail, lvec_min_c);
 }
 
-lval* builtin_ord(lenv* e, lval* a, char* op) {
-    LASSERT_NUM(op, a, 2);
-    for (int i = 0; i < a->count; i++) {
-        LASSERT_TYPE(op, a, i, LVAL_NUM);
+LVEC_AVX2 int64_t lvec_max_avx2(int64_t* x, int n) {
+    if (n < 4) { return lvec_max_c(x, n); }
+    __m256i m = _mm256_load_si256((__m256i*)x);
+    int i = 4;
+    for (; i + 4 <= n; i += 4) {
+        __m256i a = _mm256_load_si256((__m256i*)&x[i]);
+        m = _mm256_blendv_epi8(m, a, _mm256_cmpgt_epi64(a, m));
     }
+    // The tail may be empty, so x[0] stands in for it
+    int64_t tail = i < n ? lvec_max_c(&x[i], n - i) : x[0];
+    return lvec_reduce_avx2(m, tail, lvec_max_c);
+}
 
-    lval* x = lval_pop(a, 0);
-    lval* y = lval_pop(a, 0);
+LVEC_AVX2 int lvec_add_avx2(int64_t* r, int64_t* x, int64_t* y, int n) {
+    __m256i overflow = _mm256_setzero_si256();
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i a = _mm256_load_si256((__m256i*)&x[i]);
+        __m256i b = _mm256_load_si256((__m256i*)&y[i]);
+        __m256i t = _mm256_add_epi64(a, b);
+        overflow = _mm256_or_si256(overflow,
+            lvec_add_overflow_avx2(a, b, t));
+        _mm256_store_si256((__m256i*)&r[i], t);
+    }
+    return lvec_sign_avx2(overflow) | lvec_add_c(&r[i], &x[i], &y[i], n - i);
+}
 
-    if (strcmp(op, "<") == 0) { return lval_bool(x->num < y->num); }
-    if (strcmp(op, ">") == 0) { return lval_bool(x->num > y->num); }
-    if (strcmp(op, "<=") == 0) { return lval_bool(x->num <= y->num); }
-    if (strcmp(op, ">=") == 0) { return lval_bool(x->num >= y->num); }
-    if (strcmp(op, "==") == 0) { return lval_bool(lval_eq(x, y)); }
-    if (strcmp(op, "!=") == 0) { return lval_bool(!lval_eq(x, y)); }
-    return lval_err("undefined comparison operator '%s'", op);
+LVEC_AVX2 int lvec_mul_avx2(int64_t* r, int64_t* x, int64_t* y, int n) {
+    int overflow = 0;
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i a = _mm256_load_si256((__m256i*)&x[i]);
+        __m256i b = _mm256_load_si256((__m256i*)&y[i]);
+        __m256i wide = _mm256_or_si256(lvec_wide_avx2(a), lvec_wide_avx2(b));
+        if (!_mm256_testz_si256(wide, wide)) {
+            overflow |= lvec_mul_c(&r[i], &x[i], &y[i], 4);
+            continue;
+        }
+        _mm256_store_si256((__m256i*)&r[i], lvec_mul64_avx2(a, b));
+    }
+    return overflow | lvec_mul_c(&r[i], &x[i], &y[i], n - i);
 }
 
-/*
- * Return the first element of a q-expression
- */
-lval* builtin_head(lenv* e, lval* a) {
-    LASSERT_NUM("head", a, 1);
-    LASSERT_TYPE("head", a, 0, LVAL_QEXPR);
-    LASSERT_NOT_EMPTY("head", a, 0);
+LVEC_AVX2 int lvec_dot_avx2(int64_t* x, int64_t* y, int n, int64_t* r) {
+    __m256i s = _mm256_setzero_si256();
+    __m256i wide = _mm256_setzero_si256();
+    __m256i overflow = _mm256_setzero_si256();
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i a = _mm256_load_si256((__m256i*)&x[i]);
+        __m256i b = _mm256_load_si256((__m256i*)&y[i]);
+        wide = _mm256_or_si256(wide,
+            _mm256_or_si256(lvec_wide_avx2(a), lvec_wide_avx2(b)));
+        __m256i p = lvec_mul64_avx2(a, b);
+        __m256i t = _mm256_add_epi64(s, p);
+        overflow = _mm256_or_si256(overflow,
+            lvec_add_overflow_avx2(s, p, t));
+        s = t;
+    }
 
-    lval* v = lval_take(a, 0);
-    // Delete all elements which aren't the head and return
-    while (v->count > 1) { lval_del(lval_pop(v, 1)); }
-    return v;
+    int64_t lanes[5];
+    if (!_mm256_testz_si256(wide, wide) || lvec_sign_avx2(overflow) ||
+            lvec_dot_c(&x[i], &y[i], n - i, &lanes[4])) {
+        return lvec_dot_c(x, y, n, r);
+    }
+    _mm256_storeu_si256((__m256i*)lanes, s);
+    return lvec_sum_c(lanes, 5, r);
 }
 
-/*
- * Return all but the first element of a q-expression
- */
-lval* builtin_tail(lenv* e, lval* a) {
-    LASSERT_NUM("tail", a, 1);
-    LASSERT_TYPE("tail", a, 0, LVAL_QEXPR);
-    LASSERT_NOT_EMPTY("tail", a, 0);
-
-    lval* v = lval_take(a, 0);
-    // Delete first element and return
-    lval_del(lval_pop(v, 0));
-    return v;
+LVEC_AVX2 int lvec_filter_gt_avx2(int64_t* r, int64_t* x, int64_t y, int n) {
+    __m256i b = _mm256_set1_epi64x(y);
+    int count = 0;
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i a = _mm256_load_si256((__m256i*)&x[i]);
+        int mask = _mm256_movemask_pd(
+            _mm256_castsi256_pd(_mm256_cmpgt_epi64(a, b)));
+        // Store each selected lane, leaving the loop early if none are
+        for (; mask; mask &= mask - 1) {
+            r[count++] = x[i + __builtin_ctz(mask)];
+        }
+    }
+    return count + lvec_filter_gt_c(&r[count], &x[i], y, n - i);
 }
+#endif
+
+// A set of kernels for one instruction set
+typedef struct {
+    char* name;
+    int (*sum)(int64_t* x, int n, int64_t* r);
+    int64_t (*min)(int64_t* x, int n);
+    int64_t (*max)(int64_t* x, int n);
+    int (*add)(int64_t* r, int64_t* x, int64_t* y, int n);
+    int (*mul)(int64_t* r, int64_t* x, int64_t* y, int n);
+    int (*dot)(int64_t* x, int64_t* y, int n, int64_t* r);
+    int (*filter_gt)(int64_t* r, int64_t* x, int64_t y, int n);
+} lvec_kernels;
+
+lvec_kernels lvec_kernel_sets[] = {
+#ifdef LVEC_X86
+    { "avx2", lvec_sum_avx2, lvec_min_avx2, lvec_max_avx2, lvec_add_avx2,
+        lvec_mul_avx2, lvec_dot_avx2, lvec_filter_gt_avx2 },
+    { "sse2", lvec_sum_sse2, lvec_min_c, lvec_max_c, lvec_add_sse2,
+        lvec_mul_sse2, lvec_dot_sse2, lvec_filter_gt_c },
+#endif
+    { "c", lvec_sum_c, lvec_min_c, lvec_max_c, lvec_add_c, lvec_mul_c,
+        lvec_dot_c, lvec_filter_gt_c },
+    { NULL }
+};
+
+// The kernels used by the builtins
+lvec_kernels* lvec = NULL;
 
 /*
- * Convert an s-expression to a q-expression
+ * Return whether the CPU can run the kernel set k
  */
-lval* builtin_list(lenv* e, lval* a) {
-    a->type = LVAL_QEXPR;
-    return a;
+int lvec_supported(lvec_kernels* k) {
+#ifdef LVEC_X86
+    if (strcmp(k->name, "avx2") == 0) {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+    }
+#endif
+    return 1;
 }
 
 /*
- * Evaluate a q-expression as an s-expression
+ * Choose the kernels named name, or if name is NULL the best the CPU
+ * supports. Returns 0 if there's no such kernel set.
  */
-lval* builtin_eval(lenv* e, lval* a) {
-    LASSERT_NUM("eval", a, 1);
-    LASSERT_TYPE("eval", a, 0, LVAL_QEXPR);
-    
-    lval* x = lval_take(a, 0);
-    x->type = LVAL_SEXPR;
-    return lval_eval(e, x);
+int lvec_init(char* name) {
+    for (lvec_kernels* k = lvec_kernel_sets; k->name; k++) {
+        if (name ? strcmp(name, k->name) != 0 : !lvec_supported(k)) {
+            continue;
+        }
+        lvec = k;
+        return 1;
+    }
+    return 0;
 }
 
+// Ensure argument i of a is a non-empty vector
+#define LASSERT_VEC_NOT_EMPTY(func, args, index) \
+    LASSERT(args, args->cell[index]->count != 0, \
+        "function '%s' passed an empty vector for argument %d", func, index)
+
 /*
- * Join two or more q-expressions
+ * Convert a q-expression of numbers to a vector
  */
-lval* builtin_join(lenv* e, lval* a) {
-    for (int i = 0; i < a->count; i++) {
-        LASSERT_TYPE("join", a, i, LVAL_QEXPR);
+lval* builtin_vec(lenv* e, lval* a) {
+    LASSERT_NUM("vec", a, 1);
+    LASSERT_TYPE("vec", a, 0, LVAL_QEXPR);
+
+    lval* q = lval_flat(a->cell[0]);
+    for (int i = 0; i < q->count; i++) {
+        LASSERT(a, lval_type(q->cell[i]) == LVAL_NUM,
+            "function 'vec' passed element %d of type %s, expected %s",
+            i, ltype_name(lval_type(q->cell[i])), ltype_name(LVAL_NUM));
     }
 
-    lval* x = lval_pop(a, 0);
-
-    while (a->count) {
-        x = lval_join(x, lval_pop(a, 0));
+    lval* v = lval_vec(q->count);
+    for (int i = 0; i < q->count; i++) {
+        v->vec[i] = lval_to_num(q->cell[i]);
     }
     lval_del(a);
-    return x;
-}
-
-lval* builtin_def(lenv* e, lval* a) {
-    return builtin_var(e, a, "def");
-}
-
-lval* builtin_put(lenv* e, lval* a) {
-    return builtin_var(e, a, "=");
+    return v;
 }
 
 /*
- * Bind a list of symbols in a q-expression to values
+ * Convert a vector to a q-expression of numbers
  */
-lval* builtin_var(lenv* e, lval* a, char* func) {
-    LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
+lval* builtin_vlist(lenv* e, lval* a) {
+    LASSERT_NUM("vlist", a, 1);
+    LASSERT_TYPE("vlist", a, 0, LVAL_VEC);
 
-    lval* syms = a->cell[0];
-    
-    for (int i = 0; i < syms->count; i++) {
-        LASSERT(a, syms->cell[i]->type == LVAL_SYM,
-            "function '%s' can only define items of type %s. Argument %d is "
-            "type %s", func,
-            ltype_name(LVAL_SYM), i, ltype_name(syms->cell[i]->type));
+    lval* v = a->cell[0];
+    lval* q = lval_qexpr();
+    lval_reserve(q, v->count);
+    for (int i = 0; i < v->count; i++) {
+        q->cell[q->count++] = lval_num(v->vec[i]);
     }
+    lval_del(a);
+    return q;
+}
 
-    LASSERT(a, syms->count == a->count-1, 
-        "function '%s' cannot define an incorrect number of values to symbols. "
-        "Num values: %d, num symbols: %d", func, syms->count, a->count-1);
+lval* builtin_vsum(lenv* e, lval* a) {
+    LASSERT_NUM("vsum", a, 1);
+    LASSERT_TYPE("vsum", a, 0, LVAL_VEC);
 
-    for (int i = 0; i < syms->count; i++) {
-        // Def defines globally, '=' defines locally
-        if (strcmp(func, "def") == 0) {
-            lenv_def(e, syms->cell[i], a->cell[i+1]);
-        }
+    int64_t x;
+    int overflow = lvec->sum(a->cell[0]->vec, a->cell[0]->count, &x);
+    lval_del(a);
+    if (overflow) { return lval_err("integer overflow in 'vsum'"); }
+    return lval_num(x);
+}
 
-        if (strcmp(func, "=") == 0) {
-            lenv_put(e, syms->cell[i], a->cell[i+1]);
-        }
-    }
+lval* builtin_vmin(lenv* e, lval* a) {
+    LASSERT_NUM("vmin", a, 1);
+    LASSERT_TYPE("vmin", a, 0, LVAL_VEC);
+    LASSERT_VEC_NOT_EMPTY("vmin", a, 0);
 
+    lval* x = lval_num(lvec->min(a->cell[0]->vec, a->cell[0]->count));
     lval_del(a);
-    return lval_sexpr();
+    return x;
 }
 
-lval* builtin_lambda(lenv* e, lval* a) {
-    LASSERT_NUM("\\", a, 2);
-    LASSERT_TYPE("\\", a, 0, LVAL_QEXPR);
-    LASSERT_TYPE("\\", a, 1, LVAL_QEXPR);
-
-    // Check the first q-expression only contains symbols
-    for (int i = 0; i < a->cell[0]->count; i++) {
-        LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM),
-            "cannot define a non-symbol. Got %s, expected %s",
-            ltype_name(a->cell[0]->cell[i]->type), ltype_name(LVAL_SYM));
-    }
+lval* builtin_vmax(lenv* e, lval* a) {
+    LASSERT_NUM("vmax", a, 1);
+    LASSERT_TYPE("vmax", a, 0, LVAL_VEC);
+    LASSERT_VEC_NOT_EMPTY("vmax", a, 0);
 
-    // Pop the first two arguments and pass them to lval_lambda
-    lval* formals = lval_pop(a, 0);
-    lval* body = lval_pop(a, 0);
+    lval* x = lval_num(lvec->max(a->cell[0]->vec, a->cell[0]->count));
     lval_del(a);
-
-    return lval_lambda(formals, body);
+    return x;
 }
 
-lval* builtin_if(lenv* e, lval*a) {
-    LASSERT(a, a->count == 2 || a->count == 3, "'if' statements require 2 or "
-        "3 arguments. Got %d", a->count);
-    LASSERT_TYPE("if", a, 0, LVAL_BOOL);
-    LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
-    if (a->count == 3) {
-        LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
+/*
+ * Apply the elementwise kernel k to the vector a->cell[0] and either a vector
+ * of the same length or a number, which is used for every element
+ */
+lval* builtin_vop(lenv* e, lval* a, char* func,
+        int (*k)(int64_t*, int64_t*, int64_t*, int)) {
+    LASSERT_NUM(func, a, 2);
+    LASSERT_TYPE(func, a, 0, LVAL_VEC);
+    int n = a->cell[0]->count;
+    if (lval_type(a->cell[1]) == LVAL_NUM) {
+        // Broadcast the number to a vector
+        long y = lval_to_num(a->cell[1]);
+        lval_del(a->cell[1]);
+        a->cell[1] = lval_vec(n);
+        for (int i = 0; i < n; i++) { a->cell[1]->vec[i] = y; }
     }
+    LASSERT_TYPE(func, a, 1, LVAL_VEC);
+    LASSERT(a, a->cell[1]->count == n,
+        "function '%s' passed vectors of different lengths, %d and %d",
+        func, n, a->cell[1]->count);
 
-    lval* cond = lval_pop(a, 0);
-    lval* if_expr = lval_pop(a, 0);
-    lval* else_expr;
-    if (a->count == 1) {
-        else_expr = lval_pop(a, 0);
-    } else {
-        else_expr = lval_sexpr();
+    // Write the result over x if nothing else holds it
+    lval* x = lval_pop(a, 0);
+    lval* r = x->refs == 1 ? lval_ref(x) : lval_vec(n);
+    int overflow = k(r->vec, x->vec, a->cell[0]->vec, n);
+    lval_del(x);
+    lval_del(a);
+    if (overflow) {
+        lval_del(r);
+        return lval_err("integer overflow in '%s'", func);
     }
+    return r;
+}
+
+lval* builtin_vadd(lenv* e, lval* a) {
+    return builtin_vop(e, a, "v+", lvec->add);
+}
 
-    // Mark expressions as executable
-    if_expr->type=LVAL_SEXPR;
-    else_expr->type=LVAL_SEXPR;
+lval* builtin_vmul(lenv* e, lval* a) {
+    return builtin_vop(e, a, "v*", lvec->mul);
+}
 
+lval* builtin_vdot(lenv* e, lval* a) {
+    LASSERT_NUM("vdot", a, 2);
+    LASSERT_TYPE("vdot", a, 0, LVAL_VEC);
+    LASSERT_TYPE("vdot", a, 1, LVAL_VEC);
+    int n = a->cell[0]->count;
+    LASSERT(a, a->cell[1]->count == n,
+        "function 'vdot' passed vectors of different lengths, %d and %d",
+        n, a->cell[1]->count);
+
+    int64_t x;
+    int overflow = lvec->dot(a->cell[0]->vec, a->cell[1]->vec, n, &x);
     lval_del(a);
+    if (overflow) { return lval_err("integer overflow in 'vdot'"); }
+    return lval_num(x);
+}
 
-    if (cond->bool) {
-        return lval_eval(e, if_expr);
-    } else {
-        return lval_eval(e, else_expr);
-    }
+/*
+ * Return the elements of a vector greater than a number
+ */
+lval* builtin_vfilter_gt(lenv* e, lval* a) {
+    LASSERT_NUM("vfilter-gt", a, 2);
+    LASSERT_TYPE("vfilter-gt", a, 0, LVAL_VEC);
+    LASSERT_TYPE("vfilter-gt", a, 1, LVAL_NUM);
+
+    lval* x = a->cell[0];
+    lval* r = lval_vec(x->count);
+    r->count = lvec->filter_gt(r->vec, x->vec, lval_to_num(a->cell[1]),
+        x->count);
+    lval_del(a);
+    return r;
 }
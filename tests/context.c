@@ -0,0 +1,114 @@
+/*
+** Parse Contexts
+**
+** A context keeps one input across parses. Each
+** parse must give what a parse of its own would,
+** whatever the parses before it left behind: an
+** error part of the way through, DFAs turned off
+** to report it, or packrat results for the same
+** positions of another input.
+*/
+
+#include "mpc.h"
+
+static int same = 1;
+
+static void check(mpc_context_t *c, const char *s, mpc_parser_t *p) {
+  mpc_result_t r, q;
+  int ok = mpc_context_parse(c, "<test>", s, p, &r);
+  int ok_alone = mpc_parse("<test>", s, p, &q);
+
+  if (ok != ok_alone) {
+    printf("\"%s\": differs from a parse of its own\n", s);
+    same = 0;
+  } else if (ok) {
+    if (!mpc_ast_eq(r.output, q.output)) {
+      printf("\"%s\": differs from a parse of its own\n", s);
+      same = 0;
+    }
+    printf("\"%s\": %d children\n", s, ((mpc_ast_t*)r.output)->children_num);
+  } else {
+    char *e = mpc_err_string(r.error);
+    char *e_alone = mpc_err_string(q.error);
+    if (strcmp(e, e_alone) != 0) {
+      printf("\"%s\": differs from a parse of its own\n", s);
+      same = 0;
+    }
+    printf("\"%s\": %s", s, e);
+    free(e);
+    free(e_alone);
+  }
+
+  if (ok) { mpc_ast_delete(r.output); } else { mpc_err_delete(r.error); }
+  if (ok_alone) { mpc_ast_delete(q.output); } else { mpc_err_delete(q.error); }
+}
+
+static void run(int flags) {
+  mpc_parser_t *Number = mpc_new("number");
+  mpc_parser_t *Symbol = mpc_new("symbol");
+  mpc_parser_t *String = mpc_new("string");
+  mpc_parser_t *Sexpr = mpc_new("sexpr");
+  mpc_parser_t *Qexpr = mpc_new("qexpr");
+  mpc_parser_t *Expr = mpc_new("expr");
+  mpc_parser_t *Lispy = mpc_new("lispy");
+  mpc_context_t *c = mpc_context_new();
+  mpc_mem_stats_t st;
+  mpc_result_t r;
+  char path[] = "/tmp/mpc_context_XXXXXX";
+  FILE *f;
+  int fd, j;
+
+  mpca_lang(flags,
+    "number : /-?[0-9]+/ ;"
+    "symbol : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;"
+    "string : /\"(\\\\.|[^\"])*\"/ ;"
+    "sexpr  : '(' <expr>* ')' ;"
+    "qexpr  : '{' <expr>* '}' ;"
+    "expr   : <number> | <symbol> | <string> | <sexpr> | <qexpr> ;"
+    "lispy  : /^/ <expr>* /$/ ;",
+    Number, Symbol, String, Sexpr, Qexpr, Expr, Lispy, NULL);
+
+  printf("%s\n", flags & MPCA_LANG_PACKRAT ? "packrat" : "default");
+  for (j = 0; j < 2; j++) {
+    check(c, "(+ 1 2)", Lispy);
+    check(c, "(+ 1 (* 2", Lispy);
+    check(c, "{a b} \"s\"", Lispy);
+    check(c, "(head {1 2 3})", Lispy);
+    check(c, "\"open", Lispy);
+    check(c, "", Lispy);
+    check(c, "{1 2 3} (tail x)", Lispy);
+    check(c, "(a))", Lispy);
+  }
+
+  /* Files share the context with strings */
+  fd = mkstemp(path);
+  f = fdopen(fd, "w");
+  fputs("(def {x} \"file\")\n(+ 1\n", f);
+  fclose(f);
+  for (j = 0; j < 2; j++) {
+    if (mpc_context_parse_contents(c, path, Lispy, &r)) {
+      mpc_ast_delete(r.output);
+    } else {
+      char *e = mpc_err_string(r.error);
+      printf("file: %s", strstr(e, ":") + 1);
+      free(e);
+      mpc_err_delete(r.error);
+    }
+    check(c, "(+ 1 2)", Lispy);
+  }
+  remove(path);
+
+  mpc_context_stats(c, &st);
+  printf("parses %lu, pooled %s\n", st.parses,
+    st.pooled > st.fallback + st.large ? "mostly" : "rarely");
+
+  mpc_context_delete(c);
+  mpc_cleanup(7, Number, Symbol, String, Sexpr, Qexpr, Expr, Lispy);
+}
+
+int main(void) {
+  run(MPCA_LANG_DEFAULT);
+  run(MPCA_LANG_PACKRAT);
+  printf("%s\n", same ? "all the same" : "some differ");
+  return !same;
+}
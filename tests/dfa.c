@@ -0,0 +1,122 @@
+/*
+** Regex DFAs
+**
+** `mpc_re` compiles regexes into DFAs, which are
+** only run on String and Mmap inputs. Parsing
+** from a file runs the combinator trees they
+** replace, so each input is parsed both ways and
+** must give the same result or the same error,
+** including regexes whose DFAs bail out to their
+** combinators and failed parses which are run
+** again with DFAs turned off to find the error.
+*/
+
+#include "mpc.h"
+
+static int same = 1;
+
+/* Parses `s` with `p`, into the output string or the error message */
+static char *parse(const char *s, mpc_parser_t *p, int file, mpc_dtor_t d) {
+  mpc_result_t r;
+  char *out;
+  int ok;
+  FILE *f = NULL;
+
+  if (file) {
+    f = tmpfile();
+    fputs(s, f);
+    rewind(f);
+    ok = mpc_parse_file("<test>", f, p, &r);
+    fclose(f);
+  } else {
+    ok = mpc_parse("<test>", s, p, &r);
+  }
+
+  if (!ok) {
+    out = mpc_err_string(r.error);
+    mpc_err_delete(r.error);
+  } else if (d == free) {
+    out = malloc(strlen(r.output) + 4);
+    sprintf(out, "\"%s\"\n", (char*)r.output);
+    free(r.output);
+  } else {
+    out = malloc(32);
+    sprintf(out, "%d children\n", ((mpc_ast_t*)r.output)->children_num);
+    d(r.output);
+  }
+  return out;
+}
+
+static void check(const char *name, const char *s, mpc_parser_t *p, mpc_dtor_t d) {
+  char *x = parse(s, p, 0, d);
+  char *y = parse(s, p, 1, d);
+  if (strcmp(x, y) != 0) {
+    printf("%s \"%s\": differs from the combinators: %s", name, s, y);
+    same = 0;
+  }
+  printf("%s \"%s\": %s", name, s, x);
+  free(x);
+  free(y);
+}
+
+/* Matches `re` against each of the inputs, up to a NULL */
+static void regex(const char *re, ...) {
+  va_list va;
+  const char *s;
+  mpc_parser_t *p = mpc_re(re);
+  va_start(va, re);
+  while ((s = va_arg(va, const char*))) { check(re, s, p, free); }
+  va_end(va);
+  mpc_delete(p);
+}
+
+int main(void) {
+  mpc_parser_t *Number, *Symbol, *String, *Comment, *Sexpr, *Qexpr, *Expr, *Lispy;
+
+  /* Regexes of the santoku grammar, which compile to DFAs */
+  regex("-?[0-9]+(\\.[0-9]+)?", "42", "-7", "3.25", "3.", "-", "x", "", NULL);
+  regex("[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+", "def", "+", "a\\b", " x", NULL);
+  regex("\"(\\\\.|[^\"])*\"", "\"hi\"", "\"a\\\"b\"", "\"open", "\"\\", NULL);
+  regex(";[^\\r\\n]*", "; note\nx", ";", "x", NULL);
+
+  /* Alternatives which both take the next character make the DFA bail */
+  regex("ab|ac", "ab", "ac", "ad", "a", NULL);
+  regex("a*ab", "aaab", "ab", "aaa", "b", NULL);
+  regex("(a|ab)(c|bcd)", "abcd", "ac", "abc", "abd", NULL);
+  regex("x(a|ab)*y", "xababay", "xabaa", "xy", NULL);
+
+  /* Anchors leave the regex as combinators */
+  regex("^ab$", "ab", "abc", NULL);
+
+  Number = mpc_new("number");
+  Symbol = mpc_new("symbol");
+  String = mpc_new("string");
+  Comment = mpc_new("comment");
+  Sexpr = mpc_new("sexpr");
+  Qexpr = mpc_new("qexpr");
+  Expr = mpc_new("expr");
+  Lispy = mpc_new("lispy");
+
+  mpca_lang(MPCA_LANG_DEFAULT,
+    "number  : /-?[0-9]+(\\.[0-9]+)?/ ;"
+    "symbol  : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;"
+    "string  : /\"(\\\\.|[^\"])*\"/ ;"
+    "comment : /;[^\\r\\n]*/ ;"
+    "sexpr   : '(' <expr>* ')' ;"
+    "qexpr   : '{' <expr>* '}' ;"
+    "expr    : <number> | <symbol> | <string> | <comment> | <sexpr> | <qexpr> ;"
+    "lispy   : /^/ <expr>* /$/ ;",
+    Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy, NULL);
+
+  /* Failed parses are run again without DFAs to report the error */
+  check("lispy", "(def {x} 1) ; one\n(+ x 2.5)", Lispy, (mpc_dtor_t)mpc_ast_delete);
+  check("lispy", "(def {x} 1", Lispy, (mpc_dtor_t)mpc_ast_delete);
+  check("lispy", "(join {1 2} \"open)", Lispy, (mpc_dtor_t)mpc_ast_delete);
+  check("lispy", "{1 2}}", Lispy, (mpc_dtor_t)mpc_ast_delete);
+  check("lispy", "(+ 1 2)\n(- 3 #)", Lispy, (mpc_dtor_t)mpc_ast_delete);
+
+  mpc_cleanup(8, Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
+
+  printf("%s\n", same ? "all the same" : "some differ");
+  return !same;
+}
@@ -0,0 +1,168 @@
+/*
+** Packrat parsing
+**
+** A parser wrapped with `mpc_packrat` is run once
+** at each position of an input held in memory,
+** and later attempts there are answered from the
+** memo table. Every parse must give the results
+** and errors it would without the memo table.
+*/
+
+#include "mpc.h"
+
+static int runs = 0;
+
+static mpc_val_t *count(mpc_val_t *x) {
+  runs++;
+  return x;
+}
+
+static mpc_val_t *copy(mpc_val_t *x) {
+  char *y = malloc(strlen(x) + 1);
+  strcpy(y, x);
+  return y;
+}
+
+/* Parses `s` with `p`, printing the result and how often `a` ran */
+static void parse(const char *name, const char *s, mpc_parser_t *p) {
+  mpc_result_t r;
+  runs = 0;
+  if (mpc_parse("<test>", s, p, &r)) {
+    printf("%s \"%s\": %s, runs %d\n", name, s, (char*)r.output, runs);
+    free(r.output);
+  } else {
+    printf("%s \"%s\": error, runs %d\n", name, s, runs);
+    mpc_err_print(r.error);
+    mpc_err_delete(r.error);
+  }
+}
+
+/* Parses `s` with `p` through a pipe, where the memo table isn't used */
+static void parse_pipe(const char *name, const char *s, mpc_parser_t *p) {
+  mpc_result_t r;
+  FILE *f = tmpfile();
+  fputs(s, f);
+  rewind(f);
+  runs = 0;
+  if (mpc_parse_pipe("<test>", f, p, &r)) {
+    printf("%s pipe \"%s\": %s, runs %d\n", name, s, (char*)r.output, runs);
+    free(r.output);
+  } else {
+    printf("%s pipe \"%s\": error, runs %d\n", name, s, runs);
+    mpc_err_print(r.error);
+    mpc_err_delete(r.error);
+  }
+  fclose(f);
+}
+
+/*
+** Builds `(<a> 'x' | <a> 'y')*` followed by the
+** end of input, where `a` is "a" counted each
+** time it is run, memoized if `memo` is set.
+*/
+static mpc_parser_t *twice(mpc_parser_t *a, int memo) {
+  mpc_parser_t *x = mpc_and(2, mpcf_snd,
+    mpc_apply(mpc_pass(), count), mpc_string("a"), free);
+  mpc_define(a, memo ? mpc_packrat(x, copy, free) : x);
+  return mpc_and(2, mpcf_fst,
+    mpc_many(mpcf_strfold, mpc_or(2,
+      mpc_and(2, mpcf_strfold, a, mpc_char('x'), free),
+      mpc_and(2, mpcf_strfold, a, mpc_char('y'), free))),
+    mpc_eoi(), free);
+}
+
+static void grammar(const char *s) {
+  mpc_parser_t *Expr[2], *Term[2], *Factor[2], *Top[2];
+  mpc_result_t r[2];
+  int ok[2], j;
+
+  for (j = 0; j < 2; j++) {
+    Expr[j] = mpc_new("expr");
+    Term[j] = mpc_new("term");
+    Factor[j] = mpc_new("factor");
+    Top[j] = mpc_new("top");
+    mpca_lang(j ? MPCA_LANG_PACKRAT : MPCA_LANG_DEFAULT,
+      "expr   : <term> '+' <expr> | <term> '-' <expr> | <term> ;"
+      "term   : <factor> '*' <term> | <factor> '/' <term> | <factor> ;"
+      "factor : /[0-9]+/ | '(' <expr> ')' ;"
+      "top    : /^/ <expr> (';' <expr>)* /$/ ;",
+      Expr[j], Term[j], Factor[j], Top[j], NULL);
+    ok[j] = mpc_parse("<test>", s, Top[j], &r[j]);
+  }
+
+  if (ok[0] != ok[1]) {
+    printf("grammar \"%.20s\": results differ\n", s);
+  } else if (ok[0]) {
+    printf("grammar \"%.20s\": %s\n", s,
+      mpc_ast_eq(r[0].output, r[1].output) ? "same" : "differ");
+    mpc_ast_delete(r[0].output);
+    mpc_ast_delete(r[1].output);
+  } else {
+    char *e0 = mpc_err_string(r[0].error);
+    char *e1 = mpc_err_string(r[1].error);
+    printf("grammar \"%.20s\": error %s", s, strcmp(e0, e1) ? "differs" : "same");
+    printf(": %s", e1);
+    free(e0);
+    free(e1);
+    mpc_err_delete(r[0].error);
+    mpc_err_delete(r[1].error);
+  }
+
+  for (j = 0; j < 2; j++) {
+    mpc_cleanup(4, Expr[j], Term[j], Factor[j], Top[j]);
+  }
+}
+
+int main(void) {
+  mpc_parser_t *a_plain = mpc_new("a");
+  mpc_parser_t *a_memo = mpc_new("a");
+  mpc_parser_t *plain = twice(a_plain, 0);
+  mpc_parser_t *memo = twice(a_memo, 1);
+  char *s;
+  int j;
+
+  /* The second alternative hits the memo entry the first one made */
+  parse("plain", "ay", plain);
+  parse("memo", "ay", memo);
+  parse("plain", "axayay", plain);
+  parse("memo", "axayay", memo);
+
+  /* Remembered failures are hits too */
+  parse("plain", "b", plain);
+  parse("memo", "b", memo);
+  parse("plain", "ayaz", plain);
+  parse("memo", "ayaz", memo);
+
+  /* Inputs not held in memory parse as if there were no memo table */
+  parse_pipe("memo", "axay", memo);
+  parse_pipe("memo", "ayaz", memo);
+
+  /* Inputs longer than the table replace its entries as they go */
+  s = malloc(2 * 10000 + 1);
+  for (j = 0; j < 10000; j++) { strcpy(s + 2 * j, j % 3 ? "ay" : "ax"); }
+  for (j = 0; j < 2; j++) {
+    mpc_result_t r;
+    runs = 0;
+    if (mpc_parse("<test>", s, j ? memo : plain, &r)) {
+      printf("%s long: %d bytes, runs %d\n", j ? "memo" : "plain",
+        (int)strlen(r.output), runs);
+      free(r.output);
+    } else {
+      mpc_err_print(r.error);
+      mpc_err_delete(r.error);
+    }
+  }
+  free(s);
+
+  mpc_delete(plain);
+  mpc_delete(memo);
+  mpc_cleanup(2, a_plain, a_memo);
+
+  /* Grammars with MPCA_LANG_PACKRAT */
+  grammar("1+2*3;(4-5)/6");
+  grammar("((((((1))))))*((((2))))");
+  grammar("1+(2*3");
+  grammar("1+2;;3");
+
+  return 0;
+}
@@ -0,0 +1,154 @@
+/*
+** Parser VM
+**
+** A parser compiled with `mpc_compile` must give
+** the results and errors of the parser it was
+** compiled from. Each input is parsed both ways,
+** including a few thousand generated ones, and
+** then input nested deeper than the recursive
+** parser's C stack could hold.
+*/
+
+#include "mpc.h"
+
+static int same = 1;
+
+/* Parses `s` with both parsers, returning whether the results match */
+static int differ(const char *s, mpc_parser_t *p, mpc_parser_t *vm, int print) {
+  mpc_result_t r, q;
+  int ok = mpc_parse("<test>", s, p, &r);
+  int ok_vm = mpc_parse("<test>", s, vm, &q);
+  int eq = ok == ok_vm;
+
+  if (eq && ok) {
+    eq = mpc_ast_eq(r.output, q.output);
+    if (print) {
+      printf("\"%s\": %d children\n", s, ((mpc_ast_t*)q.output)->children_num);
+    }
+  } else if (eq) {
+    char *e = mpc_err_string(r.error);
+    char *e_vm = mpc_err_string(q.error);
+    eq = strcmp(e, e_vm) == 0;
+    if (print) { printf("\"%s\": %s", s, e_vm); }
+    free(e);
+    free(e_vm);
+  }
+  if (!eq) {
+    printf("\"%s\": the parser VM differs\n", s);
+    same = 0;
+  }
+
+  if (ok) { mpc_ast_delete(r.output); } else { mpc_err_delete(r.error); }
+  if (ok_vm) { mpc_ast_delete(q.output); } else { mpc_err_delete(q.error); }
+  return !eq;
+}
+
+/* Parses `n` inputs made of pieces of santoku, returning how many differ */
+static int generated(int n, mpc_parser_t *p, mpc_parser_t *vm) {
+  static const char *pieces[] = {
+    "(", ")", "{", "}", " ", "1", "-2", "ab", "+", "\"s\"", "\"", "\\", "#"
+  };
+  unsigned long seed = 1;
+  char s[64];
+  int j, k, len, bad = 0;
+
+  for (j = 0; j < n; j++) {
+    s[0] = '\0';
+    seed = seed * 1103515245 + 12345;
+    len = (int)((seed >> 16) % 12);
+    for (k = 0; k < len; k++) {
+      seed = seed * 1103515245 + 12345;
+      strcat(s, pieces[(seed >> 16) % (sizeof(pieces) / sizeof(pieces[0]))]);
+    }
+    bad += differ(s, p, vm, 0);
+  }
+  return bad;
+}
+
+/* Parses a number nested in `depth` parentheses with `p` */
+static void deep(int depth, mpc_parser_t *p) {
+  char *s = malloc((size_t)depth * 2 + 2);
+  mpc_result_t r;
+  mpc_ast_t *a;
+  int j, n = 0;
+
+  for (j = 0; j < depth; j++) { s[n++] = '('; }
+  s[n++] = '1';
+  for (j = 0; j < depth; j++) { s[n++] = ')'; }
+  s[n] = '\0';
+
+  if (mpc_parse("<test>", s, p, &r)) {
+    /* Walk down to the number, counting the levels of parentheses */
+    a = r.output;
+    n = 0;
+    while (a->children_num > 1) {
+      n += strcmp(a->children[0]->contents, "(") == 0;
+      a = a->children[a->children_num > 2 ? 1 : 0];
+    }
+    printf("depth %d: parsed, %d levels, \"%s\"\n", depth, n, a->contents);
+    mpc_ast_delete(r.output);
+  } else {
+    mpc_err_print(r.error);
+    mpc_err_delete(r.error);
+  }
+  free(s);
+}
+
+int main(void) {
+  mpc_parser_t *Number = mpc_new("number");
+  mpc_parser_t *Symbol = mpc_new("symbol");
+  mpc_parser_t *String = mpc_new("string");
+  mpc_parser_t *Sexpr = mpc_new("sexpr");
+  mpc_parser_t *Qexpr = mpc_new("qexpr");
+  mpc_parser_t *Expr = mpc_new("expr");
+  mpc_parser_t *Lispy = mpc_new("lispy");
+  mpc_parser_t *Word = mpc_new("word");
+  mpc_parser_t *Line = mpc_new("line");
+  mpc_parser_t *vm;
+
+  mpca_lang(MPCA_LANG_DEFAULT,
+    "number : /-?[0-9]+/ ;"
+    "symbol : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;"
+    "string : /\"(\\\\.|[^\"])*\"/ ;"
+    "sexpr  : '(' <expr>* ')' ;"
+    "qexpr  : '{' <expr>* '}' ;"
+    "expr   : <number> | <symbol> | <string> | <sexpr> | <qexpr> ;"
+    "lispy  : /^/ <expr>* /$/ ;",
+    Number, Symbol, String, Sexpr, Qexpr, Expr, Lispy, NULL);
+
+  /* Optional, repeated, counted and negated parts */
+  mpca_lang(MPCA_LANG_DEFAULT,
+    "word : (\"ab\" | 'a')+ 'c'? ;"
+    "line : /^/ <word> (',' <word>){2} (';' !'x' /[a-z]/)* /$/ ;",
+    Word, Line, NULL);
+
+  vm = mpc_compile(Lispy);
+  differ("(+ 1 2)", Lispy, vm, 1);
+  differ("{a {b \"c\"}} (-3)", Lispy, vm, 1);
+  differ("", Lispy, vm, 1);
+  differ("(+ 1 (* 2", Lispy, vm, 1);
+  differ("{1 2}}", Lispy, vm, 1);
+  differ("(\"open)", Lispy, vm, 1);
+  differ("(a #)", Lispy, vm, 1);
+  printf("generated: %d differ\n", generated(5000, Lispy, vm));
+  mpc_delete(vm);
+
+  vm = mpc_compile(Line);
+  differ("ab,a,abc", Line, vm, 1);
+  differ("abc,a,ac;b;c", Line, vm, 1);
+  differ("ab,a", Line, vm, 1);
+  differ("ab,a,a;x", Line, vm, 1);
+  differ("ab,a,a;", Line, vm, 1);
+  differ("aab,ba,a", Line, vm, 1);
+  mpc_delete(vm);
+
+  /* The recursive parser would run out of C stack */
+  vm = mpc_compile(Lispy);
+  deep(100000, vm);
+  mpc_delete(vm);
+
+  mpc_cleanup(9, Number, Symbol, String, Sexpr, Qexpr, Expr, Lispy, Word, Line);
+
+  printf("%s\n", same ? "all the same" : "some differ");
+  return !same;
+}
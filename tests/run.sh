@@ -0,0 +1,61 @@
+#!/bin/sh
+#
+# Run the regression tests
+#
+# Each tests/NAME.lspy is run with both the bytecode VM and the tree walking
+# evaluator, and must print exactly what tests/NAME.out holds. Programs too
+# large to keep in the tree are printed by a script, tests/NAME.gen, instead.
+# Each tests/NAME.c tests the parser library, and is built with src/mpc.c and
+# run the same way. The tests nesting code deeply are sized for the usual 8MB
+# C stack.
+#
+# Usage: tests/run.sh [path/to/santoku]
+
+SANTOKU=${1:-build/santoku}
+CC=${CC:-cc}
+DIR=$(dirname "$0")
+SRC=$DIR/../src
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+ulimit -s 8192 2> /dev/null
+
+failed=0
+for test in "$DIR"/*.lspy "$DIR"/*.gen; do
+    [ -e "$test" ] || continue
+    name=$(basename "${test%.*}")
+    if [ "${test##*.}" = gen ]; then
+        sh "$test" > "$TMP/$name.lspy"
+        test=$TMP/$name.lspy
+    fi
+    for mode in "" --tree; do
+        "$SANTOKU" $mode "$test" > "$TMP/out" 2>&1
+        if cmp -s "$TMP/out" "$DIR/$name.out"; then
+            echo "pass  $name $mode"
+        else
+            echo "FAIL  $name $mode"
+            diff "$DIR/$name.out" "$TMP/out" | head -20
+            failed=1
+        fi
+    done
+done
+
+for test in "$DIR"/*.c; do
+    [ -e "$test" ] || continue
+    name=$(basename "${test%.*}")
+    if ! "$CC" $CFLAGS -I"$SRC" "$test" "$SRC/mpc.c" -lm -o "$TMP/$name"; then
+        echo "FAIL  $name (build)"
+        failed=1
+        continue
+    fi
+    "$TMP/$name" > "$TMP/out" 2>&1
+    if cmp -s "$TMP/out" "$DIR/$name.out"; then
+        echo "pass  $name"
+    else
+        echo "FAIL  $name"
+        diff "$DIR/$name.out" "$TMP/out" | head -20
+        failed=1
+    fi
+done
+exit $failed